@@ -96,7 +96,8 @@ and watermark_f.c the front end.</p>
 <p>This module is responsible for the creation of the flippability score lookup table based on 3x3 patterns. This data structure encapsulates almost exclusively the information
 that defines the quality of the embedding process. The values are calculated based on 5 statically defined criteria
 and consequently the table is saved to a file with the name flippalut.data in the form of a raw array of floats. The table is cached to the disk because it's values are context
-independant(same for all images) thus we can avoid creating it everytime we run the program. The correlation between table indices and actual image patterns, is illustrated below.</p>
+independant(same for all images) thus we can avoid creating it everytime we run the program. The 3x3 table is also generated at build time by <em>mklut</em> and linked into the binary (flippalut3.c), so embedding
+never reads flippalut.data; the disk cache is only used for other pattern sizes. The correlation between table indices and actual image patterns, is illustrated below.</p>
 
 <p><img src="images/flippability.svg" alt="Table-pattern correlation" title="Table-pattern correlation" /></p>
 
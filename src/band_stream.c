@@ -0,0 +1,153 @@
+/**
+*\file band_stream.c
+*This module embeds/extracts the SHUFFLE_BANDED layout reading and
+*writing raw pbm files one band at a time. Only the tallest band
+*and its two context rows are ever in memory, whatever the height
+*of the image.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pbm.h>
+#include "bin_watermarking.h"
+#include "score_map.h"
+#include "pbm_io.h"
+#include "band_stream.h"
+
+/**
+*Embeds the payload in the raw pbm in and writes the result with
+*its trailer to out. The image is the one embed_opt gives with
+*SHUFFLE_BANDED and the same neighborhood.
+*\returns WM_OK or one of the WM_E* error codes. On failure out
+*is removed.
+*/
+int embed_stream(const char *in, const char *out, const void *payload,
+        size_t bytes, unsigned int seed, int neighborhood) {
+    FILE *fr, *fw;
+    struct band_layout bl;
+    struct image buf, view;
+    struct score_map map;
+    struct wm_trailer tr;
+    int cols, rows, band, top, bottom, vtop, vbottom, loaded, status;
+    int radius, vtop_next, *scratch;
+    //INIT
+    memset(&map, 0, sizeof(map));
+    if (score_map_use(&map, neighborhood) != 0)
+        return WM_ENOLUT;
+    radius = band_halo(&map);
+    fr = fopen(in, "rb");
+    if (fr == NULL)
+        return WM_EIO;
+    if (pbm_read_header(fr, &cols, &rows) != 0) {
+        fclose(fr);
+        return WM_EIO;
+    }
+    if (band_layout_init(&bl, cols, rows, bytes, seed) != 0) {
+        fclose(fr);
+        return WM_EINVAL;
+    }
+    fw = fopen(out, "wb");
+    if (fw == NULL) {
+        fclose(fr);
+        return WM_EIO;
+    }
+    scratch = (int *)malloc(bl.window * sizeof(int));
+    if (scratch == NULL || image_alloc(&buf, cols, band_max_rows(&bl) + 2 * radius) != 0) {
+        free(scratch);
+        fclose(fr);
+        fclose(fw);
+        remove(out);
+        return WM_ENOMEM;
+    }
+    //PROCESS
+    status = pbm_write_header(fw, cols, rows) == 0 ? WM_OK : WM_EIO;
+    //buf holds the image rows [vtop, loaded) from its first row
+    loaded = 0;
+    for (band = 0; band < bl.nbands && status == WM_OK; band++) {
+        band_rows(&bl, band, &top, &bottom);
+        vtop = top > radius ? top - radius : 0;
+        vbottom = rows - bottom > radius ? bottom + radius : rows;
+        if (pbm_read_rows(fr, buf, loaded - vtop, vbottom - loaded) != 0) {
+            status = WM_EIO;
+            break;
+        }
+        loaded = vbottom;
+        view = buf;
+        view.rows = vbottom - vtop;
+        status = embed_band(view, top - vtop, &bl, band, payload, &map, scratch);
+        if (status != WM_OK)
+            break;
+        if (pbm_write_rows(fw, buf, top - vtop, bottom - top) != 0) {
+            status = WM_EIO;
+            break;
+        }
+        //the context rows of the next band carry over
+        vtop_next = bottom > radius ? bottom - radius : 0;
+        memmove(buf.words, image_row(buf, vtop_next - vtop),
+                (size_t)(loaded - vtop_next) * buf.stride * sizeof(uint64_t));
+    }
+    if (status == WM_OK) {
+        tr.length = bytes;
+        tr.mode = SHUFFLE_BANDED;
+        if (pbm_write_trailer(fw, &tr) != 0)
+            status = WM_EIO;
+    }
+    //FREE
+    score_map_free(&map);
+    image_free(&buf);
+    free(scratch);
+    fclose(fr);
+    if (fclose(fw) != 0 && status == WM_OK)
+        status = WM_EIO;
+    if (status != WM_OK)
+        remove(out);
+    return status;
+}
+
+/**
+*Extracts a SHUFFLE_BANDED payload from the raw pbm in.
+*\returns WM_OK or one of the WM_E* error codes.
+*/
+int extract_stream(const char *in, void *payload, size_t bytes,
+        unsigned int seed) {
+    FILE *fr;
+    struct band_layout bl;
+    struct image buf;
+    int cols, rows, band, top, bottom, status, *scratch;
+    //INIT
+    fr = fopen(in, "rb");
+    if (fr == NULL)
+        return WM_EIO;
+    if (pbm_read_header(fr, &cols, &rows) != 0) {
+        fclose(fr);
+        return WM_EIO;
+    }
+    if (band_layout_init(&bl, cols, rows, bytes, seed) != 0) {
+        fclose(fr);
+        return WM_EINVAL;
+    }
+    scratch = (int *)malloc(bl.window * sizeof(int));
+    if (scratch == NULL || image_alloc(&buf, cols, band_max_rows(&bl)) != 0) {
+        free(scratch);
+        fclose(fr);
+        return WM_ENOMEM;
+    }
+    //PROCESS
+    memset(payload, 0, bytes);
+    status = WM_OK;
+    for (band = 0; band < bl.nbands && status == WM_OK; band++) {
+        band_rows(&bl, band, &top, &bottom);
+        if (pbm_read_rows(fr, buf, 0, bottom - top) != 0) {
+            status = WM_EIO;
+            break;
+        }
+        buf.rows = bottom - top;
+        status = extract_band(buf, &bl, band, payload, scratch);
+    }
+    //FREE
+    image_free(&buf);
+    free(scratch);
+    fclose(fr);
+    return status;
+}
@@ -0,0 +1,11 @@
+#ifndef BAND_STREAM_H
+#define BAND_STREAM_H 1
+
+#include <stddef.h>
+
+int embed_stream(const char *in, const char *out, const void *payload,
+        size_t bytes, unsigned int seed, int neighborhood);
+int extract_stream(const char *in, void *payload, size_t bytes,
+        unsigned int seed);
+
+#endif
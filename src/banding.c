@@ -0,0 +1,81 @@
+/**
+*\file banding.c
+*This module describes the SHUFFLE_BANDED layout, which confines
+*every window to a band of rows so that an image can be processed
+*one band at a time in bounded memory.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include "banding.h"
+
+/**
+*Lays out a payload of the given size over a cols x rows image.
+*\returns 0 on success, -1 if the payload is empty or some band has
+*less than one pixel per payload bit.
+*/
+int band_layout_init(struct band_layout *bl, int cols, int rows,
+        size_t bytes, unsigned int seed) {
+    long per_band;
+    bl->cols = cols;
+    bl->rows = rows;
+    bl->seed = seed;
+    bl->bits = 8 * (long)bytes;
+    if (cols <= 0 || rows <= 0 || bytes == 0)
+        return -1;
+    bl->nbands = (rows + BAND_ROWS - 1) / BAND_ROWS;
+    //the fullest band holds ceil(bits / nbands) windows, the shortest rows / nbands rows
+    per_band = (bl->bits + bl->nbands - 1) / bl->nbands;
+    bl->window = (int)(((long)cols * (rows / bl->nbands)) / per_band);
+    return bl->window > 0 ? 0 : -1;
+}
+
+/**
+*The rows [top, bottom) of a band.
+*/
+void band_rows(const struct band_layout *bl, int band, int *top, int *bottom) {
+    *top = (int)((long)band * bl->rows / bl->nbands);
+    *bottom = (int)((long)(band + 1) * bl->rows / bl->nbands);
+}
+
+/**
+*The number of payload bits, windows, embedded in a band.
+*/
+long band_bits(const struct band_layout *bl, int band) {
+    return bl->bits / bl->nbands + (band < bl->bits % bl->nbands);
+}
+
+/**
+*The height of the tallest band.
+*/
+int band_max_rows(const struct band_layout *bl) {
+    return (bl->rows + bl->nbands - 1) / bl->nbands;
+}
+
+/**
+*Opens the keyed shuffle of the pixels of a band. Every band has
+*its own key, derived from the seed and the band index, and needs
+*no memory past the round keys.
+*\returns 0 on success, -1 on failure.
+*/
+int band_open(const struct band_layout *bl, int band, struct shuffle *sh) {
+    int top, bottom;
+    band_rows(bl, band, &top, &bottom);
+    return shuffle_open(sh, bl->cols * (bottom - top),
+            bl->seed ^ ((unsigned int)band * 0x9e3779b9U), SHUFFLE_FEISTEL);
+}
+
+/**
+*Computes the k-th window of a band into scratch.
+*\param[in] offset Added to every position, the first pixel of
+*the band in the image the caller indexes.
+*\returns scratch, bl->window positions.
+*/
+const int *band_window(const struct band_layout *bl, const struct shuffle *sh,
+        long k, int offset, int *scratch) {
+    int i;
+    int first = (int)(k * bl->window);
+    for (i = 0; i < bl->window; i++)
+        scratch[i] = shuffle_at(sh, first + i) + offset;
+    return scratch;
+}
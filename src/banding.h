@@ -0,0 +1,33 @@
+#ifndef BANDING_H
+#define BANDING_H 1
+
+#include <stddef.h>
+#include "shuffling.h"
+
+#define BAND_ROWS 256 //the height of a band, the rows are split evenly
+
+/**
+*The SHUFFLE_BANDED layout. The rows are split in nbands bands of
+*(nearly) equal height and every band is shuffled on its own, so
+*a window never leaves its band. The payload bit i is embedded in
+*band i % nbands, as the (i / nbands)-th window of the band.
+*/
+struct band_layout {
+    int cols;
+    int rows;
+    int nbands;
+    int window; //the pixels of every window, the same in all bands
+    long bits;
+    unsigned int seed;
+};
+
+int band_layout_init(struct band_layout *bl, int cols, int rows,
+        size_t bytes, unsigned int seed);
+void band_rows(const struct band_layout *bl, int band, int *top, int *bottom);
+long band_bits(const struct band_layout *bl, int band);
+int band_max_rows(const struct band_layout *bl);
+int band_open(const struct band_layout *bl, int band, struct shuffle *sh);
+const int *band_window(const struct band_layout *bl, const struct shuffle *sh,
+        long k, int offset, int *scratch);
+
+#endif
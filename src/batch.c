@@ -0,0 +1,495 @@
+/**
+*\file batch.c
+*This module processes a manifest of watermarking/authentication
+*jobs on a pool of threads. The workers share the shuffles, so every
+*image size is generated once per run: the pages of a size get their
+*header in the strip of the first one whenever they can, which leaves
+*them the same payload rows. They take work from each
+*other when they run out of their own. A failed item is reported
+*and the batch goes on.
+*
+*Every line of the manifest is one item, blank lines and lines
+*starting with # are skipped.
+*   w <input.pbm> <output.pbm> <payload> compresses the payload file
+*     and embeds it in input, the result is saved to output.
+*   a <input.pbm> <payload> extracts and uncompresses the payload of
+*     a watermarked image into the payload file.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <pbm.h>
+#include <zlib.h>
+#include "shuffle_cache.h"
+#include "capacity.h"
+#include "wm_header.h"
+#include "inflate_sink.h"
+#include "pbm_io.h"
+#include "file_io.h"
+#include "profile.h"
+#include "batch.h"
+
+#define MAX_PATH 4096
+
+struct batch_item {
+    int line;
+    char op;
+    char input[MAX_PATH];
+    char output[MAX_PATH];
+    char payload[MAX_PATH];
+    const char *error; //NULL on success
+    char message[128]; //room for the errors that carry numbers
+    double seconds;
+};
+
+/**
+*A shuffle opened by the first worker that needs it and
+*shared read-only by all the others, the one of the payload rows of
+*the pages of cols x rows pixels whose header strip ends at strip.
+*/
+struct shared_shuffle {
+    int cols;
+    int rows;
+    int strip;
+    enum shuffle_mode mode;
+    int status;
+    int ready;
+    pthread_mutex_t lock;
+    struct shuffle sh;
+    struct shared_shuffle *next;
+};
+
+/**
+*The work of one thread. The owner takes from the bottom, the
+*thieves from the top.
+*/
+struct deque {
+    pthread_mutex_t lock;
+    int *items;
+    int top;
+    int bottom;
+};
+
+struct batch {
+    struct batch_item *items;
+    int n_items;
+    struct deque *queues;
+    int n_queues;
+    const struct wm_options *opt;
+    pthread_mutex_t shuffles_lock;
+    struct shared_shuffle *shuffles;
+};
+
+struct worker {
+    pthread_t thread;
+    struct batch *batch;
+    int id;
+    int started;
+};
+
+int parse_manifest(const char *path, struct batch_item **items);
+void *batch_worker(void *arg);
+int next_item(struct batch *b, int id);
+void process_item(struct batch *b, struct batch_item *it);
+const char *watermark_item(struct batch *b, struct batch_item *it);
+const char *authenticate_item(struct batch *b, struct batch_item *it);
+int size_strip(struct batch *b, struct image img, enum shuffle_mode mode);
+const struct shuffle *get_shuffle(struct batch *b, struct image img,
+        int strip, enum shuffle_mode mode);
+int compare_doubles(const void *l, const void *r);
+
+/**
+*Runs every item of the manifest and reports the failed ones on
+*stderr and the throughput and latency on stdout.
+*\param[in] manifest The path of the manifest.
+*\param[in] opt The options, threads is ignored since every item
+*is processed by a single thread.
+*\param[in] threads The size of the pool, <= 0 means one per online cpu.
+*\returns The number of failed items, -1 if the manifest could not be read.
+*/
+int run_batch(const char *manifest, const struct wm_options *opt, int threads) {
+    struct batch b;
+    struct worker *workers;
+    struct shared_shuffle *s, *next;
+    double start, wall, *latency;
+    int i, t, failed = 0;
+    b.n_items = parse_manifest(manifest, &b.items);
+    if (b.n_items < 0)
+        return -1;
+    if (threads <= 0)
+        threads = (int)sysconf(_SC_NPROCESSORS_ONLN);
+    if (threads < 1)
+        threads = 1;
+    if (threads > b.n_items && b.n_items > 0)
+        threads = b.n_items;
+    b.opt = opt;
+    b.shuffles = NULL;
+    pthread_mutex_init(&b.shuffles_lock, NULL);
+    b.n_queues = threads;
+    b.queues = (struct deque *)calloc(threads, sizeof(struct deque));
+    workers = (struct worker *)calloc(threads, sizeof(struct worker));
+    latency = (double *)calloc(b.n_items + 1, sizeof(double));
+    if (b.queues == NULL || workers == NULL || latency == NULL) {
+        free(b.queues);
+        free(workers);
+        free(latency);
+        free(b.items);
+        return -1;
+    }
+    //deal the items round robin, stealing evens out the rest
+    for (t = 0; t < threads; t++) {
+        pthread_mutex_init(&b.queues[t].lock, NULL);
+        b.queues[t].items = (int *)calloc(b.n_items / threads + 1, sizeof(int));
+        b.queues[t].top = b.queues[t].bottom = 0;
+    }
+    for (i = 0; i < b.n_items; i++) {
+        t = i % threads;
+        b.queues[t].items[b.queues[t].bottom++] = i;
+    }
+    start = clock_seconds();
+    for (t = 0; t < threads; t++) {
+        workers[t].batch = &b;
+        workers[t].id = t;
+    }
+    for (t = 1; t < threads; t++) {
+        workers[t].started = pthread_create(&workers[t].thread, NULL,
+                batch_worker, workers + t) == 0;
+    }
+    batch_worker(workers);
+    for (t = 1; t < threads; t++) {
+        if (workers[t].started)
+            pthread_join(workers[t].thread, NULL);
+    }
+    wall = clock_seconds() - start;
+    //REPORT
+    for (i = 0; i < b.n_items; i++) {
+        latency[i] = b.items[i].seconds;
+        if (b.items[i].error != NULL) {
+            fprintf(stderr, "%s:%d: %s: %s\n", manifest, b.items[i].line,
+                    b.items[i].input, b.items[i].error);
+            failed++;
+        }
+    }
+    qsort(latency, b.n_items, sizeof(double), compare_doubles);
+    printf("batch: %d items, %d failed, %d threads, %.3f s, %.2f images/s, "
+            "p50 %.2f ms, p99 %.2f ms\n", b.n_items, failed, threads, wall,
+            wall > 0.0 ? b.n_items / wall : 0.0,
+            1000.0 * latency[b.n_items / 2],
+            1000.0 * latency[b.n_items > 0 ? (b.n_items * 99 - 1) / 100 : 0]);
+    //FREE
+    for (s = b.shuffles; s != NULL; s = next) {
+        next = s->next;
+        if (s->ready && s->status == 0)
+            shuffle_close(&s->sh);
+        pthread_mutex_destroy(&s->lock);
+        free(s);
+    }
+    for (t = 0; t < threads; t++) {
+        pthread_mutex_destroy(&b.queues[t].lock);
+        free(b.queues[t].items);
+    }
+    pthread_mutex_destroy(&b.shuffles_lock);
+    free(b.queues);
+    free(workers);
+    free(latency);
+    free(b.items);
+    return failed;
+}
+
+void *batch_worker(void *arg) {
+    struct worker *w = (struct worker *)arg;
+    int idx;
+    while ((idx = next_item(w->batch, w->id)) >= 0)
+        process_item(w->batch, w->batch->items + idx);
+    if (w->id != 0)
+        PROF_THREAD_END();
+    return NULL;
+}
+
+/**
+*Pops the next item of the worker's own queue, or steals the
+*oldest item of another queue when its own is empty. No item is
+*ever added after the start, so nothing left to steal means done.
+*\returns The index of the item, -1 when the batch is finished.
+*/
+int next_item(struct batch *b, int id) {
+    struct deque *q;
+    int k, idx = -1;
+    q = b->queues + id;
+    pthread_mutex_lock(&q->lock);
+    if (q->bottom > q->top)
+        idx = q->items[--q->bottom];
+    pthread_mutex_unlock(&q->lock);
+    for (k = 1; idx < 0 && k < b->n_queues; k++) {
+        q = b->queues + (id + k) % b->n_queues;
+        pthread_mutex_lock(&q->lock);
+        if (q->bottom > q->top)
+            idx = q->items[q->top++];
+        pthread_mutex_unlock(&q->lock);
+    }
+    return idx;
+}
+
+void process_item(struct batch *b, struct batch_item *it) {
+    double start = clock_seconds();
+    if (it->error == NULL) {
+        if (it->op == 'w')
+            it->error = watermark_item(b, it);
+        else
+            it->error = authenticate_item(b, it);
+    }
+    it->seconds = clock_seconds() - start;
+    PROF_REPORT(it->input);
+}
+
+const char *watermark_item(struct batch *b, struct batch_item *it) {
+    unsigned char *payload;
+    Bytef *zipped;
+    uLongf zipped_len;
+    size_t len;
+    struct image img, top, rest;
+    struct wm_header h;
+    struct capacity_report rep;
+    const struct shuffle *sh;
+    int strip, status;
+    payload = read_file(it->payload, &len);
+    if (payload == NULL)
+        return "cannot read the payload";
+    zipped_len = compressBound(len);
+    zipped = (Bytef *)malloc(zipped_len);
+    if (zipped == NULL ||
+        compress(zipped, &zipped_len, payload, len) != Z_OK) {
+        free(zipped);
+        free(payload);
+        return "cannot compress the payload";
+    }
+    free(payload);
+    if (pbm_load(it->input, &img, NULL) != 0) {
+        free(zipped);
+        return "cannot read the image";
+    }
+    //the header goes first, its strip decides where the payload rows start
+    header_init(&h, zipped, zipped_len, len, b->opt);
+    strip = size_strip(b, img, b->opt->shuffle);
+    status = WM_ECAPACITY;
+    if (strip > 0)
+        status = embed_header_at(img, &h, b->opt, strip);
+    if (status == WM_ECAPACITY)
+        status = embed_header(img, &h, b->opt);
+    if (status != WM_OK) {
+        free(zipped);
+        image_free(&img);
+        return status == WM_EINVAL ? "the image is too small for a header" :
+            wm_strerror(status);
+    }
+    header_split(img, &h, &top, &rest);
+    //the dry run rejects what embed would half write, at extract cost
+    if (b->opt->shuffle == SHUFFLE_BANDED) {
+        //the bands derive their keys on the fly, nothing to share
+        sh = NULL;
+        status = analyze_capacity(rest, zipped_len, zipped, b->opt, &rep);
+    } else {
+        sh = get_shuffle(b, img, h.rows, b->opt->shuffle);
+        status = sh == NULL ? WM_ENOMEM :
+            analyze_capacity_shuffled(rest, zipped_len, zipped, sh, &rep);
+    }
+    if (status == WM_OK && !rep.go) {
+        free(zipped);
+        image_free(&img);
+        snprintf(it->message, sizeof(it->message),
+                "the payload of %lu bytes does not fit, at most %lu do",
+                (unsigned long)zipped_len, (unsigned long)rep.max_safe_bytes);
+        return it->message;
+    }
+    if (status == WM_OK) {
+        if (sh == NULL)
+            status = embed_opt(rest, zipped, zipped_len, b->opt);
+        else
+            status = embed_scored(rest, zipped, zipped_len, sh,
+                    b->opt->neighborhood);
+    }
+    free(zipped);
+    if (status == WM_OK && pbm_save(it->output, img, NULL) != 0) {
+        image_free(&img);
+        return "cannot write the image";
+    }
+    image_free(&img);
+    return status == WM_OK ? NULL : wm_strerror(status);
+}
+
+const char *authenticate_item(struct batch *b, struct batch_item *it) {
+    struct image img, view, top;
+    struct wm_trailer tr;
+    struct wm_header h;
+    struct wm_options opt;
+    struct inflate_sink sink;
+    const struct shuffle *sh;
+    unsigned char *dest;
+    size_t d_len, hint = 0;
+    long length;
+    int status, framed;
+    if (pbm_load(it->input, &img, &tr) != 0)
+        return "cannot read the image";
+    opt = *b->opt;
+    opt.threads = 1;
+    //an unmarked image is rejected by its header rows alone
+    framed = read_header(img, &opt, &h) == WM_OK;
+    if (framed) {
+        header_split(img, &h, &top, &view);
+        length = h.length;
+        opt.shuffle = h.mode;
+        hint = h.raw_length;
+    } else if (tr.length > 0) {
+        //a mode no generator has is a bad trailer, not a lack of memory
+        if (tr.mode < SHUFFLE_FLOYD || tr.mode > SHUFFLE_BANDED) {
+            image_free(&img);
+            return "the trailer has an unknown shuffle mode";
+        }
+        view = img;
+        length = tr.length;
+        opt.shuffle = (enum shuffle_mode)tr.mode;
+    } else {
+        image_free(&img);
+        return "no watermark";
+    }
+    sh = NULL;
+    if (opt.shuffle != SHUFFLE_BANDED)
+        sh = get_shuffle(b, img, img.rows - view.rows, opt.shuffle);
+    if ((sh == NULL && opt.shuffle != SHUFFLE_BANDED) ||
+        inflate_sink_init(&sink, hint) != WM_OK) {
+        image_free(&img);
+        return wm_strerror(WM_ENOMEM);
+    }
+    //the payload is inflated as it is extracted, a corrupt one stops early
+    if (sh == NULL)
+        status = extract_each(view, length, &opt, inflate_sink_write, &sink);
+    else
+        status = extract_each_shuffled(view, length, sh, 1,
+                inflate_sink_write, &sink);
+    image_free(&img);
+    if (status == WM_OK && framed && (uint32_t)sink.crc != h.crc)
+        status = WM_ECHECKSUM;
+    if (status != WM_OK) {
+        inflate_sink_free(&sink);
+        return wm_strerror(status);
+    }
+    if (inflate_sink_finish(&sink, &dest, &d_len) != WM_OK)
+        return "corrupt payload";
+    status = write_file(it->payload, dest, d_len);
+    free(dest);
+    return status == 0 ? NULL : "cannot write the payload";
+}
+
+/**
+*Returns the header strip of the first page of the size of img, 0 if
+*there is none yet.
+*/
+int size_strip(struct batch *b, struct image img, enum shuffle_mode mode) {
+    struct shared_shuffle *s;
+    int strip = 0;
+    pthread_mutex_lock(&b->shuffles_lock);
+    //the list grows at its head, the first page is the last of its size
+    for (s = b->shuffles; s != NULL; s = s->next) {
+        if (s->cols == img.cols && s->rows == img.rows && s->mode == mode)
+            strip = s->strip;
+    }
+    pthread_mutex_unlock(&b->shuffles_lock);
+    return strip;
+}
+
+/**
+*Returns the shuffle of the payload rows of the pages of the size of
+*img with a header strip of strip rows, opening it on first use.
+*Concurrent callers of the same layout wait for the first one, the
+*others go on.
+*/
+const struct shuffle *get_shuffle(struct batch *b, struct image img,
+        int strip, enum shuffle_mode mode) {
+    struct shared_shuffle *s;
+    const struct wm_options *opt = b->opt;
+    int pix_N = img.cols * (img.rows - strip);
+    pthread_mutex_lock(&b->shuffles_lock);
+    for (s = b->shuffles; s != NULL; s = s->next) {
+        if (s->cols == img.cols && s->rows == img.rows &&
+            s->strip == strip && s->mode == mode)
+            break;
+    }
+    if (s == NULL) {
+        s = (struct shared_shuffle *)calloc(1, sizeof(struct shared_shuffle));
+        if (s == NULL) {
+            pthread_mutex_unlock(&b->shuffles_lock);
+            return NULL;
+        }
+        s->cols = img.cols;
+        s->rows = img.rows;
+        s->strip = strip;
+        s->mode = mode;
+        pthread_mutex_init(&s->lock, NULL);
+        s->next = b->shuffles;
+        b->shuffles = s;
+    }
+    pthread_mutex_unlock(&b->shuffles_lock);
+    pthread_mutex_lock(&s->lock);
+    if (!s->ready) {
+        s->status = shuffle_open_cached(&s->sh, pix_N, opt->seed, mode,
+                opt->cache_dir, opt->cache_limit);
+        s->ready = 1;
+    }
+    pthread_mutex_unlock(&s->lock);
+    return s->status == 0 ? &s->sh : NULL;
+}
+
+/**
+*Reads the manifest, the malformed lines become failed items.
+*\returns The number of items or -1 if the file could not be read.
+*/
+int parse_manifest(const char *path, struct batch_item **items) {
+    FILE *f;
+    char line[3 * MAX_PATH + 16], op[2];
+    struct batch_item *all = NULL, *grown, *it;
+    int n = 0, cap = 0, lineno = 0, fields;
+    f = fopen(path, "r");
+    if (f == NULL)
+        return -1;
+    while (fgets(line, sizeof(line), f) != NULL) {
+        lineno++;
+        if (line[strspn(line, " \t\r\n")] == '\0' || line[0] == '#')
+            continue;
+        if (n == cap) {
+            cap = cap ? 2 * cap : 64;
+            grown = (struct batch_item *)realloc(all, cap * sizeof(*all));
+            if (grown == NULL) {
+                free(all);
+                fclose(f);
+                return -1;
+            }
+            all = grown;
+        }
+        it = all + n++;
+        memset(it, 0, sizeof(*it));
+        it->line = lineno;
+        fields = sscanf(line, "%1s %4095s %4095s %4095s", op, it->input,
+                it->output, it->payload);
+        it->op = op[0];
+        if (fields == 4 && it->op == 'w') {
+            continue;
+        } else if (fields == 3 && it->op == 'a') {
+            //the second path of an authentication is its payload
+            memcpy(it->payload, it->output, sizeof(it->payload));
+            it->output[0] = '\0';
+        } else {
+            it->error = "malformed manifest line";
+        }
+    }
+    fclose(f);
+    *items = all;
+    return n;
+}
+
+int compare_doubles(const void *l, const void *r) {
+    double ll = *(const double *)l, rr = *(const double *)r;
+    return (ll > rr) - (ll < rr);
+}
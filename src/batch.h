@@ -0,0 +1,8 @@
+#ifndef BATCH_H
+#define BATCH_H 1
+
+#include "bin_watermarking.h"
+
+int run_batch(const char *manifest, const struct wm_options *opt, int threads);
+
+#endif
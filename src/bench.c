@@ -0,0 +1,465 @@
+/**
+*\file bench.c
+*The benchmark. It generates deterministic synthetic pages (text,
+*halftone and line art) of the requested sizes, times every phase
+*of a watermarking round trip separately and checks the watermarked
+*images against the golden hashes of bench_golden.txt, so a speed-up
+*is accepted only if it is bit-exact.
+*
+*   bench [-m mp,mp,...] [-c corpus] [-s mode] [-g golden] [-u] [-o]
+*
+*-m the page sizes in megapixels (1,4,16 by default, up to 500),
+*-c only one corpus (text, halftone or lineart), -s the shuffle mode,
+*-g the golden file and -u to record the current hashes in it. -o
+*keeps the windows of the materialized shuffles in shuffle order
+*instead of sorting them (shuffle_sort_windows), to measure the
+*gathers both ways.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <math.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#include <pbm.h>
+#include "flippability.h"
+#include "shuffling.h"
+#include "bin_watermarking.h"
+#include "profile.h"
+
+#define MAX_GOLDEN 256
+#define BENCH_WINDOW 512 //pixels per payload bit of the benchmark payloads
+
+struct golden {
+    char corpus[16];
+    int mp;
+    int mode;
+    uint64_t hash;
+};
+
+struct corpus {
+    const char *name;
+    void (*generate)(struct image img, uint64_t *rng);
+};
+
+void gen_text(struct image img, uint64_t *rng);
+void gen_halftone(struct image img, uint64_t *rng);
+void gen_lineart(struct image img, uint64_t *rng);
+int run_one(const struct corpus *cp, int mp, enum shuffle_mode mode,
+        int sorted, struct golden *table, int *n_golden, int update);
+int load_golden(const char *path, struct golden *table);
+int save_golden(const char *path, const struct golden *table, int n);
+uint64_t image_hash(struct image img);
+uint64_t next_rand(uint64_t *state);
+long peak_rss_kb(void);
+
+static const struct corpus corpora[] = {
+    {"text", gen_text},
+    {"halftone", gen_halftone},
+    {"lineart", gen_lineart}
+};
+
+int main(int argc, char **argv) {
+    int opt, i, k, n_golden, failed = 0, update = 0, sorted = 1, n_mp = 0;
+    int mp[32];
+    char sizes[256] = "1,4,16", *tok;
+    const char *only = NULL, *golden_path = "bench_golden.txt";
+    enum shuffle_mode mode = SHUFFLE_FLOYD;
+    struct golden *table;
+    float lut[1 << (3 * 3)];
+    double t0;
+    while ((opt = getopt(argc, argv, "m:c:s:g:uo")) != -1) {
+        switch (opt) {
+        case 'm':
+            snprintf(sizes, sizeof(sizes), "%s", optarg);
+            break;
+        case 'c':
+            only = optarg;
+            break;
+        case 's':
+            if (shuffle_mode_parse(optarg, &mode) != 0) {
+                fprintf(stderr, "-s takes a shuffle mode from %d to %d\n",
+                        SHUFFLE_FLOYD, SHUFFLE_BANDED);
+                return 2;
+            }
+            break;
+        case 'g':
+            golden_path = optarg;
+            break;
+        case 'u':
+            update = 1;
+            break;
+        case 'o':
+            sorted = 0;
+            break;
+        default:
+            fprintf(stderr, "usage: %s [-m mp,...] [-c corpus] [-s mode] "
+                    "[-g golden] [-u] [-o]\n", argv[0]);
+            return 2;
+        }
+    }
+    for (tok = strtok(sizes, ","); tok != NULL && n_mp < 32;
+            tok = strtok(NULL, ",")) {
+        mp[n_mp] = atoi(tok);
+        if (mp[n_mp] < 1 || mp[n_mp] > 500) {
+            fprintf(stderr, "sizes range from 1 to 500 MP\n");
+            return 2;
+        }
+        n_mp++;
+    }
+    table = (struct golden *)calloc(MAX_GOLDEN, sizeof(struct golden));
+    if (table == NULL)
+        return 2;
+    n_golden = load_golden(golden_path, table);
+    //LUT
+    t0 = clock_seconds();
+    build_flippability_lut(lut, 3);
+    printf("build_flippability_lut(3): %.3f ms\n",
+            1000.0 * (clock_seconds() - t0));
+    printf("%-9s %4s %5s %12s %12s %12s %8s  %-16s\n", "corpus", "MP", "mode",
+            "perm Mpx/s", "embed Mpx/s", "extr Mpx/s", "RSS MB", "hash");
+    //PROCESS
+    for (k = 0; k < sizeof(corpora) / sizeof(corpora[0]); k++) {
+        if (only != NULL && strcmp(only, corpora[k].name) != 0)
+            continue;
+        for (i = 0; i < n_mp; i++)
+            failed += run_one(corpora + k, mp[i], mode, sorted, table,
+                    &n_golden, update);
+    }
+    if (update && save_golden(golden_path, table, n_golden) != 0) {
+        fprintf(stderr, "cannot write %s\n", golden_path);
+        failed++;
+    }
+    free(table);
+    printf(failed ? "FAILED\n" : "PASSED\n");
+    return failed != 0;
+}
+
+/**
+*Benchmarks one page and checks it against its golden hash.
+*\returns 0 if the round trip is exact and the hash matches or is
+*new, 1 otherwise.
+*/
+int run_one(const struct corpus *cp, int mp, enum shuffle_mode mode,
+        int sorted, struct golden *table, int *n_golden, int update) {
+    struct image img;
+    struct shuffle sh;
+    struct wm_options opt;
+    unsigned char *payload, *extracted;
+    uint64_t rng, hash;
+    size_t i, bytes;
+    long pix;
+    int g, cols, rows, status, failed = 0;
+    double t0, t_perm, t_embed, t_extract;
+    const char *verdict;
+    char perm[32];
+    //INIT
+    pix = (long)mp * 1000000;
+    cols = (int)sqrt(pix / 1.4142);
+    cols = (cols + 7) & ~7;
+    rows = (int)(pix / cols);
+    if (image_alloc(&img, cols, rows) != 0) {
+        fprintf(stderr, "%s %d MP: out of memory\n", cp->name, mp);
+        return 1;
+    }
+    rng = 0x5eed0000ULL + mp;
+    cp->generate(img, &rng);
+    bytes = (size_t)cols * rows / (8 * BENCH_WINDOW);
+    payload = (unsigned char *)malloc(bytes);
+    extracted = (unsigned char *)malloc(bytes);
+    if (payload == NULL || extracted == NULL) {
+        fprintf(stderr, "%s %d MP: out of memory\n", cp->name, mp);
+        free(payload);
+        free(extracted);
+        image_free(&img);
+        return 1;
+    }
+    for (i = 0; i < bytes; i++)
+        payload[i] = (unsigned char)next_rand(&rng);
+    //PROCESS
+    wm_default_options(&opt);
+    t0 = clock_seconds();
+    if (mode == SHUFFLE_BANDED)
+        status = 0; //the bands key their shuffles on the fly
+    else
+        status = shuffle_open(&sh, cols * rows, SHUFFLE_SEED, mode);
+    //the sort is part of the layout, once per payload size
+    if (status == 0 && sorted && mode != SHUFFLE_BANDED)
+        status = shuffle_sort_windows(&sh, payload_window(img, bytes));
+    t_perm = clock_seconds() - t0;
+    if (status != 0) {
+        fprintf(stderr, "%s %d MP: cannot shuffle\n", cp->name, mp);
+        failed = 1;
+        goto release;
+    }
+    opt.shuffle = mode;
+    t0 = clock_seconds();
+    if (mode == SHUFFLE_BANDED)
+        status = embed_opt(img, payload, bytes, &opt);
+    else
+        status = embed_shuffled(img, payload, bytes, &sh);
+    t_embed = clock_seconds() - t0;
+    t0 = clock_seconds();
+    if (status == WM_OK && mode == SHUFFLE_BANDED)
+        status = extract_opt(img, extracted, bytes, &opt);
+    else if (status == WM_OK)
+        status = extract_shuffled(img, extracted, bytes, &sh, 1);
+    t_extract = clock_seconds() - t0;
+    if (mode != SHUFFLE_BANDED)
+        shuffle_close(&sh);
+    if (status != WM_OK || memcmp(payload, extracted, bytes) != 0) {
+        fprintf(stderr, "%s %d MP: round trip failed: %s\n", cp->name, mp,
+                wm_strerror(status));
+        failed = 1;
+        goto release;
+    }
+    //CHECK
+    hash = image_hash(img);
+    for (g = 0; g < *n_golden; g++) {
+        if (strcmp(table[g].corpus, cp->name) == 0 && table[g].mp == mp &&
+            table[g].mode == mode)
+            break;
+    }
+    if (g == *n_golden) {
+        verdict = "new";
+        if (update && g < MAX_GOLDEN) {
+            snprintf(table[g].corpus, sizeof(table[g].corpus), "%s", cp->name);
+            table[g].mp = mp;
+            table[g].mode = mode;
+            table[g].hash = hash;
+            (*n_golden)++;
+        }
+    } else if (table[g].hash == hash) {
+        verdict = "ok";
+    } else if (update) {
+        verdict = "updated";
+        table[g].hash = hash;
+    } else {
+        verdict = "MISMATCH";
+        failed = 1;
+    }
+    //the keyed modes compute their positions inside embed/extract
+    if (mode == SHUFFLE_FEISTEL || mode == SHUFFLE_BANDED)
+        snprintf(perm, sizeof(perm), "%12s", "-");
+    else
+        snprintf(perm, sizeof(perm), "%12.1f", 1e-6 * pix / t_perm);
+    printf("%-9s %4d %5d %s %12.1f %12.1f %8ld  %016llx %s\n", cp->name,
+            mp, (int)mode, perm, 1e-6 * pix / t_embed, 1e-6 * pix / t_extract,
+            peak_rss_kb() / 1024, (unsigned long long)hash, verdict);
+    fflush(stdout);
+release:
+    free(payload);
+    free(extracted);
+    image_free(&img);
+    return failed;
+}
+
+static void set_pixel(struct image img, int r, int c) {
+    if (r >= 0 && r < img.rows && c >= 0 && c < img.cols)
+        image_row(img, r)[c >> 6] |= (uint64_t)1 << (c & 63);
+}
+
+/**
+*A page of text: lines of words made of glyphs, every glyph a few
+*horizontal and vertical strokes in a 7x11 box.
+*/
+void gen_text(struct image img, uint64_t *rng) {
+    int r, c, k, s, strokes, x, y, len, vertical, word;
+    int margin_r = img.rows / 20, margin_c = img.cols / 12;
+    for (r = margin_r; r + 16 < img.rows - margin_r; r += 18) {
+        word = 3 + next_rand(rng) % 7;
+        for (c = margin_c; c + 10 < img.cols - margin_c; c += 9) {
+            if (word-- == 0) {
+                //a space between the words
+                word = 3 + next_rand(rng) % 7;
+                continue;
+            }
+            strokes = 2 + next_rand(rng) % 4;
+            for (s = 0; s < strokes; s++) {
+                vertical = next_rand(rng) & 1;
+                x = next_rand(rng) % 7;
+                y = next_rand(rng) % 11;
+                len = 3 + next_rand(rng) % 8;
+                for (k = 0; k < len; k++) {
+                    if (vertical)
+                        set_pixel(img, r + (y + k) % 11, c + x);
+                    else
+                        set_pixel(img, r + y, c + (x + k) % 7);
+                }
+            }
+        }
+    }
+}
+
+/**
+*A halftone: a smooth gray field dithered with the 8x8 Bayer matrix.
+*/
+void gen_halftone(struct image img, uint64_t *rng) {
+    static const unsigned char bayer[8][8] = {
+        { 0, 32,  8, 40,  2, 34, 10, 42}, {48, 16, 56, 24, 50, 18, 58, 26},
+        {12, 44,  4, 36, 14, 46,  6, 38}, {60, 28, 52, 20, 62, 30, 54, 22},
+        { 3, 35, 11, 43,  1, 33,  9, 41}, {51, 19, 59, 27, 49, 17, 57, 25},
+        {15, 47,  7, 39, 13, 45,  5, 37}, {63, 31, 55, 23, 61, 29, 53, 21}
+    };
+    double *col_gray;
+    double phase = (next_rand(rng) % 1000) / 100.0, row_gray;
+    int r, c;
+    col_gray = (double *)malloc(img.cols * sizeof(double));
+    if (col_gray == NULL)
+        return;
+    for (c = 0; c < img.cols; c++)
+        col_gray[c] = 0.25 * cos(c / 131.0 + phase);
+    for (r = 0; r < img.rows; r++) {
+        row_gray = 0.5 + 0.25 * sin(r / 97.0);
+        for (c = 0; c < img.cols; c++) {
+            if ((row_gray + col_gray[c]) * 64.0 > bayer[r & 7][c & 7])
+                set_pixel(img, r, c);
+        }
+    }
+    free(col_gray);
+}
+
+/**
+*Line art: straight segments and circles of 1 to 3 pixels of width.
+*/
+void gen_lineart(struct image img, uint64_t *rng) {
+    long n, shapes = (long)img.cols * img.rows / 20000;
+    int k, r0, c0, r1, c1, dr, dc, err, e2, sr, sc, width, radius, x, y;
+    for (n = 0; n < shapes; n++) {
+        width = 1 + next_rand(rng) % 3;
+        r0 = next_rand(rng) % img.rows;
+        c0 = next_rand(rng) % img.cols;
+        if (next_rand(rng) % 4 == 0) {
+            //midpoint circle, the eight octants at once
+            radius = 4 + next_rand(rng) % 60;
+            for (k = 0; k < width; k++) {
+                x = radius + k;
+                y = 0;
+                err = 1 - x;
+                while (x >= y) {
+                    set_pixel(img, r0 + y, c0 + x);
+                    set_pixel(img, r0 + x, c0 + y);
+                    set_pixel(img, r0 + x, c0 - y);
+                    set_pixel(img, r0 + y, c0 - x);
+                    set_pixel(img, r0 - y, c0 - x);
+                    set_pixel(img, r0 - x, c0 - y);
+                    set_pixel(img, r0 - x, c0 + y);
+                    set_pixel(img, r0 - y, c0 + x);
+                    y++;
+                    if (err < 0) {
+                        err += 2 * y + 1;
+                    } else {
+                        x--;
+                        err += 2 * (y - x) + 1;
+                    }
+                }
+            }
+            continue;
+        }
+        //Bresenham segment, thickened downwards
+        r1 = r0 + (int)(next_rand(rng) % 400) - 200;
+        c1 = c0 + (int)(next_rand(rng) % 400) - 200;
+        dr = abs(r1 - r0);
+        dc = abs(c1 - c0);
+        sr = r0 < r1 ? 1 : -1;
+        sc = c0 < c1 ? 1 : -1;
+        err = dc - dr;
+        for (;;) {
+            for (k = 0; k < width; k++)
+                set_pixel(img, r0 + k, c0);
+            if (r0 == r1 && c0 == c1)
+                break;
+            e2 = 2 * err;
+            if (e2 > -dr) {
+                err -= dr;
+                c0 += sc;
+            }
+            if (e2 < dc) {
+                err += dc;
+                r0 += sr;
+            }
+        }
+    }
+}
+
+/**
+*Reads the "<corpus> <mp> <mode> <hash>" lines of the golden file.
+*\returns The number of entries, 0 if the file does not exist.
+*/
+int load_golden(const char *path, struct golden *table) {
+    FILE *f;
+    char line[128];
+    unsigned long long hash;
+    int n = 0;
+    f = fopen(path, "r");
+    if (f == NULL)
+        return 0;
+    while (n < MAX_GOLDEN && fgets(line, sizeof(line), f) != NULL) {
+        if (line[0] == '#')
+            continue;
+        if (sscanf(line, "%15s %d %d %llx", table[n].corpus, &table[n].mp,
+                &table[n].mode, &hash) == 4) {
+            table[n].hash = hash;
+            n++;
+        }
+    }
+    fclose(f);
+    return n;
+}
+
+int save_golden(const char *path, const struct golden *table, int n) {
+    FILE *f;
+    int i;
+    f = fopen(path, "w");
+    if (f == NULL)
+        return -1;
+    fprintf(f, "# corpus MP shuffle-mode FNV-1a of the watermarked image, "
+            "written by bench -u\n");
+    for (i = 0; i < n; i++) {
+        fprintf(f, "%s %d %d %016llx\n", table[i].corpus, table[i].mp,
+                table[i].mode, (unsigned long long)table[i].hash);
+    }
+    return fclose(f);
+}
+
+/**
+*FNV-1a over the image words, row by row.
+*/
+uint64_t image_hash(struct image img) {
+    uint64_t h = 0xcbf29ce484222325ULL, w;
+    size_t i, n = (size_t)img.stride * img.rows;
+    int b;
+    for (i = 0; i < n; i++) {
+        w = img.words[i];
+        for (b = 0; b < 8; b++, w >>= 8) {
+            h ^= w & 0xff;
+            h *= 0x100000001b3ULL;
+        }
+    }
+    return h;
+}
+
+/**
+*xorshift64*, the corpus generator. It must never change or the
+*golden hashes become meaningless.
+*/
+uint64_t next_rand(uint64_t *state) {
+    uint64_t x = *state ? *state : 0x9e3779b97f4a7c15ULL;
+    x ^= x >> 12;
+    x ^= x << 25;
+    x ^= x >> 27;
+    *state = x;
+    return (x * 0x2545f4914f6cdd1dULL) >> 32;
+}
+
+/**
+*The peak resident set of the process so far, in KB.
+*/
+long peak_rss_kb(void) {
+    struct rusage ru;
+    if (getrusage(RUSAGE_SELF, &ru) != 0)
+        return 0;
+    return ru.ru_maxrss;
+}
@@ -5,91 +5,314 @@
 */
 #include <stdio.h>
 #include <stdlib.h>
-#include <pbm.h>
-#include <assert.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
 #include "flippability.h"
 #include "shuffling.h"
+#include "shuffle_cache.h"
+#include "score_map.h"
+#include "banding.h"
+#include "profile.h"
 #include "bin_watermarking.h"
 
-#define pushbit(word, bit) (((word << 1) + bit) & 0x1ff)
+#define MAX_FLIPS 3 //the quantization step Q, no window needs more flips
+#define SINK_CHUNK 64 //the payload bytes extract_each hands over at once
+#define GATHER_AHEAD 16 //the pixels a gather prefetches ahead, a power of 2
 
 /**
-*This is an auxiliary data stracture
-*used only for sorting the pixel positions
-*in accordance with their flippability score
+*This is an auxiliary data stracture filled by a single pass
+*over a window. Besides the black pixels it keeps, for every color
+*and score bucket, the MAX_FLIPS highest pixel positions in
+*descending order, which is all flip_pixels ever needs.
 */
-struct pos_score {
-    int pos;
-    float score;
+struct window_scan {
+    int blacks;
+    int count[2][SCORE_BUCKETS];
+    int top[2][SCORE_BUCKETS][MAX_FLIPS];
 };
 
-void sort_by_flippability(struct pos_score *flippables, int window,
-        int *hd, struct image img, float *lut);
-int sum_of_blacks(struct image img, int *hd, int window);
-int flip_pixels(struct image img, struct pos_score *flippables, int array_size,
-        int N_pix, const int color);
-float evaluate(struct image img, int pos, float *lut);
-int compar(const void *l, const void *r);
+/**
+*The share of the payload decoded by one extract thread,
+*the bytes [first, last).
+*/
+struct extract_job {
+    pthread_t thread;
+    struct image img;
+    const struct shuffle *sh;
+    int window;
+    unsigned char *payload;
+    size_t first;
+    size_t last;
+    int started;
+    int status;
+#ifdef FPWM_PROFILE
+    struct prof prof; //the timers and counters of the thread
+#endif
+};
+
+/**
+*The chunks of extract_each_shuffled, decoded ahead by the
+*each_worker threads into payload and marked ready in order of
+*completion, handed to the sink in order of position.
+*/
+struct each_pipe {
+    struct image img;
+    const struct shuffle *sh;
+    int window;
+    size_t bytes;
+    size_t chunks;
+    unsigned char *payload;
+    unsigned char *ready; //per chunk, set once it is decoded
+    size_t next; //the first chunk no thread took, chunks to stop them
+    int status; //the first error of a thread
+    pthread_mutex_t lock; //guards ready, next and status
+    pthread_cond_t cond; //signaled as chunks get ready
+};
+
+struct each_job {
+    pthread_t thread;
+    struct each_pipe *pipe;
+    int started;
+#ifdef FPWM_PROFILE
+    struct prof prof;
+#endif
+};
+
+int decode_bit(int blacks);
+int update_window(struct image img, struct score_map *map, const int *seq,
+        int window, int bit, long *touched);
+int embed_banded(struct image img, const void *payload, size_t bytes,
+        unsigned int seed, int neighborhood);
+int extract_banded(struct image img, void *payload, size_t bytes,
+        unsigned int seed);
+int extract_banded_range(struct image img, unsigned char *pl, size_t bytes,
+        size_t offset, size_t len, unsigned int seed);
+void scan_window(struct window_scan *scan, const int *seq, int window,
+        struct image img, const struct score_map *map);
+int flip_pixels(struct image img, struct score_map *map, struct window_scan *scan,
+        const int *seq, int window, int N_pix, const int color);
+void *extract_worker(void *arg);
+int extract_each_serial(struct each_pipe *pipe,
+        int (*sink)(void *arg, const unsigned char *chunk, size_t len),
+        void *arg);
+void *each_worker(void *arg);
 
 /**
 *This function implements the data embedding functionality.
 *It scans the image with the sliding window end flipps the pixels
 *when needed, to establish the relationship with the payload.
+*The pixels with the highest flippability score go first and among
+*equal scores the one with the highest position (row major) wins.
+*The scores are kept current, a flip rescores its neighbors before
+*the next pixel is chosen.
 *\param[in, out] img This struct represents the original image
 *at the input, and at the output is the modified one.
 *\param[in] payload A void * to the data to be embedded.
 *\param[in] bytes The size of the payload.
-*\returns Nothing.
-*/
-void embed(struct image img, void *payload, size_t bytes) {
-    size_t items;
-    int window, i, j, k, sum, status, seq_idx;
-    struct pos_score *flippables;
-    int *sequence;
-    float *lut;
-    FILE *f;
-    div_t divided_sum;
-    unsigned char *pl, byte;
+*\returns WM_OK or one of the WM_E* error codes. On WM_ECAPACITY
+*the image is left partially modified.
+*/
+int embed(struct image img, void *payload, size_t bytes) {
+    struct wm_options opt;
+    wm_default_options(&opt);
+    return embed_opt(img, payload, bytes, &opt);
+}
+
+/**
+*Same as embed, with the options given by the caller. The
+*extraction must use the same shuffle mode and seed.
+*/
+int embed_opt(struct image img, void *payload, size_t bytes,
+        const struct wm_options *opt) {
+    struct shuffle sh;
+    int status;
+    if (opt->shuffle == SHUFFLE_BANDED)
+        return embed_banded(img, payload, bytes, opt->seed, opt->neighborhood);
+    if (payload_window(img, bytes) <= 0)
+        return WM_EINVAL;
+    PROF_BEGIN(PROF_SHUFFLE);
+    status = shuffle_open_cached(&sh, img.cols * img.rows, opt->seed,
+            opt->shuffle, opt->cache_dir, opt->cache_limit);
+    PROF_END(PROF_SHUFFLE);
+    if (status != 0)
+        return WM_ENOMEM;
+    status = embed_scored(img, payload, bytes, &sh, opt->neighborhood);
+    shuffle_close(&sh);
+    return status;
+}
+
+/**
+*Same as embed, walking a shuffle the caller already opened. The
+*shuffle is only read, many threads may embed with the same one.
+*/
+int embed_shuffled(struct image img, void *payload, size_t bytes,
+        const struct shuffle *sh) {
+    return embed_scored(img, payload, bytes, sh, 3);
+}
+
+/**
+*Same as embed_shuffled, choosing the pixels to flip by the scores
+*of their neighborhood x neighborhood patterns (see score_map_use).
+*/
+int embed_scored(struct image img, void *payload, size_t bytes,
+        const struct shuffle *sh, int neighborhood) {
+    int window, status;
+    struct score_map map;
+    int *scratch;
+    const float *lut;
     //INIT
-    lut = (float *)calloc(1 << (3 * 3), sizeof(float));
-    assert(lut != NULL);
-    init_flippability_lut(3);
-    f = fopen("flippalut.data", "r");
-    assert(f != NULL);
-    items = fread(lut, sizeof(float), 1 << (3 * 3), f);
-    assert(items == (1 << (3 * 3)));
-    sequence = random_permutation(img.cols * img.rows);
-    assert(sequence != NULL);
-    pl = (unsigned char *)payload;
-    window = (img.cols * img.rows) / (8 * bytes);
-    flippables = (struct pos_score *)calloc(window, sizeof(struct pos_score));
-    assert(flippables != NULL);
-    seq_idx = 0;
+    window = payload_window(img, bytes);
+    if (window <= 0 || sh->pix_N != img.cols * img.rows)
+        return WM_EINVAL;
+    PROF_BEGIN(PROF_LUT);
+    lut = flippability_lut(3);
+    PROF_END(PROF_LUT);
+    if (lut == NULL)
+        return WM_ENOLUT;
+    //the keyed shuffle computes one window at a time
+    scratch = NULL;
+    if (sh->sequence == NULL) {
+        scratch = (int *)malloc(window * sizeof(int));
+        if (scratch == NULL)
+            return WM_ENOMEM;
+    }
+    memset(&map, 0, sizeof(map));
+    if (score_map_use(&map, neighborhood) != 0) {
+        free(scratch);
+        return WM_ENOLUT;
+    }
     //PROCESS
-    for (k = 0; k < bytes; k++) {
+    status = embed_windows(img, &map, lut, sh, payload, bytes, scratch);
+    //FREE
+    score_map_free(&map);
+    free(scratch);
+    return status;
+}
+
+/**
+*Scores the image and embeds the payload in the windows of the
+*shuffle, the body of embed_shuffled.
+*\param map The storage of the scores, built or zeroed, which
+*score_map_rebuild reuses. The caller frees it either way.
+*\param scratch Room for a window of the keyed shuffle, NULL for
+*the materialized ones.
+*/
+int embed_windows(struct image img, struct score_map *map, const float *lut, const struct shuffle *sh, const void *payload,
+        size_t bytes, int *scratch) {
+    const unsigned char *pl = (const unsigned char *)payload;
+    const int *seq;
+    unsigned char byte;
+    int window, i, status, seq_idx;
+    size_t k;
+    window = payload_window(img, bytes);
+    PROF_BEGIN(PROF_SCORE);
+    status = score_map_rebuild(map, img, lut);
+    PROF_END(PROF_SCORE);
+    if (status != 0)
+        return WM_ENOMEM;
+    seq_idx = 0;
+    status = WM_OK;
+    for (k = 0; k < bytes && status == WM_OK; k++) {
         byte = pl[k];
         for(i = 0; i < 8; i++) {
-            sort_by_flippability(flippables, window, sequence + seq_idx, img, lut);
-            sum = sum_of_blacks(img, sequence + seq_idx, window);
-            divided_sum = div(sum, 3);
-            if ((divided_sum.quot % 2) == (byte & 0x1)) {
-                //change divided_sum.rem pixels from black to white
-                status = flip_pixels(img, flippables, window, divided_sum.rem, PBM_BLACK);
-                assert(status == 0);
-            } else {
-                //change 3 - divided_sum.rem pixels from white to black
-                status = flip_pixels(img, flippables, window, 3 - divided_sum.rem, PBM_WHITE);
-                assert(status == 0);
-            }
+            PROF_BEGIN(PROF_SHUFFLE);
+            seq = shuffle_window(sh, seq_idx, window, scratch);
+            PROF_END(PROF_SHUFFLE);
+            status = embed_bit(img, map, seq, window, byte & 0x1);
+            if (status != WM_OK)
+                break;
             byte = byte >> 1;
             seq_idx += window;
         }
     }
+    return status;
+}
+
+/**
+*  Makes an image watermarked with opt carry another payload of the
+*  same size. A window whose bit does not change is already valid and
+*  is left alone, unread when old is given; only the windows whose bit
+*  differs are scored and flipped, so a small change of the payload
+*  costs and alters little of the image.
+*  \param[in] old The payload the image carries, NULL to decode it
+*  from the image window by window.
+*  \param[in] payload The payload to carry instead.
+*  \param[out] touched The number of windows flipped, may be NULL.
+*  \returns WM_OK or one of the WM_E* error codes.
+*/
+int embed_update(struct image img, const void *old, const void *payload,
+        size_t bytes, const struct wm_options *opt, long *touched) {
+    const unsigned char *was = (const unsigned char *)old;
+    const unsigned char *pl = (const unsigned char *)payload;
+    struct band_layout bl;
+    struct shuffle sh;
+    struct score_map map;
+    const float *lut;
+    const int *seq;
+    int window, bit, banded, band, top, bottom, status, opened = 0, *scratch;
+    long i, bits = 8 * (long)bytes, n = 0;
+    //INIT
+    banded = opt->shuffle == SHUFFLE_BANDED;
+    if (banded) {
+        if (band_layout_init(&bl, img.cols, img.rows, bytes, opt->seed) != 0)
+            return WM_EINVAL;
+        window = bl.window;
+    } else {
+        window = payload_window(img, bytes);
+        if (window <= 0)
+            return WM_EINVAL;
+    }
+    PROF_BEGIN(PROF_LUT);
+    lut = flippability_lut(3);
+    PROF_END(PROF_LUT);
+    if (lut == NULL)
+        return WM_ENOLUT;
+    memset(&map, 0, sizeof(map));
+    status = score_map_use(&map, opt->neighborhood) != 0 ? WM_ENOLUT : WM_OK;
+    scratch = (int *)malloc(window * sizeof(int));
+    if (status == WM_OK && scratch == NULL)
+        status = WM_ENOMEM;
+    if (status == WM_OK && !banded) {
+        PROF_BEGIN(PROF_SHUFFLE);
+        opened = shuffle_open_cached(&sh, img.cols * img.rows, opt->seed,
+                opt->shuffle, opt->cache_dir, opt->cache_limit) == 0;
+        PROF_END(PROF_SHUFFLE);
+        if (!opened)
+            status = WM_ENOMEM;
+    }
+    //nothing is scored until a window needs it
+    if (status == WM_OK && score_map_clear(&map, img, lut) != 0)
+        status = WM_ENOMEM;
+    //PROCESS
+    for (i = 0; i < bits && status == WM_OK; i++) {
+        bit = (pl[i >> 3] >> (i & 7)) & 1;
+        if (was != NULL && ((was[i >> 3] >> (i & 7)) & 1) == bit)
+            continue;
+        PROF_BEGIN(PROF_SHUFFLE);
+        if (banded) {
+            band = (int)(i % bl.nbands);
+            if (band_open(&bl, band, &sh) != 0) {
+                status = WM_EINVAL;
+                break;
+            }
+            band_rows(&bl, band, &top, &bottom);
+            seq = band_window(&bl, &sh, i / bl.nbands, top * img.cols, scratch);
+            shuffle_close(&sh);
+        } else {
+            seq = shuffle_window(&sh, (int)(i * window), window, scratch);
+        }
+        PROF_END(PROF_SHUFFLE);
+        status = update_window(img, &map, seq, window, bit, &n);
+    }
     //FREE
-    free(lut);
-    free(sequence);
-    free(flippables);
-    fclose(f);
+    if (opened)
+        shuffle_close(&sh);
+    score_map_free(&map);
+    free(scratch);
+    if (touched != NULL)
+        *touched = n;
+    return status;
 }
 
 /**
@@ -101,103 +324,769 @@ void embed(struct image img, void *payload, size_t bytes) {
 *  \param[in] bytes The size of the payload which means the caller
 *  must provide the exact size of the embedded data.
 *  \param[out] payload The extracted data.
-*  \returns Nothing.
+*  \returns WM_OK or one of the WM_E* error codes.
 */
-void extract(struct image img, void *payload, size_t bytes) {
-    int window, *sequence, i, j, seq_idx, sum;
-    div_t divided_sum;
-    unsigned char *pl, byte;
+int extract(struct image img, void *payload, size_t bytes) {
+    struct wm_options opt;
+    wm_default_options(&opt);
+    return extract_opt(img, payload, bytes, &opt);
+}
+
+/**
+*  Same as extract, with the options given by the caller.
+*/
+int extract_opt(struct image img, void *payload, size_t bytes,
+        const struct wm_options *opt) {
+    struct shuffle sh;
+    int status;
+    if (opt->shuffle == SHUFFLE_BANDED)
+        return extract_banded(img, payload, bytes, opt->seed);
+    if (payload_window(img, bytes) <= 0)
+        return WM_EINVAL;
+    PROF_BEGIN(PROF_SHUFFLE);
+    status = shuffle_open_cached(&sh, img.cols * img.rows, opt->seed,
+            opt->shuffle, opt->cache_dir, opt->cache_limit);
+    PROF_END(PROF_SHUFFLE);
+    if (status != 0)
+        return WM_ENOMEM;
+    status = extract_shuffled(img, payload, bytes, &sh, opt->threads);
+    shuffle_close(&sh);
+    return status;
+}
+
+/**
+*  Decodes only the payload bytes [offset, offset + len) of a payload
+*  of the given size. The byte k depends on the windows 8k to 8k + 7
+*  alone, so only those are read. SHUFFLE_FEISTEL and SHUFFLE_BANDED
+*  compute just their positions, the cost is O(len); the materialized
+*  modes need their whole sequence first, which opt->cache_dir keeps
+*  from one call to the next.
+*  \param[out] payload Room for len bytes, payload[0] being the byte
+*  offset.
+*  \returns WM_OK or one of the WM_E* error codes.
+*/
+int extract_range(struct image img, void *payload, size_t bytes,
+        size_t offset, size_t len, const struct wm_options *opt) {
+    struct shuffle sh;
+    int window, status;
+    window = payload_window(img, bytes);
+    if (window <= 0 || offset > bytes || len > bytes - offset)
+        return WM_EINVAL;
+    if (len == 0)
+        return WM_OK;
+    if (opt->shuffle == SHUFFLE_BANDED)
+        return extract_banded_range(img, (unsigned char *)payload, bytes,
+                offset, len, opt->seed);
+    PROF_BEGIN(PROF_SHUFFLE);
+    status = shuffle_open_cached(&sh, img.cols * img.rows, opt->seed,
+            opt->shuffle, opt->cache_dir, opt->cache_limit);
+    PROF_END(PROF_SHUFFLE);
+    if (status != 0)
+        return WM_ENOMEM;
+    status = extract_bytes(img, &sh, window, (unsigned char *)payload, offset,
+            offset + len, NULL);
+    shuffle_close(&sh);
+    return status;
+}
+
+/**
+*  Same as extract_opt, handing the payload to sink in order as it is
+*  decoded, SINK_CHUNK bytes at a time, instead of filling a buffer.
+*  The consumer works while the rest of the image is still to be
+*  read and can stop the extraction early. The banded layout spreads
+*  every byte over all the bands, so it is decoded whole and handed
+*  over at once.
+*  \param sink Called with arg and every chunk. A nonzero return
+*  stops the extraction and is returned.
+*  \returns WM_OK, the return of sink, or one of the WM_E* error codes.
+*/
+int extract_each(struct image img, size_t bytes, const struct wm_options *opt,
+        int (*sink)(void *arg, const unsigned char *chunk, size_t len),
+        void *arg) {
+    struct shuffle sh;
+    unsigned char *payload;
+    int status;
+    if (opt->shuffle == SHUFFLE_BANDED) {
+        payload = (unsigned char *)malloc(bytes > 0 ? bytes : 1);
+        if (payload == NULL)
+            return WM_ENOMEM;
+        status = extract_banded(img, payload, bytes, opt->seed);
+        if (status == WM_OK)
+            status = sink(arg, payload, bytes);
+        free(payload);
+        return status;
+    }
+    if (payload_window(img, bytes) <= 0)
+        return WM_EINVAL;
+    PROF_BEGIN(PROF_SHUFFLE);
+    status = shuffle_open_cached(&sh, img.cols * img.rows, opt->seed,
+            opt->shuffle, opt->cache_dir, opt->cache_limit);
+    PROF_END(PROF_SHUFFLE);
+    if (status != 0)
+        return WM_ENOMEM;
+    status = extract_each_shuffled(img, bytes, &sh, opt->threads, sink, arg);
+    shuffle_close(&sh);
+    return status;
+}
+
+/**
+*  Same as extract_each, walking a shuffle the caller already opened.
+*  With threads > 1 the chunks are decoded ahead by a pool of threads
+*  while the calling thread hands them to sink in order, as soon as
+*  each is ready.
+*  \param[in] threads The number of decoding threads, <= 0 means one
+*  per online cpu.
+*/
+int extract_each_shuffled(struct image img, size_t bytes,
+        const struct shuffle *sh, int threads,
+        int (*sink)(void *arg, const unsigned char *chunk, size_t len),
+        void *arg) {
+    struct each_pipe pipe;
+    struct each_job *jobs;
+    size_t c, len;
+    int window, t, started, status = WM_OK;
     //INIT
-    window = (img.cols * img.rows) / (8 * bytes);
-    sequence = random_permutation(img.cols * img.rows);
-    assert(sequence != NULL);
-    pl = (unsigned char *)payload;
-    seq_idx = 0;
+    window = payload_window(img, bytes);
+    if (window <= 0 || sh->pix_N != img.cols * img.rows)
+        return WM_EINVAL;
+    if (threads <= 0)
+        threads = (int)sysconf(_SC_NPROCESSORS_ONLN);
+    memset(&pipe, 0, sizeof(pipe));
+    pipe.img = img;
+    pipe.sh = sh;
+    pipe.window = window;
+    pipe.bytes = bytes;
+    pipe.chunks = (bytes + SINK_CHUNK - 1) / SINK_CHUNK;
+    if (threads <= 1 || pipe.chunks == 1)
+        return extract_each_serial(&pipe, sink, arg);
+    if ((size_t)threads > pipe.chunks)
+        threads = (int)pipe.chunks;
+    pipe.payload = (unsigned char *)malloc(bytes);
+    pipe.ready = (unsigned char *)calloc(pipe.chunks, 1);
+    jobs = (struct each_job *)calloc(threads, sizeof(struct each_job));
+    if (pipe.payload == NULL || pipe.ready == NULL || jobs == NULL) {
+        free(pipe.payload);
+        free(pipe.ready);
+        free(jobs);
+        return WM_ENOMEM;
+    }
+    pthread_mutex_init(&pipe.lock, NULL);
+    pthread_cond_init(&pipe.cond, NULL);
     //PROCESS
-    for (i = 0; i < bytes; i++) {
+    for (t = 0, started = 0; t < threads; t++) {
+        jobs[t].pipe = &pipe;
+        jobs[t].started = pthread_create(&jobs[t].thread, NULL,
+                each_worker, jobs + t) == 0;
+        started += jobs[t].started;
+    }
+    if (started == 0) {
+        //no thread to decode ahead, the caller does it all
+        free(pipe.payload);
+        pipe.payload = NULL;
+        status = extract_each_serial(&pipe, sink, arg);
+    }
+    for (c = 0; started > 0 && c < pipe.chunks && status == WM_OK; c++) {
+        pthread_mutex_lock(&pipe.lock);
+        while (!pipe.ready[c] && pipe.status == WM_OK)
+            pthread_cond_wait(&pipe.cond, &pipe.lock);
+        status = pipe.status;
+        pthread_mutex_unlock(&pipe.lock);
+        len = c + 1 < pipe.chunks ? SINK_CHUNK : bytes - c * SINK_CHUNK;
+        if (status == WM_OK)
+            status = sink(arg, pipe.payload + c * SINK_CHUNK, len);
+    }
+    //a sink that gave up stops the decoding of the chunks left
+    pthread_mutex_lock(&pipe.lock);
+    pipe.next = pipe.chunks;
+    pthread_mutex_unlock(&pipe.lock);
+    for (t = 0; t < threads; t++) {
+        if (jobs[t].started)
+            pthread_join(jobs[t].thread, NULL);
+        PROF_MERGE(&jobs[t].prof);
+    }
+    //FREE
+    pthread_cond_destroy(&pipe.cond);
+    pthread_mutex_destroy(&pipe.lock);
+    free(pipe.payload);
+    free(pipe.ready);
+    free(jobs);
+    return status;
+}
+
+/**
+*The single threaded extract_each_shuffled.
+*/
+int extract_each_serial(struct each_pipe *pipe,
+        int (*sink)(void *arg, const unsigned char *chunk, size_t len),
+        void *arg) {
+    unsigned char chunk[SINK_CHUNK];
+    size_t first, last;
+    int status = WM_OK, *scratch = NULL;
+    if (pipe->sh->sequence == NULL) {
+        scratch = (int *)malloc(pipe->window * sizeof(int));
+        if (scratch == NULL)
+            return WM_ENOMEM;
+    }
+    for (first = 0; first < pipe->bytes && status == WM_OK; first = last) {
+        last = pipe->bytes - first < SINK_CHUNK ? pipe->bytes :
+            first + SINK_CHUNK;
+        status = extract_bytes(pipe->img, pipe->sh, pipe->window, chunk,
+                first, last, scratch);
+        if (status == WM_OK)
+            status = sink(arg, chunk, last - first);
+    }
+    free(scratch);
+    return status;
+}
+
+/**
+*Decodes the next chunk nobody took until there is none left.
+*/
+void *each_worker(void *arg) {
+    struct each_job *job = (struct each_job *)arg;
+    struct each_pipe *pipe = job->pipe;
+    size_t c, first, last;
+    int status, *scratch = NULL;
+    if (pipe->sh->sequence == NULL)
+        scratch = (int *)malloc(pipe->window * sizeof(int));
+    status = pipe->sh->sequence == NULL && scratch == NULL ? WM_ENOMEM : WM_OK;
+    for (;;) {
+        pthread_mutex_lock(&pipe->lock);
+        if (status != WM_OK && pipe->status == WM_OK)
+            pipe->status = status;
+        c = pipe->next;
+        if (status == WM_OK && c < pipe->chunks)
+            pipe->next++;
+        pthread_cond_broadcast(&pipe->cond);
+        pthread_mutex_unlock(&pipe->lock);
+        if (status != WM_OK || c >= pipe->chunks)
+            break;
+        first = c * SINK_CHUNK;
+        last = c + 1 < pipe->chunks ? first + SINK_CHUNK : pipe->bytes;
+        status = extract_bytes(pipe->img, pipe->sh, pipe->window,
+                pipe->payload + first, first, last, scratch);
+        if (status == WM_OK) {
+            pthread_mutex_lock(&pipe->lock);
+            pipe->ready[c] = 1;
+            pthread_cond_broadcast(&pipe->cond);
+            pthread_mutex_unlock(&pipe->lock);
+        }
+    }
+    free(scratch);
+    PROF_TAKE(&job->prof);
+    PROF_THREAD_END();
+    return NULL;
+}
+
+/**
+*  Same as extract, walking a shuffle the caller already opened.
+*  Every byte depends only on its own 8 windows and the image is
+*  never written, so with threads > 1 the payload is split in
+*  contiguous byte ranges decoded concurrently. The result is
+*  identical to the sequential one.
+*  \param[in] threads The number of threads, <= 0 means one per
+*  online cpu.
+*/
+int extract_shuffled(struct image img, void *payload, size_t bytes,
+        const struct shuffle *sh, int threads) {
+    int window, t, status;
+    struct extract_job *jobs;
+    size_t first, share;
+    //INIT
+    window = payload_window(img, bytes);
+    if (window <= 0 || sh->pix_N != img.cols * img.rows)
+        return WM_EINVAL;
+    if (threads <= 0)
+        threads = (int)sysconf(_SC_NPROCESSORS_ONLN);
+    if (threads < 1)
+        threads = 1;
+    if ((size_t)threads > bytes)
+        threads = bytes;
+    jobs = (struct extract_job *)calloc(threads, sizeof(struct extract_job));
+    if (jobs == NULL)
+        return WM_ENOMEM;
+    //PROCESS
+    share = bytes / threads;
+    for (t = 0, first = 0; t < threads; t++) {
+        jobs[t].img = img;
+        jobs[t].sh = sh;
+        jobs[t].window = window;
+        jobs[t].payload = (unsigned char *)payload;
+        jobs[t].first = first;
+        first += share + ((size_t)t < bytes % threads);
+        jobs[t].last = first;
+    }
+    for (t = 1; t < threads; t++) {
+        //a thread that cannot start leaves its share to the caller
+        jobs[t].started = pthread_create(&jobs[t].thread, NULL,
+                extract_worker, jobs + t) == 0;
+        if (!jobs[t].started)
+            extract_worker(jobs + t);
+    }
+    extract_worker(jobs);
+    status = jobs[0].status;
+    PROF_MERGE(&jobs[0].prof);
+    for (t = 1; t < threads; t++) {
+        if (jobs[t].started)
+            pthread_join(jobs[t].thread, NULL);
+        if (jobs[t].status != WM_OK)
+            status = jobs[t].status;
+        PROF_MERGE(&jobs[t].prof);
+    }
+    //FREE
+    free(jobs);
+    return status;
+}
+
+/**
+*  Fills the default options, which give the historical behavior.
+*/
+void wm_default_options(struct wm_options *opt) {
+    opt->threads = 1;
+    opt->shuffle = SHUFFLE_FLOYD;
+    opt->seed = SHUFFLE_SEED;
+    opt->cache_dir = NULL;
+    opt->cache_limit = SHUFFLE_CACHE_LIMIT;
+    opt->neighborhood = 3;
+}
+
+/**
+*  Returns a short description of a WM_E* error code.
+*/
+const char *wm_strerror(int status) {
+    switch (status) {
+    case WM_OK:
+        return "success";
+    case WM_ENOMEM:
+        return "out of memory";
+    case WM_EINVAL:
+        return "the payload does not fit the image";
+    case WM_ECAPACITY:
+        return "a window has not enough pixels to flip";
+    case WM_ENOLUT:
+        return "the flippability table is not available";
+    case WM_EIO:
+        return "the image could not be read or written";
+    case WM_ENOHEADER:
+        return "the image carries no watermark";
+    case WM_ECHECKSUM:
+        return "the payload does not match its checksum";
+    case WM_ECORRUPT:
+        return "the payload is not a valid compressed stream";
+    default:
+        return "unknown error";
+    }
+}
+
+/**
+*  The number of pixels of every window, 0 if the image has less
+*  than one pixel per payload bit.
+*/
+int payload_window(struct image img, size_t bytes) {
+    if (bytes == 0)
+        return 0;
+    return (int)(((size_t)img.cols * img.rows) / (8 * bytes));
+}
+
+void *extract_worker(void *arg) {
+    struct extract_job *job = (struct extract_job *)arg;
+    job->status = extract_bytes(job->img, job->sh, job->window,
+            job->payload + job->first, job->first, job->last, NULL);
+    //hand the share over to the spawning thread, which merges it
+    PROF_TAKE(&job->prof);
+    if (job->started)
+        PROF_THREAD_END();
+    return NULL;
+}
+
+/**
+*Decodes the payload bytes [first, last) into pl, pl[0] being the
+*byte first.
+*\param scratch Room for a window of the keyed shuffle, NULL to let
+*the function allocate it if needed.
+*\returns WM_OK, or WM_ENOMEM if the window scratch could not be allocated.
+*/
+int extract_bytes(struct image img, const struct shuffle *sh, int window,
+        unsigned char *pl, size_t first, size_t last, int *scratch) {
+    int j, sum, *owned = NULL;
+    const int *seq;
+    size_t i, seq_idx;
+    unsigned char byte;
+    seq_idx = first * 8 * (size_t)window;
+    if (sh->sequence == NULL && scratch == NULL) {
+        scratch = owned = (int *)malloc(window * sizeof(int));
+        if (scratch == NULL)
+            return WM_ENOMEM;
+    }
+    for (i = first; i < last; i++) {
         byte = 0;
         for (j = 0; j < 8; j++) {
-            sum = sum_of_blacks(img, sequence + seq_idx, window);
-            divided_sum = div(sum, 3);
-            if (divided_sum.rem == 2)
-                divided_sum.quot += 1;
-            if (divided_sum.quot % 2 == 1) {
+            PROF_BEGIN(PROF_SHUFFLE);
+            seq = shuffle_window(sh, seq_idx, window, scratch);
+            PROF_END(PROF_SHUFFLE);
+            PROF_BEGIN(PROF_SUM);
+            sum = sum_of_blacks(img, seq, window);
+            PROF_END(PROF_SUM);
+            if (decode_bit(sum) == 1) {
                 byte = byte | (PBM_BLACK << j);
             } else {
                 byte = byte | (PBM_WHITE << j);
             }
             seq_idx += window;
         }
-        pl[i] = byte;
+        pl[i - first] = byte;
     }
-    //FREE
-    free(sequence);
+    PROF_COUNT(PROF_WINDOWS, 8 * (last - first));
+    free(owned);
+    return WM_OK;
 }
 
-void sort_by_flippability(struct pos_score *flippables, int window, int *seq,
-        struct image img, float *lut) {
-    int i;
-    for (i = 0; i < window; i++) {
-        flippables[i].pos = seq[i];
-        flippables[i].score = evaluate(img, seq[i], lut);
+/**
+*Embeds the SHUFFLE_BANDED layout, the bands in order from the top.
+*A band is processed whole before the next one, which is the order
+*the streaming embed is bound to, so both give the same image.
+*/
+int embed_banded(struct image img, const void *payload, size_t bytes,
+        unsigned int seed, int neighborhood) {
+    struct band_layout bl;
+    struct score_map map;
+    int status, *scratch;
+    if (band_layout_init(&bl, img.cols, img.rows, bytes, seed) != 0)
+        return WM_EINVAL;
+    scratch = (int *)malloc(bl.window * sizeof(int));
+    if (scratch == NULL)
+        return WM_ENOMEM;
+    memset(&map, 0, sizeof(map));
+    if (score_map_use(&map, neighborhood) != 0) {
+        free(scratch);
+        return WM_ENOLUT;
     }
-    qsort((void *)flippables, window, sizeof(struct pos_score), compar);
+    status = embed_bands(img, &bl, payload, &map, scratch);
+    score_map_free(&map);
+    free(scratch);
+    return status;
 }
 
-int sum_of_blacks(struct image img, int *seq, int window) {
-    int i, sum = 0;
-    div_t q;
-    for (i = 0; i < window; i++) {
-        q = div(seq[i], img.cols);
-        sum += img.bitmap[q.quot][q.rem];
+/**
+*The band loop of embed_banded, every band scored in map.
+*/
+int embed_bands(struct image img, const struct band_layout *bl,
+        const void *payload, struct score_map *map, int *scratch) {
+    struct image view;
+    int band, top, bottom, halo_top, halo_bottom, status = WM_OK;
+    int radius = band_halo(map);
+    for (band = 0; band < bl->nbands && status == WM_OK; band++) {
+        //the band with the rows of context of its patterns above and below
+        band_rows(bl, band, &top, &bottom);
+        halo_top = top < radius ? top : radius;
+        halo_bottom = img.rows - bottom < radius ? img.rows - bottom : radius;
+        view = img;
+        view.words = image_row(img, top - halo_top);
+        view.rows = bottom - top + halo_top + halo_bottom;
+        status = embed_band(view, halo_top, bl, band, payload, map, scratch);
     }
-    return sum;
+    return status;
+}
+
+/**
+*Returns the rows of context a band needs on each side, for the
+*patterns map scores.
+*/
+int band_halo(const struct score_map *map) {
+    return map->n > 3 ? map->n >> 1 : 1;
 }
 
-int flip_pixels(struct image img, struct pos_score *flippables, int array_size,
-        int N_pix, const int color) {
-    int i = array_size - 1, pos;
-    div_t q;
-    while (N_pix != 0 && i >=0) {
-        q = div(flippables[i].pos, img.cols);
-        if (img.bitmap[q.quot][q.rem] == color) {
-            img.bitmap[q.quot][q.rem] = color ^ 1;
-            N_pix--;
+int extract_banded(struct image img, void *payload, size_t bytes,
+        unsigned int seed) {
+    struct band_layout bl;
+    int status, *scratch;
+    if (band_layout_init(&bl, img.cols, img.rows, bytes, seed) != 0)
+        return WM_EINVAL;
+    scratch = (int *)malloc(bl.window * sizeof(int));
+    if (scratch == NULL)
+        return WM_ENOMEM;
+    status = extract_bands(img, &bl, payload, scratch);
+    free(scratch);
+    return status;
+}
+
+/**
+*The bits of the bytes [offset, offset + len) of the banded layout,
+*each one read from its own band.
+*/
+int extract_banded_range(struct image img, unsigned char *pl, size_t bytes,
+        size_t offset, size_t len, unsigned int seed) {
+    struct band_layout bl;
+    struct shuffle sh;
+    struct image view;
+    const int *seq;
+    int band, top, bottom, *scratch;
+    long i, first = 8 * (long)offset, last = 8 * (long)(offset + len);
+    if (band_layout_init(&bl, img.cols, img.rows, bytes, seed) != 0)
+        return WM_EINVAL;
+    scratch = (int *)malloc(bl.window * sizeof(int));
+    if (scratch == NULL)
+        return WM_ENOMEM;
+    memset(pl, 0, len);
+    for (i = first; i < last; i++) {
+        //a band shuffle is a handful of round keys, cheap to reopen
+        band = (int)(i % bl.nbands);
+        if (band_open(&bl, band, &sh) != 0) {
+            free(scratch);
+            return WM_EINVAL;
         }
-        i--;
+        band_rows(&bl, band, &top, &bottom);
+        view = img;
+        view.words = image_row(img, top);
+        view.rows = bottom - top;
+        seq = band_window(&bl, &sh, i / bl.nbands, 0, scratch);
+        pl[(i - first) >> 3] |= decode_bit(sum_of_blacks(view, seq, bl.window))
+            << (i & 7);
+        shuffle_close(&sh);
     }
-    return N_pix;
+    PROF_COUNT(PROF_WINDOWS, last - first);
+    free(scratch);
+    return WM_OK;
 }
 
-float evaluate(struct image img, int pos, float *lut) {
-    int i, j;
-    div_t q;
-    int index = 0;
-    q = div(pos, img.cols);
-    //[q.quot, q.rem] is the [x,y] cordinates of the central pixel of the 3x3 window
-    if (q.quot == 0 || q.quot == (img.rows - 1) ||
-        q.rem == 0  || q.rem  == (img.cols - 1)) {
-        //if the position of the pixel is at the borders of the image
-        return (0.250);
-    }
-    for (i = 1; i >= -1; i--) {
-        for (j = 1; j >= -1; j--) {
-            index = pushbit(index,
-                    img.bitmap[q.quot + i][q.rem + j]);
-        }
+/**
+*The band loop of extract_banded.
+*/
+int extract_bands(struct image img, const struct band_layout *bl,
+        void *payload, int *scratch) {
+    struct image view;
+    int band, top, bottom, status = WM_OK;
+    memset(payload, 0, (size_t)((bl->bits + 7) / 8));
+    for (band = 0; band < bl->nbands && status == WM_OK; band++) {
+        band_rows(bl, band, &top, &bottom);
+        view = img;
+        view.words = image_row(img, top);
+        view.rows = bottom - top;
+        status = extract_band(view, bl, band, payload, scratch);
     }
-    return (lut[index]);
+    return status;
 }
 
-int compar(const void *l, const void *r) {
-    struct pos_score *ll, *rr;
-    ll = (struct pos_score *)l;
-    rr = (struct pos_score *)r;
-    if (ll->score < rr->score) {
-        return -1;
-    } else if (ll->score > rr->score) {
-        return 1;
+/**
+*Embeds the payload bits of one band of the SHUFFLE_BANDED layout.
+*\param[in, out] view The rows of the band, plus band_halo rows of
+*context above and below it, fewer at the top and bottom of the
+*image. The context rows are only read, for the flippability scores.
+*\param[in] halo_top The rows of context above the band.
+*\param[in] payload The whole payload, every bit of the band is read.
+*\param map The storage of the scores, built or zeroed, rebuilt for
+*the view. The bands of a layout differ by a row at most, so after
+*the first band the storage is reused.
+*\param scratch Room for bl->window positions.
+*\returns WM_OK or one of the WM_E* error codes.
+*/
+int embed_band(struct image view, int halo_top, const struct band_layout *bl,
+        int band, const void *payload, struct score_map *map, int *scratch) {
+    struct shuffle sh;
+    const unsigned char *pl = (const unsigned char *)payload;
+    const int *seq;
+    const float *lut;
+    long k, n, i;
+    int status = WM_OK;
+    PROF_BEGIN(PROF_LUT);
+    lut = flippability_lut(3);
+    PROF_END(PROF_LUT);
+    if (lut == NULL)
+        return WM_ENOLUT;
+    if (band_open(bl, band, &sh) != 0)
+        return WM_EINVAL;
+    PROF_BEGIN(PROF_SCORE);
+    status = score_map_rebuild(map, view, lut);
+    PROF_END(PROF_SCORE);
+    if (status != 0)
+        return WM_ENOMEM;
+    n = band_bits(bl, band);
+    for (k = 0; k < n && status == WM_OK; k++) {
+        i = k * bl->nbands + band;
+        PROF_BEGIN(PROF_SHUFFLE);
+        seq = band_window(bl, &sh, k, halo_top * view.cols, scratch);
+        PROF_END(PROF_SHUFFLE);
+        status = embed_bit(view, map, seq, bl->window, (pl[i >> 3] >> (i & 7)) & 1);
+    }
+    shuffle_close(&sh);
+    return status;
+}
+
+/**
+*Decodes the payload bits of one band, view holding exactly its
+*rows. The bits are or-ed in the payload, which the caller clears.
+*\returns WM_OK or one of the WM_E* error codes.
+*/
+int extract_band(struct image view, const struct band_layout *bl, int band,
+        void *payload, int *scratch) {
+    struct shuffle sh;
+    unsigned char *pl = (unsigned char *)payload;
+    const int *seq;
+    long k, n, i;
+    if (band_open(bl, band, &sh) != 0)
+        return WM_EINVAL;
+    n = band_bits(bl, band);
+    for (k = 0; k < n; k++) {
+        i = k * bl->nbands + band;
+        PROF_BEGIN(PROF_SHUFFLE);
+        seq = band_window(bl, &sh, k, 0, scratch);
+        PROF_END(PROF_SHUFFLE);
+        PROF_BEGIN(PROF_SUM);
+        pl[i >> 3] |= decode_bit(sum_of_blacks(view, seq, bl->window)) << (i & 7);
+        PROF_END(PROF_SUM);
+    }
+    PROF_COUNT(PROF_WINDOWS, n);
+    shuffle_close(&sh);
+    return WM_OK;
+}
+
+/**
+*Brings the blacks of a window to the parity of bit, flipping the
+*fewest pixels of the best scores.
+*\returns WM_OK, or WM_ECAPACITY if the window lacks the pixels.
+*/
+int embed_bit(struct image img, struct score_map *map, const int *seq,
+        int window, int bit) {
+    struct window_scan scan;
+    div_t divided_sum;
+    int status;
+    PROF_BEGIN(PROF_SCAN);
+    scan_window(&scan, seq, window, img, map);
+    PROF_END(PROF_SCAN);
+    PROF_COUNT(PROF_WINDOWS, 1);
+    divided_sum = div(scan.blacks, 3);
+    PROF_BEGIN(PROF_FLIP);
+    if ((divided_sum.quot % 2) == bit) {
+        //change divided_sum.rem pixels from black to white
+        status = flip_pixels(img, map, &scan, seq,
+                window, divided_sum.rem, PBM_BLACK);
     } else {
-        return 0;
+        //change 3 - divided_sum.rem pixels from white to black
+        status = flip_pixels(img, map, &scan, seq,
+                window, 3 - divided_sum.rem, PBM_WHITE);
+    }
+    PROF_END(PROF_FLIP);
+    if (status != 0) {
+        PROF_COUNT(PROF_FAILED, 1);
+        return WM_ECAPACITY;
     }
+    return WM_OK;
+}
+
+/**
+*Embeds bit in a window of embed_update unless it already decodes
+*to it, scoring its pixels first, and counts it in touched.
+*/
+int update_window(struct image img, struct score_map *map, const int *seq,
+        int window, int bit, long *touched) {
+    int i;
+    if (decode_bit(sum_of_blacks(img, seq, window)) == bit)
+        return WM_OK;
+    PROF_BEGIN(PROF_SCORE);
+    for (i = 0; i < window; i++)
+        score_map_touch(map, img, seq[i] / img.cols, seq[i] % img.cols);
+    PROF_END(PROF_SCORE);
+    PROF_COUNT(PROF_SCORED, window);
+    (*touched)++;
+    return embed_bit(img, map, seq, window, bit);
+}
+
+/**
+*The bit a window of the given blacks carries: the parity of
+*blacks / 3, rounded to the nearest.
+*/
+int decode_bit(int blacks) {
+    div_t divided_sum = div(blacks, 3);
+    if (divided_sum.rem == 2)
+        divided_sum.quot += 1;
+    return divided_sum.quot % 2;
+}
+
+/**
+*Visits every pixel of the window once, counting the blacks and
+*bucketing the candidates of both colors by score. It replaces
+*sorting the whole window since at most MAX_FLIPS pixels of
+*one color are flipped.
+*/
+void scan_window(struct window_scan *scan, const int *seq, int window,
+        struct image img, const struct score_map *map) {
+    int i, k, r, c, pos, color, bucket, n, *top;
+    scan->blacks = 0;
+    memset(scan->count, 0, sizeof(scan->count));
+    for (i = 0; i < window; i++) {
+        pos = seq[i];
+        r = pos / img.cols;
+        c = pos % img.cols;
+        color = image_get(img, r, c);
+        scan->blacks += color;
+        bucket = score_map_get(map, r, c);
+        //keep the bucket sorted by descending position, drop the smallest
+        top = scan->top[color][bucket];
+        n = scan->count[color][bucket];
+        if (n == MAX_FLIPS) {
+            if (pos < top[MAX_FLIPS - 1])
+                continue;
+            n--;
+        }
+        for (k = n; k > 0 && top[k - 1] < pos; k--)
+            top[k] = top[k - 1];
+        top[k] = pos;
+        scan->count[color][bucket] = n + 1;
+    }
+}
+
+/**
+*Counts the blacks of a window. The word of every pixel is located
+*and prefetched GATHER_AHEAD pixels before it is read, so the misses
+*of a window overlap instead of following one another.
+*/
+int sum_of_blacks(struct image img, const int *seq, int window) {
+    const uint64_t *word[GATHER_AHEAD];
+    int bit[GATHER_AHEAD];
+    int i, k, c, sum = 0;
+    for (i = 0; i < window + GATHER_AHEAD; i++) {
+        k = i & (GATHER_AHEAD - 1);
+        if (i >= GATHER_AHEAD)
+            sum += (*word[k] >> bit[k]) & 1;
+        if (i < window) {
+            c = seq[i] % img.cols;
+            word[k] = image_row(img, seq[i] / img.cols) + (c >> 6);
+            bit[k] = c & 63;
+            __builtin_prefetch(word[k]);
+        }
+    }
+    return sum;
+}
+
+/**
+*Flips N_pix pixels of the given color, the best candidates
+*collected by scan_window first. Every flip updates the score map
+*and, if some score changed while more flips are due, the window
+*is scanned again so the next choice sees the current scores.
+*\returns The number of pixels that could not be flipped.
+*/
+int flip_pixels(struct image img, struct score_map *map, struct window_scan *scan,
+        const int *seq, int window, int N_pix, const int color) {
+    int bucket, k, pos, r, c;
+    while (N_pix != 0) {
+        for (bucket = SCORE_BUCKETS - 1; bucket >= 0; bucket--) {
+            if (scan->count[color][bucket] != 0)
+                break;
+        }
+        if (bucket < 0)
+            break;
+        //take the best candidate out of its bucket
+        pos = scan->top[color][bucket][0];
+        scan->count[color][bucket]--;
+        for (k = 0; k < scan->count[color][bucket]; k++)
+            scan->top[color][bucket][k] = scan->top[color][bucket][k + 1];
+        r = pos / img.cols;
+        c = pos % img.cols;
+        image_toggle(img, r, c);
+        PROF_COUNT(PROF_FLIPS, 1);
+        N_pix--;
+        if (score_map_update(map, img, r, c) != 0 && N_pix != 0)
+            scan_window(scan, seq, window, img, map);
+    }
+    return N_pix;
 }
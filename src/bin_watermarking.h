@@ -1,13 +1,79 @@
 #ifndef BIN_WATERMARKING_H
 #define BIN_WATERMARKING_H 1
 
-struct image {
-    int cols;
-    int rows;
-    bit **bitmap;
+#include "packed_image.h"
+#include "shuffling.h"
+#include "banding.h"
+
+struct score_map;
+
+/**
+*The return codes of embed/extract.
+*/
+#define WM_OK 0
+#define WM_ENOMEM -1 //an allocation failed
+#define WM_EINVAL -2 //empty payload or less than one pixel per payload bit
+#define WM_ECAPACITY -3 //a window has not enough pixels of the needed color
+#define WM_ENOLUT -4 //the flippability look up table could not be loaded
+#define WM_EIO -5 //the image could not be read or written
+#define WM_ENOHEADER -6 //the image carries no valid watermark header
+#define WM_ECHECKSUM -7 //the extracted payload does not match its checksum
+#define WM_ECORRUPT -8 //the extracted payload is not a valid zlib stream
+
+/**
+*Tunables of embed/extract. Initialize with wm_default_options.
+*/
+struct wm_options {
+    int threads; //extract threads, <= 0 means one per online cpu
+    enum shuffle_mode shuffle; //the pixel shuffling generator
+    unsigned int seed; //the seed of the shuffling generator
+    const char *cache_dir; //the shuffle cache directory, NULL disables it
+    long cache_limit; //the size limit of cache_dir in bytes
+    int neighborhood; //the side of the patterns embed scores, 3 or 5
 };
 
-void embed(struct image img, void *payload, size_t bytes);
-void extract(struct image img, void *payload, size_t bytes);
+void wm_default_options(struct wm_options *opt);
+const char *wm_strerror(int status);
+int embed(struct image img, void *payload, size_t bytes);
+int embed_opt(struct image img, void *payload, size_t bytes,
+        const struct wm_options *opt);
+int embed_shuffled(struct image img, void *payload, size_t bytes,
+        const struct shuffle *sh);
+int embed_scored(struct image img, void *payload, size_t bytes,
+        const struct shuffle *sh, int neighborhood);
+int embed_update(struct image img, const void *old, const void *payload,
+        size_t bytes, const struct wm_options *opt, long *touched);
+int extract(struct image img, void *payload, size_t bytes);
+int extract_opt(struct image img, void *payload, size_t bytes,
+        const struct wm_options *opt);
+int extract_shuffled(struct image img, void *payload, size_t bytes,
+        const struct shuffle *sh, int threads);
+int extract_range(struct image img, void *payload, size_t bytes,
+        size_t offset, size_t len, const struct wm_options *opt);
+int extract_each(struct image img, size_t bytes, const struct wm_options *opt,
+        int (*sink)(void *arg, const unsigned char *chunk, size_t len),
+        void *arg);
+int extract_each_shuffled(struct image img, size_t bytes,
+        const struct shuffle *sh, int threads,
+        int (*sink)(void *arg, const unsigned char *chunk, size_t len),
+        void *arg);
+int payload_window(struct image img, size_t bytes);
+int embed_bit(struct image img, struct score_map *map, const int *seq,
+        int window, int bit);
+int sum_of_blacks(struct image img, const int *seq, int window);
+int embed_windows(struct image img, struct score_map *map, const float *lut,
+        const struct shuffle *sh, const void *payload, size_t bytes,
+        int *scratch);
+int extract_bytes(struct image img, const struct shuffle *sh, int window,
+        unsigned char *pl, size_t first, size_t last, int *scratch);
+int embed_bands(struct image img, const struct band_layout *bl,
+        const void *payload, struct score_map *map, int *scratch);
+int extract_bands(struct image img, const struct band_layout *bl,
+        void *payload, int *scratch);
+int band_halo(const struct score_map *map);
+int embed_band(struct image view, int halo_top, const struct band_layout *bl,
+        int band, const void *payload, struct score_map *map, int *scratch);
+int extract_band(struct image view, const struct band_layout *bl, int band,
+        void *payload, int *scratch);
 
 #endif
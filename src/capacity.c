@@ -0,0 +1,223 @@
+/**
+*\file capacity.c
+*This module answers, without touching the image, whether a payload
+*fits it. A window of b blacks carries the bit of its parity of
+*b / 3 for free or by flipping b % 3 blacks, and the other bit only
+*by flipping 3 - b % 3 whites. Since every window owns its pixels
+*and flip_pixels takes any pixel of the needed color, a window fails
+*exactly when it has fewer whites than that. Counting the blacks of
+*every window costs about an extract, a fraction of an embed.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "shuffle_cache.h"
+#include "capacity.h"
+
+/**
+*The windows of one payload size in one layout.
+*/
+struct layout {
+    struct image img;
+    const struct shuffle *sh; //NULL for SHUFFLE_BANDED
+    struct band_layout bl;
+    int window;
+    long windows;
+};
+
+int analyze_layout(struct image img, size_t bytes, const void *payload,
+        const struct shuffle *sh, unsigned int seed,
+        struct capacity_report *rep);
+int layout_init(struct layout *lo, struct image img, const struct shuffle *sh,
+        size_t bytes, unsigned int seed);
+int scan_layout(const struct layout *lo, const unsigned char *payload,
+        struct capacity_report *rep, int *scratch, int stop_early);
+int check_window(const struct layout *lo, const int *seq, long i,
+        const unsigned char *payload, struct capacity_report *rep);
+void keep_weak(struct capacity_report *rep, const struct weak_window *w);
+
+/**
+*Analyzes the windows a payload of the given size would use.
+*\param[in] img The image, only read.
+*\param[in] bytes The payload size.
+*\param[in] payload The payload itself to count the windows that
+*fail for its actual bits, NULL to check only the worst case.
+*\param[in] opt The shuffle mode and seed of the embed.
+*\param[out] rep The report. go is 1 if no window is unsafe, or with
+*a payload if no window fails for it. max_safe_bytes is found by
+*bisection over the payload size, the safety of a size not being
+*strictly monotonic it is a safe size, not necessarily the largest.
+*With a payload that fits the search is skipped, max_safe_bytes is
+*then bytes if no window is unsafe and 0 otherwise.
+*\returns WM_OK or one of the WM_E* error codes.
+*/
+int analyze_capacity(struct image img, size_t bytes, const void *payload,
+        const struct wm_options *opt, struct capacity_report *rep) {
+    struct shuffle sh;
+    int status;
+    if (opt->shuffle == SHUFFLE_BANDED)
+        return analyze_layout(img, bytes, payload, NULL, opt->seed, rep);
+    if (shuffle_open_cached(&sh, img.cols * img.rows, opt->seed,
+            opt->shuffle, opt->cache_dir, opt->cache_limit) != 0)
+        return WM_ENOMEM;
+    status = analyze_layout(img, bytes, payload, &sh, opt->seed, rep);
+    shuffle_close(&sh);
+    return status;
+}
+
+/**
+*Like analyze_capacity, with a shuffle of img.cols * img.rows pixels
+*already opened, as for embed_shuffled.
+*/
+int analyze_capacity_shuffled(struct image img, size_t bytes,
+        const void *payload, const struct shuffle *sh,
+        struct capacity_report *rep) {
+    return analyze_layout(img, bytes, payload, sh, 0, rep);
+}
+
+/**
+*\param[in] sh The shuffle of the layout, NULL for SHUFFLE_BANDED
+*which is keyed by the seed.
+*/
+int analyze_layout(struct image img, size_t bytes, const void *payload,
+        const struct shuffle *sh, unsigned int seed,
+        struct capacity_report *rep) {
+    struct capacity_report probe;
+    struct layout lo;
+    size_t lo_bytes, hi_bytes, mid;
+    int *scratch, status = WM_OK;
+    memset(rep, 0, sizeof(*rep));
+    rep->bytes = bytes;
+    //a window never exceeds the pixels of one payload byte
+    scratch = (int *)malloc(((size_t)img.cols * img.rows / 8 + 1) * sizeof(int));
+    if (scratch == NULL)
+        return WM_ENOMEM;
+    //the requested size, in full
+    if (layout_init(&lo, img, sh, bytes, seed) == 0) {
+        rep->window = lo.window;
+        if (scan_layout(&lo, (const unsigned char *)payload, rep, scratch, 0) < 0)
+            status = WM_EINVAL;
+        rep->go = payload != NULL ? rep->failing == 0 : rep->unsafe == 0;
+    }
+    //the largest safe size, each probe stops at its first unsafe window
+    lo_bytes = 0;
+    hi_bytes = (size_t)img.cols * img.rows / 8;
+    if (rep->window > 0 && rep->unsafe == 0) {
+        lo_bytes = bytes;
+        if (payload != NULL)
+            hi_bytes = bytes;
+    } else if (payload != NULL && rep->go)
+        hi_bytes = 0;
+    else if (rep->window > 0 || bytes <= hi_bytes)
+        hi_bytes = bytes > 0 ? bytes - 1 : 0;
+    while (status == WM_OK && lo_bytes < hi_bytes) {
+        mid = lo_bytes + (hi_bytes - lo_bytes + 1) / 2;
+        memset(&probe, 0, sizeof(probe));
+        if (layout_init(&lo, img, sh, mid, seed) == 0 &&
+            scan_layout(&lo, NULL, &probe, scratch, 1) == 0)
+            lo_bytes = mid;
+        else
+            hi_bytes = mid - 1;
+    }
+    rep->max_safe_bytes = lo_bytes;
+    free(scratch);
+    return status;
+}
+
+int layout_init(struct layout *lo, struct image img, const struct shuffle *sh,
+        size_t bytes, unsigned int seed) {
+    lo->img = img;
+    lo->sh = sh;
+    lo->windows = 8 * (long)bytes;
+    if (sh == NULL) {
+        if (band_layout_init(&lo->bl, img.cols, img.rows, bytes, seed) != 0)
+            return -1;
+        lo->window = lo->bl.window;
+    } else {
+        lo->window = payload_window(img, bytes);
+    }
+    return lo->window > 0 ? 0 : -1;
+}
+
+/**
+*Counts the blacks of every window of the layout. The banded layout
+*is walked band by band, to open every band shuffle once.
+*\param[in] payload The bits to check the windows against, may be NULL.
+*\param[in] stop_early Stop at the first unsafe window.
+*\returns The number of unsafe windows seen.
+*/
+int scan_layout(const struct layout *lo, const unsigned char *payload,
+        struct capacity_report *rep, int *scratch, int stop_early) {
+    struct shuffle band;
+    const int *seq;
+    long i, k, n;
+    int b, top, bottom;
+    if (lo->sh != NULL) {
+        for (i = 0; i < lo->windows; i++) {
+            seq = shuffle_window(lo->sh, (int)(i * lo->window), lo->window,
+                    scratch);
+            if (check_window(lo, seq, i, payload, rep) && stop_early)
+                return 1;
+        }
+        return (int)rep->unsafe;
+    }
+    for (b = 0; b < lo->bl.nbands; b++) {
+        band_rows(&lo->bl, b, &top, &bottom);
+        if (band_open(&lo->bl, b, &band) != 0)
+            return -1;
+        n = band_bits(&lo->bl, b);
+        for (k = 0; k < n; k++) {
+            seq = band_window(&lo->bl, &band, k, top * lo->img.cols, scratch);
+            if (check_window(lo, seq, k * lo->bl.nbands + b, payload, rep) &&
+                stop_early) {
+                shuffle_close(&band);
+                return 1;
+            }
+        }
+        shuffle_close(&band);
+    }
+    return (int)rep->unsafe;
+}
+
+/**
+*Counts the blacks of the window carrying the payload bit i and
+*records it in the report.
+*\returns 1 if the window is unsafe.
+*/
+int check_window(const struct layout *lo, const int *seq, long i,
+        const unsigned char *payload, struct capacity_report *rep) {
+    struct weak_window w;
+    int bit;
+    w.index = i;
+    w.blacks = sum_of_blacks(lo->img, seq, lo->window);
+    w.whites = lo->window - w.blacks;
+    w.margin = w.whites - (3 - w.blacks % 3);
+    keep_weak(rep, &w);
+    if (w.margin >= 0)
+        return 0;
+    rep->unsafe++;
+    if (payload != NULL) {
+        //the bit of the parity of blacks / 3 costs no white
+        bit = (payload[i >> 3] >> (i & 7)) & 1;
+        rep->failing += (w.blacks / 3) % 2 != bit;
+    }
+    return 1;
+}
+
+/**
+*Inserts a window in the sorted list of the weakest.
+*/
+void keep_weak(struct capacity_report *rep, const struct weak_window *w) {
+    int k = rep->n_weak;
+    if (k == CAPACITY_WEAK) {
+        if (w->margin >= rep->weakest[k - 1].margin)
+            return;
+        k--;
+    } else {
+        rep->n_weak++;
+    }
+    for (; k > 0 && rep->weakest[k - 1].margin > w->margin; k--)
+        rep->weakest[k] = rep->weakest[k - 1];
+    rep->weakest[k] = *w;
+}
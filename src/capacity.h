@@ -0,0 +1,40 @@
+#ifndef CAPACITY_H
+#define CAPACITY_H 1
+
+#include "bin_watermarking.h"
+
+#define CAPACITY_WEAK 8 //the weakest windows reported
+
+/**
+*A window of the layout, with its margin: the whites left over
+*after the flips the worst bit needs. A negative margin means the
+*window cannot carry that bit.
+*/
+struct weak_window {
+    long index; //the payload bit the window carries
+    int blacks;
+    int whites;
+    int margin;
+};
+
+/**
+*The result of a capacity dry run, see analyze_capacity.
+*/
+struct capacity_report {
+    size_t bytes; //the payload size analyzed
+    int window; //pixels per window, 0 if the size does not fit at all
+    long unsafe; //windows that fail for one of the two bit values
+    long failing; //windows that fail for the given payload
+    int go; //1 if the embed is certain to succeed
+    size_t max_safe_bytes; //the largest size with no unsafe window found
+    int n_weak;
+    struct weak_window weakest[CAPACITY_WEAK]; //ascending margin
+};
+
+int analyze_capacity(struct image img, size_t bytes, const void *payload,
+        const struct wm_options *opt, struct capacity_report *rep);
+int analyze_capacity_shuffled(struct image img, size_t bytes,
+        const void *payload, const struct shuffle *sh,
+        struct capacity_report *rep);
+
+#endif
@@ -0,0 +1,54 @@
+/**
+*\file file_io.c
+*This module reads and writes whole files, the payloads of the batch
+*and the fingerprint templates the replay source plays back.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include "file_io.h"
+
+/**
+*Reads a whole file into memory.
+*\param[out] len The size of the file.
+*\returns The contents, released with free, or NULL if the file could
+*not be read or is empty.
+*/
+unsigned char *read_file(const char *path, size_t *len) {
+    FILE *f;
+    unsigned char *buf;
+    long size;
+    f = fopen(path, "rb");
+    if (f == NULL)
+        return NULL;
+    if (fseek(f, 0, SEEK_END) != 0 || (size = ftell(f)) <= 0 ||
+        fseek(f, 0, SEEK_SET) != 0) {
+        fclose(f);
+        return NULL;
+    }
+    buf = (unsigned char *)malloc(size);
+    if (buf != NULL && fread(buf, 1, size, f) != (size_t)size) {
+        free(buf);
+        buf = NULL;
+    }
+    fclose(f);
+    *len = size;
+    return buf;
+}
+
+/**
+*Writes len bytes to a file, replacing it.
+*\returns 0 on success, -1 on failure.
+*/
+int write_file(const char *path, const unsigned char *buf, size_t len) {
+    FILE *f;
+    int status = 0;
+    f = fopen(path, "wb");
+    if (f == NULL)
+        return -1;
+    if (fwrite(buf, 1, len, f) != len)
+        status = -1;
+    if (fclose(f) != 0)
+        status = -1;
+    return status;
+}
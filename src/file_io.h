@@ -0,0 +1,9 @@
+#ifndef FILE_IO_H
+#define FILE_IO_H 1
+
+#include <stddef.h>
+
+unsigned char *read_file(const char *path, size_t *len);
+int write_file(const char *path, const unsigned char *buf, size_t len);
+
+#endif
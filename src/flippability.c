@@ -8,6 +8,9 @@
 #include <stdlib.h>
 #include <assert.h>
 #include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <pthread.h>
 #include "flippability.h"
 
 /**
@@ -22,13 +25,41 @@ struct smooth {
     int anti;
 };
 
-float compute_score(unsigned char *pattern, int n);
-void print_lut(float *lut, int n);
-void print_image(unsigned char *image, int n);
-struct smooth smoothness(unsigned char *window, int n);
-int *connectivity(unsigned char *window, const int n);
-void discover_connections(int i, int j,
-unsigned char *current, int *touched, const int n);
+/**
+*The bit masks of an n x n pattern, bit r * n + c being the pixel
+*at row r and column c. Each mask marks the pixels that have a
+*neighbor in one direction, the first pixel of every pair.
+*/
+struct pattern_masks {
+    int n;
+    uint32_t all;
+    uint32_t right; //not in the last column
+    uint32_t down; //not in the last row
+    uint32_t down_right;
+    uint32_t down_left;
+    uint32_t center;
+    uint32_t cross; //the four neighbors of the center
+};
+
+/**
+*The share of the table computed by one thread.
+*/
+struct lut_job {
+    pthread_t thread;
+    const struct pattern_masks *m;
+    float *lut;
+    unsigned char *packed;
+    uint32_t first;
+    uint32_t last;
+};
+
+void pattern_masks_init(struct pattern_masks *m, int n);
+float compute_score(uint32_t pattern, const struct pattern_masks *m);
+struct smooth smoothness(uint32_t window, const struct pattern_masks *m);
+int clusters_change(uint32_t window, const struct pattern_masks *m);
+int distinct_clusters(uint32_t color, uint32_t seeds, const struct pattern_masks *m);
+void build_table(float *lut, unsigned char *packed, int n);
+void *lut_worker(void *arg);
 
 /**
 *This is the main function of this module. It's role is to
@@ -40,46 +71,157 @@ unsigned char *current, int *touched, const int n);
 *\returns nothing (exept that it creates the file)
 */
 void init_flippability_lut(int n) {
-    unsigned char *buf;
     float *lut;
-    int i, j;
     size_t io_items;
+    char name[32];
     FILE *f;
     //check if flippability look up table is present
-    f = fopen("flippalut.data", "r");
+    lut_file_name(name, sizeof(name), n);
+    f = fopen(name, "r");
     if ( f != NULL) {
         fclose(f);
         return;
     }
-    buf = (unsigned char *)calloc(n * n, sizeof(unsigned char));
     lut = (float *)calloc(1 << (n * n), sizeof(float)); //2 ^ n*n patterns
-    assert(buf != NULL && lut != NULL);
-    for (i = 0; i < (1 << (n * n)); i++) {
-        for (j = 0; j < n * n; j++) {
-            buf[j] = (i & (1 << j)) >> j;
-        }
-        lut[i] = compute_score(buf, n);
-    }
-    f = fopen("flippalut.data", "w");
+    assert(lut != NULL);
+    build_flippability_lut(lut, n);
+    f = fopen(name, "w");
     io_items = fwrite(lut, sizeof(float), 1 << (n * n), f);
     assert(io_items == (1 << (n * n)));
     free(lut);
-    free(buf);
     fclose(f);
 }
 
-float compute_score(unsigned char *pattern, int n) {
-    unsigned char *flipped;
-    int *con, *con_fl;
+/**
+*Computes the score of every n x n pattern into lut, which must
+*have room for 2 ^ (n * n) floats. This is what init_flippability_lut
+*saves to the disk and what mklut compiles into the binary.
+*/
+void build_flippability_lut(float *lut, int n) {
+    build_table(lut, NULL, n);
+}
+
+/**
+*Computes the bucket (score * 8, see score_bucket) of every n x n
+*pattern, two per byte: the pattern i is the low nibble of byte
+*i / 2 when i is even and the high nibble otherwise. The 5x5 table
+*takes 16 MB where the float one would take 128 MB.
+*\param[out] packed Room for 2 ^ (n * n) / 2 bytes, n > 1.
+*/
+void build_flippability_packed(unsigned char *packed, int n) {
+    build_table(NULL, packed, n);
+}
+
+/**
+*Spreads the patterns over one thread per online cpu. The kernel
+*works on the bits of the pattern index and allocates nothing.
+*/
+void build_table(float *lut, unsigned char *packed, int n) {
+    struct pattern_masks m;
+    struct lut_job *jobs;
+    uint32_t N = (uint32_t)1 << (n * n), share;
+    int t, threads;
+    pattern_masks_init(&m, n);
+    threads = (int)sysconf(_SC_NPROCESSORS_ONLN);
+    //the small tables are not worth a thread
+    if (threads < 1 || N < (1 << 16))
+        threads = 1;
+    jobs = (struct lut_job *)calloc(threads, sizeof(struct lut_job));
+    assert(jobs != NULL);
+    //the shares are even, two patterns never share a byte across threads
+    share = (N / threads) & ~(uint32_t)1;
+    for (t = 0; t < threads; t++) {
+        jobs[t].m = &m;
+        jobs[t].lut = lut;
+        jobs[t].packed = packed;
+        jobs[t].first = t * share;
+        jobs[t].last = t == threads - 1 ? N : (t + 1) * share;
+    }
+    for (t = 1; t < threads; t++) {
+        if (pthread_create(&jobs[t].thread, NULL, lut_worker, jobs + t) != 0)
+            lut_worker(jobs + t);
+        else
+            jobs[t].first = jobs[t].last + 1; //marks the started ones
+    }
+    lut_worker(jobs);
+    for (t = 1; t < threads; t++)
+        if (jobs[t].first > jobs[t].last)
+            pthread_join(jobs[t].thread, NULL);
+    free(jobs);
+}
+
+void *lut_worker(void *arg) {
+    struct lut_job *job = (struct lut_job *)arg;
+    uint32_t i, last = job->last;
+    float score;
+    int bucket;
+    for (i = job->first; i < last; i++) {
+        score = compute_score(i, job->m);
+        if (job->lut != NULL)
+            job->lut[i] = score;
+        if (job->packed != NULL) {
+            bucket = (int)(score * 8 + 0.5f);
+            if (i & 1)
+                job->packed[i >> 1] |= bucket << 4;
+            else
+                job->packed[i >> 1] = bucket;
+        }
+    }
+    return NULL;
+}
+
+/**
+*The 3x3 table keeps the historical flippalut.data name,
+*the other sizes get their own file.
+*/
+void lut_file_name(char *name, size_t len, int n) {
+    if (n == 3)
+        snprintf(name, len, "flippalut.data");
+    else
+        snprintf(name, len, "flippalut%d.data", n);
+}
+
+/**
+*Returns the score of a single n x n pattern, bit r * n + c being
+*the pixel at row r and column c.
+*/
+float pattern_score(uint32_t pattern, int n) {
+    struct pattern_masks m;
+    pattern_masks_init(&m, n);
+    return compute_score(pattern, &m);
+}
+
+void pattern_masks_init(struct pattern_masks *m, int n) {
+    int r, c;
+    uint32_t bit;
+    memset(m, 0, sizeof(*m));
+    m->n = n;
+    for (r = 0; r < n; r++) {
+        for (c = 0; c < n; c++) {
+            bit = (uint32_t)1 << (r * n + c);
+            m->all |= bit;
+            if (c < n - 1)
+                m->right |= bit;
+            if (r < n - 1)
+                m->down |= bit;
+            if (r < n - 1 && c < n - 1)
+                m->down_right |= bit;
+            if (r < n - 1 && c > 0)
+                m->down_left |= bit;
+        }
+    }
+    m->center = (uint32_t)1 << ((n >> 1) * n + (n >> 1));
+    m->cross = ((m->center & m->right) << 1) | ((m->center >> 1) & m->right) |
+            ((m->center & m->down) << n) | (m->center >> n);
+}
+
+float compute_score(uint32_t pattern, const struct pattern_masks *m) {
+    uint32_t flipped;
     struct smooth sm, sm_fl;
     float score;
-    flipped = (unsigned char *)calloc(n * n, sizeof(unsigned char));
-    memcpy(flipped, pattern, n * n * sizeof(unsigned char));
-    sm = smoothness(pattern, n);
-    con = connectivity(pattern, n);
-    flipped[(n >> 1) * n + (n >> 1)] ^= 1; //flip the central pixel
-    sm_fl = smoothness(flipped, n);
-    con_fl= connectivity(flipped, n);
+    sm = smoothness(pattern, m);
+    flipped = pattern ^ m->center; //flip the central pixel
+    sm_fl = smoothness(flipped, m);
     //trivial cases
     //1
     if ((sm.horiz + sm.vert + sm.diag + sm.anti) == 0 ||
@@ -106,135 +248,65 @@ float compute_score(unsigned char *pattern, int n) {
         score = score - 0.125;
     }
     //5
-    if (con[0] != con_fl[0] || con[1] != con_fl[1])
+    if (clusters_change(pattern, m))
         score = score - 0.125;
     return score;
 }
 
-void print_lut(float *lut, int n) {
-    int i, j, k, l;
-    for (i = 0; i < n; i++) {
-        for (j = 0; j < n; j++) {
-            for (k = 0; k < 3; k++) {
-                printf("{");
-                for (l = 0; l < 3; l++) {
-                    printf("%d, ", ((i * n + j) & (1 << k * 3 + l)) >> k * 3 + l);
-                }
-                printf("}\n");
-            }
-            printf("%f\n\n", lut[i * n + j]);
-        }
-    }
-}
-
-void print_image(unsigned char *image, int n) {
-    int i, j;
-    unsigned char px;
-    for (i = 0; i < n; i++) {
-        for (j = 0; j < n; j++) {
-            px = image[i * n + j] + 1; // {0,255} -> {1,0}
-            printf("%d ", px);
-        }
-        printf("\n");
-    }
-}
-
-struct smooth smoothness(unsigned char *window, int n) {
+/**
+*Counts the color transitions between the neighbors of the whole
+*window. The anti-diagonal ones have always been added to diag,
+*leaving anti at 0; the published tables depend on it, so it stays.
+*/
+struct smooth smoothness(uint32_t window, const struct pattern_masks *m) {
     struct smooth sm;
-    int k, l;
-    sm.horiz = sm.vert = sm.diag = sm.anti = 0;
-    for (k = -1; k <= 1; k++) {
-        for (l = -1; l <= 0; l++) {
-            //horizontal
-            if (window[(1 + k) * n + (1 + l)] != \
-                window[(1 + k) * n + (1 + l + 1)]) {
-                sm.horiz++;
-            }
-            //vertical
-            if (window[(1 + l) * n + (1 + k)] != \
-                window[(1 + l + 1) * n + (1 + k)]) {
-                sm.vert++;
-            }
-        }
-    }
-    for (k = -1; k <= 0; k++) {
-        for (l = -1; l <= 0; l++) {
-            //diagonal
-            if (window[(1 + k) * n + (1 + l)] != \
-                window[(1 + k + 1) * n + (1 + l + 1)]) {
-                sm.diag++;
-            }
-        }
-    }
-    for (k = 0; k <= 1; k++) {
-        for (l = -1; l <= 0; l++) {
-            //anti-diagonal
-            if (window[(1 + k) * n + (1 + l)] != \
-                window[(1 + k - 1) * n + (1 + l + 1)]) {
-                sm.diag++;
-            }
-        }
-    }
+    int n = m->n;
+    sm.horiz = __builtin_popcount((window ^ (window >> 1)) & m->right);
+    sm.vert = __builtin_popcount((window ^ (window >> n)) & m->down);
+    sm.diag = __builtin_popcount((window ^ (window >> (n + 1))) & m->down_right);
+    //anti-diagonal
+    sm.diag += __builtin_popcount((window ^ (window >> (n - 1))) & m->down_left);
+    sm.anti = 0;
     return sm;
 }
 
-
-
-
-int *connectivity(unsigned char *window, const int n) {
-    int *touched;
-    int i, j, *clusters;
-    touched = (int *)calloc(n * n, sizeof(int));
-    clusters = (int *)calloc(2, sizeof(int));
-    memset(touched, 0, n * n * sizeof(int));
-    memset(clusters, 0, 2 * sizeof(int));
-    for (i = 0; i < n; i++) {
-        for (j = 0; j < n; j++) {
-            if (touched[i * n + j] == 0) {
-                discover_connections(i, j, window, touched, n);
-                clusters[window[i * n + j]]++; //count the white or black clusters in the window
-            }
-        }
-    }
-    return clusters;
+/**
+*Tells whether flipping the central pixel changes the number of
+*4-connected clusters of white or black pixels. Only the clusters
+*around the center can change: the cluster losing the center splits
+*into one per distinct cluster among its neighbors of the same color,
+*and the neighbors of the other color merge into one. The counts stay
+*the same exactly when both sides are a single cluster.
+*/
+int clusters_change(uint32_t window, const struct pattern_masks *m) {
+    uint32_t same, other;
+    same = (window & m->center) ? window : ~window & m->all;
+    other = ~same & m->all;
+    return distinct_clusters(same & ~m->center, same & m->cross, m) != 1 ||
+        distinct_clusters(other, other & m->cross, m) != 1;
 }
 
-void discover_connections(int i, int j,
-unsigned char *window, int *touched, const int n) {
-    int nxt;
-    touched[i * n + j] = 1;
-    //right
-    if (j < n - 1) {
-        nxt = i * n + j + 1;
-        if ((touched[nxt] == 0) &&
-            (window[i * n + j] == window[nxt])) { //if not visited yet and is the same color
-            discover_connections(i, j + 1, window, touched, n);
-        }
-    }
-    //down
-    if (i < n - 1) {
-        nxt = (i + 1) * n + j;
-        if ((touched[nxt] == 0) &&
-            (window[i * n + j] == window[nxt])) { //if not visited yet and is the same color
-            discover_connections(i + 1, j, window, touched, n);
-        }
-    }
-    //left
-    if (j > 0) {
-        nxt = i * n + j - 1;
-        if ((touched[nxt] == 0) &&
-            (window[i * n + j] == window[nxt])) { //if not visited yet and is the same color
-            discover_connections(i, j - 1, window, touched, n);
-        }
-    }
-    //up
-    if (i > 0) {
-        nxt = (i - 1) * n + j;
-        if ((touched[nxt] == 0) &&
-            (window[i * n + j] == window[nxt])) { //if not visited yet and is the same color
-            discover_connections(i - 1, j, window, touched, n);
+/**
+*Counts the distinct clusters of the set bits of color that hold
+*the seeds, flooding each from a seed a step in all four directions
+*at a time.
+*/
+int distinct_clusters(uint32_t color, uint32_t seeds, const struct pattern_masks *m) {
+    uint32_t region, grown;
+    int clusters = 0;
+    while (seeds != 0) {
+        region = seeds & (~seeds + 1);
+        for (;;) {
+            grown = region | ((region & m->right) << 1) |
+                    ((region >> 1) & m->right) |
+                    ((region & m->down) << m->n) | (region >> m->n);
+            grown &= color;
+            if (grown == region)
+                break;
+            region = grown;
         }
+        seeds &= ~region;
+        clusters++;
     }
+    return clusters;
 }
-
-
@@ -1,6 +1,25 @@
 #ifndef FLIPPABILITY_H
 #define FLIPPABILITY_H
 
+#include <stddef.h>
+#include <stdint.h>
+
+#define FLIPPABILITY_MAX_N 5 //the pattern index of the largest size fits 32 bits
+
 void init_flippability_lut(int n);
+void build_flippability_lut(float *lut, int n);
+void build_flippability_packed(unsigned char *packed, int n);
+float pattern_score(uint32_t pattern, int n);
+void lut_file_name(char *name, size_t len, int n);
+const float *flippability_lut(int n);
+const unsigned char *flippability_packed(int n);
+
+/**
+*Returns the bucket of a pattern from a table of
+*build_flippability_packed.
+*/
+static inline int packed_bucket(const unsigned char *packed, uint32_t pattern) {
+    return (packed[pattern >> 1] >> ((pattern & 1) << 2)) & 0xf;
+}
 
 #endif
@@ -0,0 +1,127 @@
+/**
+*\file flippalut.c
+*Run time access to the flippability look up tables. The 3x3 table
+*comes from flippalut3.c, which mklut generates at build time.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include "flippability.h"
+
+#define PACKED_MAGIC "FPQ4" //followed by n and three zero bytes, then the table
+
+extern const float flippability_lut3[1 << (3 * 3)];
+
+static pthread_mutex_t tables_lock = PTHREAD_MUTEX_INITIALIZER;
+
+const unsigned char *load_packed(int n);
+
+/**
+*Returns the flippability look up table for n x n patterns.
+*The 3x3 table is linked into the binary so no file is touched.
+*Other sizes go through the disk cache of init_flippability_lut
+*and stay loaded for the rest of the process.
+*\returns The table or NULL if it could not be loaded.
+*/
+const float *flippability_lut(int n) {
+    static float *loaded[FLIPPABILITY_MAX_N + 1];
+    size_t items;
+    char name[32];
+    FILE *f;
+    if (n == 3)
+        return flippability_lut3;
+    if (n < 1 || n > FLIPPABILITY_MAX_N)
+        return NULL;
+    pthread_mutex_lock(&tables_lock);
+    if (loaded[n] != NULL) {
+        pthread_mutex_unlock(&tables_lock);
+        return loaded[n];
+    }
+    init_flippability_lut(n);
+    lut_file_name(name, sizeof(name), n);
+    f = fopen(name, "r");
+    if (f == NULL) {
+        pthread_mutex_unlock(&tables_lock);
+        return NULL;
+    }
+    loaded[n] = (float *)calloc(1 << (n * n), sizeof(float));
+    if (loaded[n] != NULL) {
+        items = fread(loaded[n], sizeof(float), 1 << (n * n), f);
+        if (items != (1 << (n * n))) {
+            free(loaded[n]);
+            loaded[n] = NULL;
+        }
+    }
+    fclose(f);
+    pthread_mutex_unlock(&tables_lock);
+    return loaded[n];
+}
+
+/**
+*Returns the bucket table of n x n patterns, see
+*build_flippability_packed. The 3x3 one is built in memory, the
+*larger ones are cached in flippalut<n>.q4 next to the float tables
+*and stay loaded for the rest of the process.
+*\returns The table or NULL if it could not be built.
+*/
+const unsigned char *flippability_packed(int n) {
+    static unsigned char *loaded[FLIPPABILITY_MAX_N + 1];
+    const unsigned char *packed;
+    if (n < 2 || n > FLIPPABILITY_MAX_N)
+        return NULL;
+    pthread_mutex_lock(&tables_lock);
+    if (loaded[n] == NULL)
+        loaded[n] = (unsigned char *)load_packed(n);
+    packed = loaded[n];
+    pthread_mutex_unlock(&tables_lock);
+    return packed;
+}
+
+/**
+*Reads the cached table of flippability_packed, building and saving
+*it first if the file is missing or does not match.
+*/
+const unsigned char *load_packed(int n) {
+    unsigned char header[8], *packed;
+    size_t len = (size_t)1 << (n * n - 1);
+    char name[32], tmp[48];
+    int ok;
+    FILE *f;
+    packed = (unsigned char *)malloc(len);
+    if (packed == NULL)
+        return NULL;
+    if (n == 3) {
+        build_flippability_packed(packed, n);
+        return packed;
+    }
+    snprintf(name, sizeof(name), "flippalut%d.q4", n);
+    f = fopen(name, "rb");
+    if (f != NULL) {
+        if (fread(header, 1, sizeof(header), f) == sizeof(header) &&
+            memcmp(header, PACKED_MAGIC, 4) == 0 && header[4] == n &&
+            fread(packed, 1, len, f) == len) {
+            fclose(f);
+            return packed;
+        }
+        fclose(f);
+    }
+    build_flippability_packed(packed, n);
+    //written aside and renamed, a concurrent reader never sees half
+    //a table; a cache that cannot be written only costs a rebuild
+    snprintf(tmp, sizeof(tmp), "%s.%ld", name, (long)getpid());
+    f = fopen(tmp, "wb");
+    if (f != NULL) {
+        memset(header, 0, sizeof(header));
+        memcpy(header, PACKED_MAGIC, 4);
+        header[4] = n;
+        ok = fwrite(header, 1, sizeof(header), f) == sizeof(header) &&
+            fwrite(packed, 1, len, f) == len;
+        if (fclose(f) != 0 || !ok || rename(tmp, name) != 0)
+            remove(tmp);
+    }
+    return packed;
+}
+
@@ -0,0 +1,198 @@
+/**
+*\file fpwm.c
+*This module is the reentrant face of the library. embed_opt and
+*extract_opt open a shuffle, score the image and allocate their
+*scratch on every call; the context keeps all of them between calls
+*and only grows them when an image needs more.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "flippability.h"
+#include "shuffle_cache.h"
+#include "score_map.h"
+#include "profile.h"
+#include "fpwm.h"
+
+struct fpwm {
+    struct wm_options opt;
+    const float *lut;
+    struct shuffle sh;
+    int pix_N; //the pixels of sh, 0 if none is open
+    struct score_map map;
+    int *scratch;
+    size_t scratch_len;
+    long allocations; //the times the context grew
+};
+
+int fpwm_shuffle(struct fpwm *ctx, int pix_N);
+int fpwm_sort(struct fpwm *ctx, int window);
+int fpwm_scratch(struct fpwm *ctx, int window);
+int fpwm_score(struct fpwm *ctx, int cols, int rows);
+
+/**
+*Creates a context.
+*\param[out] ctx The new context, released with fpwm_close.
+*\param[in] opt The shuffle mode, seed and cache of every call, NULL
+*for the defaults of wm_default_options. threads is ignored: the
+*calls run on the calling thread.
+*/
+int fpwm_open(struct fpwm **ctx, const struct wm_options *opt) {
+    struct fpwm *c;
+    *ctx = NULL;
+    c = (struct fpwm *)calloc(1, sizeof(struct fpwm));
+    if (c == NULL)
+        return WM_ENOMEM;
+    if (opt != NULL)
+        c->opt = *opt;
+    else
+        wm_default_options(&c->opt);
+    c->lut = flippability_lut(3);
+    if (c->lut == NULL || score_map_use(&c->map, c->opt.neighborhood) != 0) {
+        free(c);
+        return WM_ENOLUT;
+    }
+    *ctx = c;
+    return WM_OK;
+}
+
+void fpwm_close(struct fpwm *ctx) {
+    if (ctx == NULL)
+        return;
+    if (ctx->pix_N != 0)
+        shuffle_close(&ctx->sh);
+    score_map_free(&ctx->map);
+    free(ctx->scratch);
+    free(ctx);
+}
+
+/**
+*Same as embed_opt with the options of the context.
+*/
+int fpwm_embed(struct fpwm *ctx, struct image img, const void *payload,
+        size_t bytes) {
+    struct band_layout bl;
+    int window, status;
+    if (ctx->opt.shuffle == SHUFFLE_BANDED) {
+        if (band_layout_init(&bl, img.cols, img.rows, bytes, ctx->opt.seed) != 0)
+            return WM_EINVAL;
+        if (fpwm_scratch(ctx, bl.window) != 0)
+            return WM_ENOMEM;
+        //the bands are scored one at a time, with their context rows
+        status = fpwm_score(ctx, img.cols,
+                band_max_rows(&bl) + 2 * band_halo(&ctx->map));
+        if (status != WM_OK)
+            return status;
+        return embed_bands(img, &bl, payload, &ctx->map, ctx->scratch);
+    }
+    window = payload_window(img, bytes);
+    if (window <= 0)
+        return WM_EINVAL;
+    if (fpwm_shuffle(ctx, img.cols * img.rows) != 0 ||
+        fpwm_sort(ctx, window) != 0 ||
+        fpwm_scratch(ctx, window) != 0 || fpwm_score(ctx, img.cols, img.rows) != WM_OK)
+        return WM_ENOMEM;
+    return embed_windows(img, &ctx->map, ctx->lut, &ctx->sh, payload, bytes,
+            ctx->scratch);
+}
+
+/**
+*Same as extract_opt with the options of the context, on the
+*calling thread only.
+*/
+int fpwm_extract(struct fpwm *ctx, struct image img, void *payload,
+        size_t bytes) {
+    struct band_layout bl;
+    int window;
+    if (ctx->opt.shuffle == SHUFFLE_BANDED) {
+        if (band_layout_init(&bl, img.cols, img.rows, bytes, ctx->opt.seed) != 0)
+            return WM_EINVAL;
+        if (fpwm_scratch(ctx, bl.window) != 0)
+            return WM_ENOMEM;
+        return extract_bands(img, &bl, payload, ctx->scratch);
+    }
+    window = payload_window(img, bytes);
+    if (window <= 0)
+        return WM_EINVAL;
+    if (fpwm_shuffle(ctx, img.cols * img.rows) != 0 ||
+        fpwm_sort(ctx, window) != 0 || fpwm_scratch(ctx, window) != 0)
+        return WM_ENOMEM;
+    return extract_bytes(img, &ctx->sh, window, (unsigned char *)payload, 0,
+            bytes, ctx->scratch);
+}
+
+/**
+*Returns the number of times the context allocated, which stays put
+*once the context is warm for the sizes it is given.
+*/
+long fpwm_allocations(const struct fpwm *ctx) {
+    return ctx->allocations;
+}
+
+/**
+*Makes the shuffle of the context the one of pix_N pixels,
+*reopening it only when the size changes.
+*/
+int fpwm_shuffle(struct fpwm *ctx, int pix_N) {
+    int status;
+    if (ctx->pix_N == pix_N)
+        return 0;
+    if (ctx->pix_N != 0)
+        shuffle_close(&ctx->sh);
+    ctx->pix_N = 0;
+    PROF_BEGIN(PROF_SHUFFLE);
+    status = shuffle_open_cached(&ctx->sh, pix_N, ctx->opt.seed,
+            ctx->opt.shuffle, ctx->opt.cache_dir, ctx->opt.cache_limit);
+    PROF_END(PROF_SHUFFLE);
+    if (status != 0)
+        return -1;
+    ctx->pix_N = pix_N;
+    ctx->allocations++;
+    return 0;
+}
+
+/**
+*Sorts the windows of the shuffle for the payload size of the call,
+*see shuffle_sort_windows. The context pays for it once per size and
+*every later call gathers its windows in memory order.
+*/
+int fpwm_sort(struct fpwm *ctx, int window) {
+    if (ctx->sh.sequence == NULL || ctx->sh.block_window == window)
+        return 0;
+    if (shuffle_sort_windows(&ctx->sh, window) != 0)
+        return -1;
+    ctx->allocations++;
+    return 0;
+}
+
+/**
+*Grows the scratch to a window, if the shuffle computes its windows.
+*/
+int fpwm_scratch(struct fpwm *ctx, int window) {
+    int *grown;
+    if (ctx->opt.shuffle != SHUFFLE_FEISTEL &&
+        ctx->opt.shuffle != SHUFFLE_BANDED)
+        return 0;
+    if (ctx->scratch_len >= (size_t)window)
+        return 0;
+    grown = (int *)realloc(ctx->scratch, window * sizeof(int));
+    if (grown == NULL)
+        return -1;
+    ctx->scratch = grown;
+    ctx->scratch_len = window;
+    ctx->allocations++;
+    return 0;
+}
+
+/**
+*Makes room in the score map for cols x rows pixels, which embed
+*then rebuilds in place.
+*/
+int fpwm_score(struct fpwm *ctx, int cols, int rows) {
+    unsigned char *bucket = ctx->map.bucket;
+    if (score_map_reserve(&ctx->map, cols, rows) != 0)
+        return WM_ENOMEM;
+    ctx->allocations += ctx->map.bucket != bucket;
+    return WM_OK;
+}
@@ -0,0 +1,25 @@
+#ifndef FPWM_H
+#define FPWM_H 1
+
+#include <stddef.h>
+#include "bin_watermarking.h"
+
+/**
+*The libfpwm context. It owns the flippability table, the shuffle
+*of the last image size and the scratch the embed/extract calls
+*need, so once warmed up by a first call, calls on images of the
+*same size make no heap allocation. A context is not shared: every
+*thread uses its own, and contexts never touch each other's state.
+*Every function returns WM_OK or one of the WM_E* error codes.
+*/
+struct fpwm;
+
+int fpwm_open(struct fpwm **ctx, const struct wm_options *opt);
+void fpwm_close(struct fpwm *ctx);
+int fpwm_embed(struct fpwm *ctx, struct image img, const void *payload,
+        size_t bytes);
+int fpwm_extract(struct fpwm *ctx, struct image img, void *payload,
+        size_t bytes);
+long fpwm_allocations(const struct fpwm *ctx);
+
+#endif
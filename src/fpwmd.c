@@ -0,0 +1,211 @@
+/**
+*\file fpwmd.c
+*The watermarking daemon and its client.
+*
+*   fpwmd [-j threads] [-s mode] [-n 3|5] [-c dir] -S socket
+*   fpwmd -C socket -w in.pbm out.pbm payload
+*   fpwmd -C socket -a in.pbm payload
+*   fpwmd -C socket -q
+*
+*-S serves the requests on the socket until -q stops it, with -j
+*threads embedding in the shuffle mode of -s with the neighborhood of
+*-n, the shuffles cached in the directory of -c. The client options
+*talk to the daemon of -C: -w embeds the payload file in in.pbm and
+*saves the result to out.pbm, -a extracts the payload of in.pbm to
+*the payload file. Both print the times of the daemon and the round
+*trip.
+*/
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pbm.h>
+#include "bin_watermarking.h"
+#include "pbm_io.h"
+#include "wm_daemon.h"
+#include "profile.h"
+
+int client_embed(int sock, const char *in, const char *out,
+        const char *payload);
+int client_extract(int sock, const char *in, const char *payload);
+int load_shared(const char *path, int *fd, struct image *img);
+void print_reply(const char *what, const struct daemon_reply *rp,
+        double round_trip);
+
+int main(int argc, char **argv) {
+    struct wm_options options;
+    struct daemon_request rq;
+    struct daemon_reply rp;
+    int opt, sock = -1, r = 0;
+    //INIT
+    pbm_init(&argc, argv);
+    wm_default_options(&options);
+    options.threads = 0;
+    options.shuffle = SHUFFLE_FISHER_YATES;
+    //PROCESS
+    while ((opt = getopt(argc, argv, "j:s:n:c:S:C:w:a:q")) != -1) {
+        switch (opt) {
+        case 'j':
+            options.threads = atoi(optarg);
+            break;
+        case 's':
+            if (shuffle_mode_parse(optarg, &options.shuffle) != 0) {
+                fprintf(stderr, "-s takes a shuffle mode from %d to %d\n",
+                        SHUFFLE_FLOYD, SHUFFLE_BANDED);
+                return 1;
+            }
+            break;
+        case 'n':
+            options.neighborhood = atoi(optarg);
+            break;
+        case 'c':
+            options.cache_dir = optarg;
+            break;
+        case 'S':
+            r = daemon_serve(optarg, &options);
+            if (r != WM_OK)
+                fprintf(stderr, "%s: %s\n", optarg, wm_strerror(r));
+            return r != WM_OK;
+        case 'C':
+            if (sock >= 0)
+                close(sock);
+            sock = daemon_connect(optarg);
+            if (sock < 0) {
+                fprintf(stderr, "Cannot connect to %s\n", optarg);
+                return 1;
+            }
+            break;
+        case 'w':
+            if (sock < 0 || optind + 1 >= argc) {
+                fprintf(stderr, "-w needs -C and in.pbm out.pbm payload\n");
+                return 1;
+            }
+            if (client_embed(sock, optarg, argv[optind], argv[optind + 1]) != 0)
+                r = 1;
+            optind += 2;
+            break;
+        case 'a':
+            if (sock < 0 || optind >= argc) {
+                fprintf(stderr, "-a needs -C and in.pbm payload\n");
+                return 1;
+            }
+            if (client_extract(sock, optarg, argv[optind]) != 0)
+                r = 1;
+            optind++;
+            break;
+        case 'q':
+            memset(&rq, 0, sizeof(rq));
+            rq.op = DAEMON_QUIT;
+            if (sock < 0 || daemon_call(sock, &rq, -1, -1, &rp) != WM_OK) {
+                r = 1;
+            } else if (rp.status != WM_OK) {
+                //a refused quit is answered, but is no success
+                fprintf(stderr, "-q: %s\n", wm_strerror(rp.status));
+                r = 1;
+            }
+            break;
+        default:
+            printf("Bad argument\n");
+            r = 1;
+        }
+    }
+    //FREE
+    if (sock >= 0)
+        close(sock);
+    return r;
+}
+
+int client_embed(int sock, const char *in, const char *out,
+        const char *payload) {
+    struct daemon_request rq;
+    struct daemon_reply rp;
+    struct image img;
+    double start;
+    int fd, payload_fd, status;
+    if (load_shared(in, &fd, &img) != 0)
+        return -1;
+    payload_fd = open(payload, O_RDONLY | O_CLOEXEC);
+    if (payload_fd < 0) {
+        fprintf(stderr, "Cannot read %s\n", payload);
+        shared_image_unmap(&img);
+        close(fd);
+        return -1;
+    }
+    memset(&rq, 0, sizeof(rq));
+    rq.op = DAEMON_EMBED;
+    start = clock_seconds();
+    status = daemon_call(sock, &rq, fd, payload_fd, &rp);
+    if (status == WM_OK)
+        print_reply("embed", &rp, 1e3 * (clock_seconds() - start));
+    else
+        fprintf(stderr, "The daemon is gone\n");
+    //the daemon watermarked the shared pixels in place
+    if (status == WM_OK && rp.status == WM_OK &&
+        pbm_save(out, img, NULL) != 0) {
+        fprintf(stderr, "Cannot write %s\n", out);
+        status = WM_EIO;
+    }
+    close(payload_fd);
+    shared_image_unmap(&img);
+    close(fd);
+    return status == WM_OK && rp.status == WM_OK ? 0 : -1;
+}
+
+int client_extract(int sock, const char *in, const char *payload) {
+    struct daemon_request rq;
+    struct daemon_reply rp;
+    struct image img;
+    double start;
+    int fd, out_fd, status;
+    if (load_shared(in, &fd, &img) != 0)
+        return -1;
+    out_fd = open(payload, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (out_fd < 0) {
+        fprintf(stderr, "Cannot write %s\n", payload);
+        shared_image_unmap(&img);
+        close(fd);
+        return -1;
+    }
+    memset(&rq, 0, sizeof(rq));
+    rq.op = DAEMON_EXTRACT;
+    start = clock_seconds();
+    status = daemon_call(sock, &rq, fd, out_fd, &rp);
+    if (status == WM_OK)
+        print_reply("extract", &rp, 1e3 * (clock_seconds() - start));
+    else
+        fprintf(stderr, "The daemon is gone\n");
+    close(out_fd);
+    shared_image_unmap(&img);
+    close(fd);
+    return status == WM_OK && rp.status == WM_OK ? 0 : -1;
+}
+
+/**
+*Reads a pbm into a new shared image.
+*/
+int load_shared(const char *path, int *fd, struct image *img) {
+    struct image src;
+    if (pbm_load(path, &src, NULL) != 0) {
+        fprintf(stderr, "Cannot read %s\n", path);
+        return -1;
+    }
+    if (shared_image_create(src.cols, src.rows, fd, img) != 0) {
+        fprintf(stderr, "Cannot share %s\n", path);
+        image_free(&src);
+        return -1;
+    }
+    memcpy(img->words, src.words,
+            (size_t)src.stride * src.rows * sizeof(uint64_t));
+    image_free(&src);
+    return 0;
+}
+
+void print_reply(const char *what, const struct daemon_reply *rp,
+        double round_trip) {
+    printf("%s: %s, %u bytes, map %.3f ms, work %.3f ms, daemon %.3f ms, "
+            "round trip %.3f ms\n", what, wm_strerror(rp->status),
+            rp->length, rp->map_ms, rp->work_ms, rp->total_ms, round_trip);
+}
@@ -0,0 +1,186 @@
+/**
+*\file image_diff.c
+*This module compares an image with its watermarked copy in packed
+*form. The differing pixels are the set bits of the XOR of the two
+*images, counted 64 at a time with popcount; only the flipped pixels
+*themselves are looked at one by one, to score them in the original
+*on the scale of the embed, the buckets of score_map.h.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pbm.h>
+#include "bin_watermarking.h"
+#include "flippability.h"
+#include "score_map.h"
+#include "image_diff.h"
+
+void count_tiles(uint64_t x, int base, int tile, long *counts);
+void count_scores(struct image a, int r, uint64_t x, int base,
+        const float *lut, const unsigned char *packed, long *scores);
+void diff_json_string(FILE *f, const char *s);
+
+/**
+*Compares a with b, two images of the same size, typically an
+*original and its watermarked copy.
+*\param tile The side of the tiles the flips are counted by, DIFF_TILE
+*if <= 0.
+*\param neighborhood The side of the patterns the flips are scored by,
+*3 or 5, as the -n of the embed.
+*\param[out] bitmap Allocated with the differing pixels in black if
+*not NULL, for pbm_save. The caller frees it.
+*\param[out] rep The counts, released by diff_report_free.
+*\returns WM_OK or one of the WM_E* error codes.
+*/
+int image_diff(struct image a, struct image b, int tile, int neighborhood,
+        struct image *bitmap, struct diff_report *rep) {
+    const uint64_t *ra, *rb;
+    uint64_t x, *out = NULL;
+    const float *lut;
+    const unsigned char *packed = NULL;
+    double density;
+    long *counts, pixels;
+    int r, k, tx, ty, w, h;
+    //INIT
+    memset(rep, 0, sizeof(*rep));
+    if (a.cols != b.cols || a.rows != b.rows || a.cols <= 0 || a.rows <= 0 ||
+        (neighborhood != 3 && neighborhood != SCORE_MAX_N))
+        return WM_EINVAL;
+    lut = flippability_lut(3);
+    if (neighborhood == SCORE_MAX_N)
+        packed = flippability_packed(neighborhood);
+    if (lut == NULL || (neighborhood == SCORE_MAX_N && packed == NULL))
+        return WM_ENOLUT;
+    rep->neighborhood = neighborhood;
+    if (tile <= 0)
+        tile = DIFF_TILE;
+    rep->cols = a.cols;
+    rep->rows = a.rows;
+    rep->tile = tile;
+    rep->tiles_x = (a.cols + tile - 1) / tile;
+    rep->tiles_y = (a.rows + tile - 1) / tile;
+    rep->tile_flips = (long *)calloc((size_t)rep->tiles_x * rep->tiles_y,
+            sizeof(long));
+    if (rep->tile_flips == NULL)
+        return WM_ENOMEM;
+    if (bitmap != NULL && image_alloc(bitmap, a.cols, a.rows) != 0) {
+        diff_report_free(rep);
+        return WM_ENOMEM;
+    }
+    //PROCESS
+    for (r = 0; r < a.rows; r++) {
+        ra = image_row(a, r);
+        rb = image_row(b, r);
+        if (bitmap != NULL)
+            out = image_row(*bitmap, r);
+        counts = rep->tile_flips + (size_t)(r / tile) * rep->tiles_x;
+        for (k = 0; k < a.stride; k++) {
+            //the padding bits are zero in both, never counted
+            x = ra[k] ^ rb[k];
+            if (out != NULL)
+                out[k] = x;
+            if (x == 0)
+                continue;
+            rep->flips += __builtin_popcountll(x);
+            count_tiles(x, k << 6, tile, counts);
+            count_scores(a, r, x, k << 6, lut, packed, rep->score_flips);
+        }
+    }
+    for (k = 0; k < DIFF_LOW_BUCKET; k++)
+        rep->low_score += rep->score_flips[k];
+    //the edge tiles are smaller, compare densities rather than counts
+    rep->max_density = 0;
+    for (ty = 0; ty < rep->tiles_y; ty++) {
+        h = ty == rep->tiles_y - 1 ? a.rows - ty * tile : tile;
+        for (tx = 0; tx < rep->tiles_x; tx++) {
+            w = tx == rep->tiles_x - 1 ? a.cols - tx * tile : tile;
+            pixels = (long)w * h;
+            density = (double)rep->tile_flips[(size_t)ty * rep->tiles_x + tx]
+                / pixels;
+            if (density > rep->max_density) {
+                rep->max_density = density;
+                rep->densest_x = tx;
+                rep->densest_y = ty;
+            }
+        }
+    }
+    return WM_OK;
+}
+
+/**
+*Adds the set bits of x, the columns base to base + 63 of a row, to
+*the counts of their tiles, a popcount per tile the word spans.
+*/
+void count_tiles(uint64_t x, int base, int tile, long *counts) {
+    uint64_t part;
+    int tx, end;
+    while (x != 0) {
+        tx = (base + __builtin_ctzll(x)) / tile;
+        end = (tx + 1) * tile - base;
+        if (end >= 64) {
+            counts[tx] += __builtin_popcountll(x);
+            break;
+        }
+        part = x & (((uint64_t)1 << end) - 1);
+        counts[tx] += __builtin_popcountll(part);
+        x ^= part;
+    }
+}
+
+/**
+*Adds the set bits of x, the columns base to base + 63 of the row r,
+*to the counts of the buckets their pixel scores in a.
+*/
+void count_scores(struct image a, int r, uint64_t x, int base,
+        const float *lut, const unsigned char *packed, long *scores) {
+    for (; x != 0; x &= x - 1)
+        scores[pixel_bucket(a, r, base + __builtin_ctzll(x), lut, packed)]++;
+}
+
+/**
+*Writes the report as one JSON object, the flips per tile as an
+*array of tile rows.
+*\param a, b The names of the images compared.
+*/
+void diff_report_json(FILE *f, const char *a, const char *b,
+        const struct diff_report *rep) {
+    int tx, ty, k;
+    fprintf(f, "{\"a\":");
+    diff_json_string(f, a);
+    fprintf(f, ",\"b\":");
+    diff_json_string(f, b);
+    fprintf(f, ",\"cols\":%d,\"rows\":%d,\"flips\":%ld,\"low_score_flips\":%ld,"
+            "\"neighborhood\":%d,\"score_flips\":[", rep->cols, rep->rows,
+            rep->flips, rep->low_score, rep->neighborhood);
+    for (k = 0; k < SCORE_BUCKETS; k++)
+        fprintf(f, "%s%ld", k ? "," : "", rep->score_flips[k]);
+    fprintf(f, "],\"tile\":%d,\"tiles_x\":%d,\"tiles_y\":%d,"
+            "\"max_density\":%.6f,\"densest_tile\":[%d,%d],\"tile_flips\":[",
+            rep->tile, rep->tiles_x, rep->tiles_y, rep->max_density,
+            rep->densest_x, rep->densest_y);
+    for (ty = 0; ty < rep->tiles_y; ty++) {
+        fprintf(f, "%s[", ty ? "," : "");
+        for (tx = 0; tx < rep->tiles_x; tx++)
+            fprintf(f, "%s%ld", tx ? "," : "",
+                    rep->tile_flips[(size_t)ty * rep->tiles_x + tx]);
+        fprintf(f, "]");
+    }
+    fprintf(f, "]}\n");
+}
+
+void diff_json_string(FILE *f, const char *s) {
+    fputc('"', f);
+    for (; *s != '\0'; s++) {
+        if (*s == '"' || *s == '\\')
+            fputc('\\', f);
+        if ((unsigned char)*s >= 0x20)
+            fputc(*s, f);
+    }
+    fputc('"', f);
+}
+
+void diff_report_free(struct diff_report *rep) {
+    free(rep->tile_flips);
+    rep->tile_flips = NULL;
+}
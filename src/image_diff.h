@@ -0,0 +1,36 @@
+#ifndef IMAGE_DIFF_H
+#define IMAGE_DIFF_H 1
+
+#include <stdio.h>
+#include "packed_image.h"
+#include "score_map.h"
+
+#define DIFF_TILE 64 //the default side of the tiles
+#define DIFF_LOW_BUCKET 1 //flips scoring below this bucket are low score
+
+/**
+*The comparison of an image with its watermarked copy, see image_diff.
+*/
+struct diff_report {
+    int cols;
+    int rows;
+    long flips; //the pixels that differ
+    int tile; //the side of the tiles
+    int tiles_x;
+    int tiles_y;
+    long *tile_flips; //the flips of every tile, row major
+    int densest_x; //the tile with the most flips per pixel
+    int densest_y;
+    double max_density; //its flips per pixel
+    int neighborhood; //the side of the patterns the flips are scored by
+    long score_flips[SCORE_BUCKETS]; //the flips by bucket of their score in a
+    long low_score; //the flips below DIFF_LOW_BUCKET, those a never offered
+};
+
+int image_diff(struct image a, struct image b, int tile, int neighborhood,
+        struct image *bitmap, struct diff_report *rep);
+void diff_report_json(FILE *f, const char *a, const char *b,
+        const struct diff_report *rep);
+void diff_report_free(struct diff_report *rep);
+
+#endif
@@ -0,0 +1,139 @@
+/**
+*\file inflate_sink.c
+*This module uncompresses a payload while it is extracted. The
+*extraction hands every chunk it decodes to inflate, so a corrupt
+*payload is rejected as soon as zlib sees it, usually long before the
+*last window is read, and the size of the uncompressed data need not
+*be known in advance.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "inflate_sink.h"
+
+int inflate_sink_grow(struct inflate_sink *s);
+
+/**
+*\param[in] hint The expected uncompressed size, 0 if unknown. The
+*output starts there and doubles when it is full.
+*\returns WM_OK or WM_ENOMEM.
+*/
+int inflate_sink_init(struct inflate_sink *s, size_t hint) {
+    memset(s, 0, sizeof(*s));
+    s->cap = hint > 0 ? hint : 4096;
+    s->out = (unsigned char *)malloc(s->cap);
+    if (s->out == NULL)
+        return WM_ENOMEM;
+    if (inflateInit(&s->zs) != Z_OK) {
+        free(s->out);
+        s->out = NULL;
+        return WM_ENOMEM;
+    }
+    s->zs.next_out = s->out;
+    s->zs.avail_out = (uInt)s->cap;
+    s->crc = crc32(0L, Z_NULL, 0);
+    return WM_OK;
+}
+
+/**
+*The sink of extract_each, arg being a struct inflate_sink. Inflates
+*the chunk right away. The bytes past the end of the stream are only
+*checksummed.
+*\returns WM_OK, WM_ECORRUPT if the stream is not valid zlib data, or
+*WM_ENOMEM.
+*/
+int inflate_sink_write(void *arg, const unsigned char *chunk, size_t len) {
+    struct inflate_sink *s = (struct inflate_sink *)arg;
+    int r, status;
+    s->crc = crc32(s->crc, chunk, (uInt)len);
+    if (s->done)
+        return WM_OK;
+    s->zs.next_in = (Bytef *)chunk;
+    s->zs.avail_in = (uInt)len;
+    do {
+        if (s->zs.avail_out == 0) {
+            status = inflate_sink_grow(s);
+            if (status != WM_OK)
+                return status;
+        }
+        r = inflate(&s->zs, Z_NO_FLUSH);
+        if (r == Z_STREAM_END)
+            s->done = 1;
+        else if (r == Z_MEM_ERROR)
+            return WM_ENOMEM;
+        else if (r != Z_OK && r != Z_BUF_ERROR)
+            return WM_ECORRUPT;
+    } while (!s->done && (s->zs.avail_in > 0 || s->zs.avail_out == 0));
+    return WM_OK;
+}
+
+/**
+*Hands over the uncompressed data, which the caller frees, and
+*releases the stream.
+*\returns WM_OK, or WM_ECORRUPT if the stream was cut short.
+*/
+int inflate_sink_finish(struct inflate_sink *s, unsigned char **out,
+        size_t *len) {
+    if (!s->done) {
+        inflate_sink_free(s);
+        return WM_ECORRUPT;
+    }
+    *out = s->out;
+    *len = s->zs.total_out;
+    s->out = NULL;
+    inflate_sink_free(s);
+    return WM_OK;
+}
+
+void inflate_sink_free(struct inflate_sink *s) {
+    inflateEnd(&s->zs);
+    free(s->out);
+    s->out = NULL;
+}
+
+/**
+*Extracts a compressed payload of the given size and uncompresses it
+*on the fly, see extract_each.
+*\param[in] hint The expected uncompressed size, 0 if unknown.
+*\param[out] out The uncompressed data, which the caller frees.
+*\param[out] crc The CRC-32 of the compressed payload, NULL if not needed.
+*\returns WM_OK, WM_ECORRUPT if the payload is not valid zlib data, or
+*one of the other WM_E* error codes.
+*/
+int extract_inflate(struct image img, size_t bytes,
+        const struct wm_options *opt, size_t hint, unsigned char **out,
+        size_t *len, uint32_t *crc) {
+    struct inflate_sink s;
+    int status;
+    status = inflate_sink_init(&s, hint);
+    if (status != WM_OK)
+        return status;
+    status = extract_each(img, bytes, opt, inflate_sink_write, &s);
+    if (status != WM_OK) {
+        inflate_sink_free(&s);
+        return status;
+    }
+    if (crc != NULL)
+        *crc = (uint32_t)s.crc;
+    return inflate_sink_finish(&s, out, len);
+}
+
+/**
+*Doubles the output, keeping what was inflated.
+*\returns WM_OK, WM_ENOMEM, or WM_ECORRUPT past INFLATE_SINK_LIMIT.
+*/
+int inflate_sink_grow(struct inflate_sink *s) {
+    unsigned char *grown;
+    size_t cap = 2 * s->cap;
+    if (cap > INFLATE_SINK_LIMIT)
+        return WM_ECORRUPT;
+    grown = (unsigned char *)realloc(s->out, cap);
+    if (grown == NULL)
+        return WM_ENOMEM;
+    s->out = grown;
+    s->zs.next_out = grown + s->zs.total_out;
+    s->zs.avail_out = (uInt)(cap - s->zs.total_out);
+    s->cap = cap;
+    return WM_OK;
+}
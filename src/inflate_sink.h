@@ -0,0 +1,31 @@
+#ifndef INFLATE_SINK_H
+#define INFLATE_SINK_H 1
+
+#include <stddef.h>
+#include <zlib.h>
+#include "bin_watermarking.h"
+
+#define INFLATE_SINK_LIMIT (1UL << 30) //the largest output, against bombs
+
+/**
+*The state of a zlib stream fed by extract_each, see
+*inflate_sink_write. The output grows to fit.
+*/
+struct inflate_sink {
+    z_stream zs;
+    unsigned char *out;
+    size_t cap; //the room of out
+    uLong crc; //the CRC-32 of the compressed bytes fed so far
+    int done; //the stream has ended
+};
+
+int inflate_sink_init(struct inflate_sink *s, size_t hint);
+int inflate_sink_write(void *arg, const unsigned char *chunk, size_t len);
+int inflate_sink_finish(struct inflate_sink *s, unsigned char **out,
+        size_t *len);
+void inflate_sink_free(struct inflate_sink *s);
+int extract_inflate(struct image img, size_t bytes,
+        const struct wm_options *opt, size_t hint, unsigned char **out,
+        size_t *len, uint32_t *crc);
+
+#endif
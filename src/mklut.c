@@ -0,0 +1,38 @@
+/**
+*\file mklut.c
+*Build time generator of the built-in flippability look up table.
+*It prints a C source file with the scores of every n x n pattern,
+*computed by the same criteria init_flippability_lut uses.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include "flippability.h"
+
+int main(int argc, char **argv) {
+    int n, i;
+    float *lut;
+    if (argc != 2) {
+        fprintf(stderr, "usage: %s n\n", argv[0]);
+        return 1;
+    }
+    n = atoi(argv[1]);
+    if (n < 1 || n > 4) {
+        fprintf(stderr, "unsupported pattern size %d\n", n);
+        return 1;
+    }
+    lut = (float *)calloc(1 << (n * n), sizeof(float));
+    if (lut == NULL)
+        return 1;
+    build_flippability_lut(lut, n);
+    printf("/* Generated by mklut %d, do not edit. */\n", n);
+    printf("const float flippability_lut%d[%d] = {\n", n, 1 << (n * n));
+    for (i = 0; i < (1 << (n * n)); i++) {
+        printf("%s%a,", (i % 8) == 0 ? "    " : " ", lut[i]);
+        if ((i % 8) == 7)
+            printf("\n");
+    }
+    printf("};\n");
+    free(lut);
+    return 0;
+}
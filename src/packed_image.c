@@ -0,0 +1,43 @@
+/**
+*\file packed_image.c
+*This module holds the packed (one bit per pixel) representation
+*of a binary image. The conversions from/to the libnetpbm bitmaps
+*are in pbm_io.c, the library does not link libnetpbm.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include "packed_image.h"
+
+/**
+*Allocates a white (all zero) packed image.
+*\param[out] img The image to be initialized.
+*\param[in] cols The width of the image.
+*\param[in] rows The height of the image.
+*\returns 0 on success, -1 if the allocation failed.
+*/
+int image_alloc(struct image *img, int cols, int rows) {
+    img->cols = cols;
+    img->rows = rows;
+    img->stride = (cols + 63) >> 6;
+    img->words = (uint64_t *)calloc((size_t)img->stride * rows, sizeof(uint64_t));
+    if (img->words == NULL)
+        return -1;
+    return 0;
+}
+
+void image_free(struct image *img) {
+    free(img->words);
+    img->words = NULL;
+}
+
+/**
+*Counts the black pixels of the whole image a word at a time.
+*/
+long image_count_blacks(struct image img) {
+    size_t i, n = (size_t)img.stride * img.rows;
+    long sum = 0;
+    for (i = 0; i < n; i++)
+        sum += __builtin_popcountll(img.words[i]);
+    return sum;
+}
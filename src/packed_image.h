@@ -0,0 +1,56 @@
+#ifndef PACKED_IMAGE_H
+#define PACKED_IMAGE_H 1
+
+#include <stddef.h>
+#include <stdint.h>
+
+//the pixel values of libnetpbm, which the library does not link
+#ifndef PBM_WHITE
+#define PBM_WHITE 0
+#define PBM_BLACK 1
+#endif
+
+/**
+*Packed binary image, one bit per pixel.
+*Every row occupies stride 64-bit words. Pixel (r, c) is the bit
+*(c & 63) of the word r * stride + (c >> 6), a set bit is a black
+*pixel (PBM_BLACK). The padding bits past cols are always zero.
+*/
+struct image {
+    int cols;
+    int rows;
+    int stride;
+    uint64_t *words;
+};
+
+int image_alloc(struct image *img, int cols, int rows);
+void image_free(struct image *img);
+long image_count_blacks(struct image img);
+
+static inline uint64_t *image_row(struct image img, int r) {
+    return img.words + (size_t)r * img.stride;
+}
+
+static inline int image_get(struct image img, int r, int c) {
+    return (image_row(img, r)[c >> 6] >> (c & 63)) & 1;
+}
+
+static inline void image_toggle(struct image img, int r, int c) {
+    image_row(img, r)[c >> 6] ^= (uint64_t)1 << (c & 63);
+}
+
+/**
+*Returns the pixels c - 1, c, c + 1 of a row as a 3 bit number,
+*c - 1 being the least significant bit. The caller guarantees
+*0 < c < cols - 1.
+*/
+static inline unsigned int image_triplet(const uint64_t *row, int c) {
+    int b = c - 1, off = b & 63;
+    const uint64_t *w = row + (b >> 6);
+    uint64_t v = w[0] >> off;
+    if (off > 61)
+        v |= w[1] << (64 - off);
+    return (unsigned int)(v & 7);
+}
+
+#endif
@@ -0,0 +1,429 @@
+/**
+*\file pbm_io.c
+*This module reads and writes the portable bitmaps together with
+*the watermark trailer. Errors are returned, never fatal, so that
+*one bad file does not end a process serving many.
+*
+*The raw (P4) files never go through libnetpbm: the file is mapped
+*and its raster packed straight into the image words, and the output
+*is produced in one buffer and written at once. The plain (P1) files
+*are left to pbm_readpbm.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <setjmp.h>
+#include <pthread.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <pbm.h>
+#include "shuffling.h"
+#include "pbm_io.h"
+
+//libnetpbm reports errors through one process wide jump buffer
+static pthread_mutex_t netpbm_lock = PTHREAD_MUTEX_INITIALIZER;
+
+bit **read_bitmap(FILE *f, int *cols, int *rows);
+int load_raw(const unsigned char *data, size_t size, struct image *img,
+        struct wm_trailer *tr);
+size_t parse_header(const unsigned char *data, size_t size, int *cols, int *rows);
+void parse_trailer(const unsigned char *p, const unsigned char *end,
+        struct wm_trailer *tr);
+uint64_t reverse_bytes_bits(uint64_t x);
+void pack_row(const unsigned char *src, uint64_t *row, int cols);
+void unpack_row(const uint64_t *row, unsigned char *dst, int cols);
+/**
+*Packs a row of pbm bytes into image words. The bits past cols
+*may hold anything in a pbm, they are cleared in the image.
+*/
+void pack_row(const unsigned char *src, uint64_t *row, int cols) {
+    size_t row_bytes = (cols + 7) >> 3;
+    int w, k, n, stride = (cols + 63) >> 6;
+    uint64_t word;
+    for (w = 0; w < stride; w++) {
+        n = row_bytes - ((size_t)w << 3) < 8 ? row_bytes - (w << 3) : 8;
+        word = 0;
+        for (k = 0; k < n; k++)
+            word |= (uint64_t)src[k] << (k << 3);
+        row[w] = reverse_bytes_bits(word);
+        src += n;
+    }
+    if (cols & 63)
+        row[stride - 1] &= ((uint64_t)1 << (cols & 63)) - 1;
+}
+
+void unpack_row(const uint64_t *row, unsigned char *dst, int cols) {
+    size_t row_bytes = (cols + 7) >> 3;
+    int w, k, n, stride = (cols + 63) >> 6;
+    uint64_t word;
+    for (w = 0; w < stride; w++) {
+        //the first pixel is the most significant bit of a pbm byte
+        word = reverse_bytes_bits(row[w]);
+        n = row_bytes - ((size_t)w << 3) < 8 ? row_bytes - (w << 3) : 8;
+        for (k = 0; k < n; k++)
+            *dst++ = (unsigned char)(word >> (k << 3));
+    }
+}
+
+int write_all(int fd, const unsigned char *buf, size_t len);
+
+/**
+*Packs a libnetpbm bitmap (one byte per pixel) into a packed image.
+*The bitmap is left untouched, the caller still owns it.
+*\returns 0 on success, -1 if the allocation failed.
+*/
+int image_from_bitmap(struct image *img, bit **bitmap, int cols, int rows) {
+    int r, c;
+    uint64_t *row, word;
+    if (image_alloc(img, cols, rows) != 0)
+        return -1;
+    for (r = 0; r < rows; r++) {
+        row = image_row(*img, r);
+        for (c = 0; c < cols; c += 64) {
+            int k, n = cols - c < 64 ? cols - c : 64;
+            word = 0;
+            for (k = 0; k < n; k++)
+                word |= (uint64_t)(bitmap[r][c + k] == PBM_BLACK) << k;
+            row[c >> 6] = word;
+        }
+    }
+    return 0;
+}
+
+/**
+*Unpacks the image into a freshly allocated libnetpbm bitmap,
+*to be released with pbm_freearray.
+*/
+bit **image_to_bitmap(struct image img) {
+    int r, c;
+    bit **bitmap;
+    bitmap = pbm_allocarray(img.cols, img.rows);
+    for (r = 0; r < img.rows; r++) {
+        for (c = 0; c < img.cols; c++) {
+            bitmap[r][c] = image_get(img, r, c) ? PBM_BLACK : PBM_WHITE;
+        }
+    }
+    return bitmap;
+}
+
+/**
+*Reads a pbm file into a packed image.
+*\param[in] path The file to be read.
+*\param[out] img The image, released with image_free.
+*\param[out] tr The watermark trailer, may be NULL.
+*\returns 0 on success, -1 if the file could not be read.
+*/
+int pbm_load(const char *path, struct image *img, struct wm_trailer *tr) {
+    FILE *f;
+    bit **bitmap;
+    struct stat st;
+    void *data;
+    int fd, cols, rows, status, mode;
+    long length;
+    //RAW
+    fd = open(path, O_RDONLY);
+    if (fd < 0)
+        return -1;
+    if (fstat(fd, &st) != 0 || st.st_size < 2) {
+        close(fd);
+        return -1;
+    }
+    data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED)
+        return -1;
+    if (memcmp(data, "P4", 2) == 0) {
+        madvise(data, st.st_size, MADV_SEQUENTIAL);
+        status = load_raw((const unsigned char *)data, st.st_size, img, tr);
+        munmap(data, st.st_size);
+        return status;
+    }
+    munmap(data, st.st_size);
+    //PLAIN
+    f = fopen(path, "rb");
+    if (f == NULL)
+        return -1;
+    bitmap = read_bitmap(f, &cols, &rows);
+    if (bitmap == NULL) {
+        fclose(f);
+        return -1;
+    }
+    status = image_from_bitmap(img, bitmap, cols, rows);
+    pbm_freearray(bitmap, rows);
+    if (tr != NULL) {
+        tr->length = 0;
+        tr->mode = SHUFFLE_FLOYD;
+        if (fscanf(f, "\n#%ld", &length) == 1) {
+            tr->length = length;
+            if (fscanf(f, " %d", &mode) == 1)
+                tr->mode = mode;
+        }
+    }
+    fclose(f);
+    return status;
+}
+
+/**
+*Writes a packed image as a raw pbm, followed by the trailer
+*if tr is not NULL. The whole file is built in memory and handed
+*to a single write.
+*\returns 0 on success, -1 on failure.
+*/
+int pbm_save(const char *path, struct image img, const struct wm_trailer *tr) {
+    unsigned char *buf, *p;
+    size_t row_bytes, size;
+    int fd, r, header, status;
+    char head[64], tail[64];
+    //INIT
+    header = snprintf(head, sizeof(head), "P4\n%d %d\n", img.cols, img.rows);
+    tail[0] = '\0';
+    if (tr != NULL)
+        snprintf(tail, sizeof(tail), "\n#%ld %d", tr->length, tr->mode);
+    row_bytes = (img.cols + 7) >> 3;
+    size = header + row_bytes * img.rows + strlen(tail);
+    buf = (unsigned char *)malloc(size);
+    if (buf == NULL)
+        return -1;
+    //PROCESS
+    memcpy(buf, head, header);
+    p = buf + header;
+    for (r = 0; r < img.rows; r++, p += row_bytes)
+        unpack_row(image_row(img, r), p, img.cols);
+    memcpy(p, tail, strlen(tail));
+    fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        free(buf);
+        return -1;
+    }
+    status = write_all(fd, buf, size);
+    if (close(fd) != 0)
+        status = -1;
+    //FREE
+    free(buf);
+    return status;
+}
+
+/**
+*Reads the header of a raw pbm and leaves f at its raster, for
+*the callers going through the image a few rows at a time.
+*\returns 0 on success, -1 if f does not start with a P4 header.
+*/
+int pbm_read_header(FILE *f, int *cols, int *rows) {
+    unsigned char head[4096];
+    size_t n, offset;
+    n = fread(head, 1, sizeof(head), f);
+    if (n < 2 || memcmp(head, "P4", 2) != 0)
+        return -1;
+    offset = parse_header(head, n, cols, rows);
+    if (offset == 0 || fseek(f, offset, SEEK_SET) != 0)
+        return -1;
+    return 0;
+}
+
+/**
+*Reads the next n raster rows of f into the rows [first, first + n)
+*of img.
+*\returns 0 on success, -1 on a short read or allocation failure.
+*/
+int pbm_read_rows(FILE *f, struct image img, int first, int n) {
+    unsigned char *buf;
+    size_t row_bytes = (img.cols + 7) >> 3;
+    int r;
+    buf = (unsigned char *)malloc(row_bytes * n + 1);
+    if (buf == NULL)
+        return -1;
+    if (fread(buf, row_bytes, n, f) != (size_t)n) {
+        free(buf);
+        return -1;
+    }
+    for (r = 0; r < n; r++)
+        pack_row(buf + r * row_bytes, image_row(img, first + r), img.cols);
+    free(buf);
+    return 0;
+}
+
+int pbm_write_header(FILE *f, int cols, int rows) {
+    return fprintf(f, "P4\n%d %d\n", cols, rows) > 0 ? 0 : -1;
+}
+
+/**
+*Appends the rows [first, first + n) of img to the raster of f.
+*\returns 0 on success, -1 on failure.
+*/
+int pbm_write_rows(FILE *f, struct image img, int first, int n) {
+    unsigned char *buf;
+    size_t row_bytes = (img.cols + 7) >> 3;
+    int r, status;
+    buf = (unsigned char *)malloc(row_bytes * n + 1);
+    if (buf == NULL)
+        return -1;
+    for (r = 0; r < n; r++)
+        unpack_row(image_row(img, first + r), buf + r * row_bytes, img.cols);
+    status = fwrite(buf, row_bytes, n, f) == (size_t)n ? 0 : -1;
+    free(buf);
+    return status;
+}
+
+int pbm_write_trailer(FILE *f, const struct wm_trailer *tr) {
+    return fprintf(f, "\n#%ld %d", tr->length, tr->mode) > 0 ? 0 : -1;
+}
+
+/**
+*Reads only the trailer of a raw pbm, seeking past the raster.
+*\returns 0 on success, -1 if the file is not a raw pbm.
+*/
+int pbm_read_trailer(const char *path, struct wm_trailer *tr) {
+    FILE *f;
+    unsigned char tail[64];
+    int cols, rows;
+    size_t n;
+    f = fopen(path, "rb");
+    if (f == NULL)
+        return -1;
+    if (pbm_read_header(f, &cols, &rows) != 0 ||
+        fseek(f, (long)((cols + 7) >> 3) * rows, SEEK_CUR) != 0) {
+        fclose(f);
+        return -1;
+    }
+    n = fread(tail, 1, sizeof(tail), f);
+    parse_trailer(tail, tail + n, tr);
+    fclose(f);
+    return 0;
+}
+
+/**
+*Packs the raster of a mapped P4 file into an image.
+*\returns 0 on success, -1 if the file is malformed or the
+*allocation failed.
+*/
+int load_raw(const unsigned char *data, size_t size, struct image *img,
+        struct wm_trailer *tr) {
+    const unsigned char *src;
+    size_t offset, row_bytes;
+    int cols, rows, r;
+    offset = parse_header(data, size, &cols, &rows);
+    if (offset == 0)
+        return -1;
+    row_bytes = (cols + 7) >> 3;
+    if ((size - offset) / row_bytes < (size_t)rows)
+        return -1;
+    if (image_alloc(img, cols, rows) != 0)
+        return -1;
+    src = data + offset;
+    for (r = 0; r < rows; r++, src += row_bytes)
+        pack_row(src, image_row(*img, r), cols);
+    if (tr != NULL)
+        parse_trailer(src, data + size, tr);
+    return 0;
+}
+
+/**
+*Parses "P4 <cols> <rows>" and the single whitespace ending the
+*header, skipping the comments as libnetpbm does.
+*\returns The offset of the raster, 0 if the header is malformed.
+*/
+size_t parse_header(const unsigned char *data, size_t size, int *cols, int *rows) {
+    size_t i = 2;
+    int f;
+    long v;
+    for (f = 0; f < 2; f++) {
+        for (;;) {
+            while (i < size && (data[i] == ' ' || data[i] == '\t' ||
+                    data[i] == '\n' || data[i] == '\r'))
+                i++;
+            if (i < size && data[i] == '#') {
+                while (i < size && data[i] != '\n')
+                    i++;
+            } else {
+                break;
+            }
+        }
+        if (i == size || data[i] < '0' || data[i] > '9')
+            return 0;
+        for (v = 0; i < size && data[i] >= '0' && data[i] <= '9'; i++) {
+            v = v * 10 + (data[i] - '0');
+            if (v > INT32_MAX)
+                return 0;
+        }
+        if (f == 0)
+            *cols = (int)v;
+        else
+            *rows = (int)v;
+    }
+    //one whitespace, then the raster
+    if (i == size || *cols <= 0 || *rows <= 0 ||
+        (long)*cols * *rows > INT32_MAX)
+        return 0;
+    return i + 1;
+}
+
+/**
+*Parses the "\n#<length> <mode>" that may follow the raster.
+*/
+void parse_trailer(const unsigned char *p, const unsigned char *end,
+        struct wm_trailer *tr) {
+    long v;
+    tr->length = 0;
+    tr->mode = SHUFFLE_FLOYD;
+    while (p < end && (*p == '\n' || *p == '\r' || *p == ' '))
+        p++;
+    if (p == end || *p++ != '#' || p == end || *p < '0' || *p > '9')
+        return;
+    for (v = 0; p < end && *p >= '0' && *p <= '9'; p++)
+        v = v * 10 + (*p - '0');
+    tr->length = v;
+    while (p < end && *p == ' ')
+        p++;
+    if (p == end || *p < '0' || *p > '9')
+        return;
+    for (v = 0; p < end && *p >= '0' && *p <= '9'; p++)
+        v = v * 10 + (*p - '0');
+    tr->mode = (int)v;
+}
+
+/**
+*Mirrors the bits of every byte of x. The image words hold the
+*first pixel in the least significant bit, the pbm bytes in the
+*most significant one.
+*/
+uint64_t reverse_bytes_bits(uint64_t x) {
+    x = ((x >> 1) & 0x5555555555555555ULL) | ((x & 0x5555555555555555ULL) << 1);
+    x = ((x >> 2) & 0x3333333333333333ULL) | ((x & 0x3333333333333333ULL) << 2);
+    x = ((x >> 4) & 0x0f0f0f0f0f0f0f0fULL) | ((x & 0x0f0f0f0f0f0f0f0fULL) << 4);
+    return x;
+}
+
+int write_all(int fd, const unsigned char *buf, size_t len) {
+    ssize_t n;
+    while (len > 0) {
+        n = write(fd, buf, len);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        buf += n;
+        len -= n;
+    }
+    return 0;
+}
+
+/**
+*pbm_readpbm with its errors caught instead of ending the process.
+*/
+bit **read_bitmap(FILE *f, int *cols, int *rows) {
+    bit **volatile bitmap = NULL;
+    jmp_buf jb, *saved;
+    pthread_mutex_lock(&netpbm_lock);
+    pm_setjmpbufsave(&jb, &saved);
+    if (setjmp(jb) == 0)
+        bitmap = pbm_readpbm(f, cols, rows);
+    pm_setjmpbuf(saved);
+    pthread_mutex_unlock(&netpbm_lock);
+    return bitmap;
+}
@@ -0,0 +1,28 @@
+#ifndef PBM_IO_H
+#define PBM_IO_H 1
+
+#include <stdio.h>
+#include <pbm.h>
+#include "packed_image.h"
+
+/**
+*The "#<length> <shuffle mode>" comment fbw writes after the raster
+*of a watermarked image. Older images carry only the length.
+*/
+struct wm_trailer {
+    long length; //0 if the image has no trailer
+    int mode; //SHUFFLE_FLOYD if not recorded
+};
+
+int pbm_load(const char *path, struct image *img, struct wm_trailer *tr);
+int pbm_save(const char *path, struct image img, const struct wm_trailer *tr);
+int pbm_read_header(FILE *f, int *cols, int *rows);
+int pbm_read_rows(FILE *f, struct image img, int first, int n);
+int pbm_read_trailer(const char *path, struct wm_trailer *tr);
+int pbm_write_header(FILE *f, int cols, int rows);
+int pbm_write_rows(FILE *f, struct image img, int first, int n);
+int pbm_write_trailer(FILE *f, const struct wm_trailer *tr);
+int image_from_bitmap(struct image *img, bit **bitmap, int cols, int rows);
+bit **image_to_bitmap(struct image img);
+
+#endif
@@ -0,0 +1,192 @@
+/**
+*\file print_device.c
+*This module is the fingerprint source of a reader, through
+*libfprint. It paces the scans for a person at the sensor.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <libfprint/fprint.h>
+#include "print_source.h"
+
+int device_enroll(struct print_source *ps, unsigned char **data, size_t *len);
+int device_verify(struct print_source *ps, const unsigned char *data,
+        size_t len);
+void device_close(struct print_source *ps);
+struct fp_dev *open_device(void);
+struct fp_dscv_dev *discover_device(struct fp_dscv_dev **discovered_devs);
+struct fp_print_data *enroll(struct fp_dev *dev);
+int verify(struct fp_dev *dev, struct fp_print_data *data);
+
+/**
+*Opens a source on the first fingerprint reader. Exits if there is
+*none, as the interactive modes cannot go on without it.
+*\returns 0.
+*/
+int device_open(struct print_source *ps) {
+    ps->enroll = device_enroll;
+    ps->verify = device_verify;
+    ps->close = device_close;
+    ps->state = open_device();
+    return 0;
+}
+
+int device_enroll(struct print_source *ps, unsigned char **data, size_t *len) {
+    struct fp_print_data *print;
+    printf("Opened device. It's now time to enroll your finger.\n");
+    print = enroll((struct fp_dev *)ps->state);
+    if (print == NULL)
+        return -1;
+    *len = fp_print_data_get_data(print, data);
+    fp_print_data_free(print);
+    return *len > 0 ? 0 : -1;
+}
+
+int device_verify(struct print_source *ps, const unsigned char *data,
+        size_t len) {
+    struct fp_print_data *print;
+    int r;
+    print = fp_print_data_from_data((unsigned char *)data, len);
+    if (print == NULL)
+        return -1;
+    r = verify((struct fp_dev *)ps->state, print);
+    fp_print_data_free(print);
+    return r;
+}
+
+void device_close(struct print_source *ps) {
+    fp_dev_close((struct fp_dev *)ps->state);
+    ps->state = NULL;
+}
+
+/**
+*Initializes libfprint and opens the first fingerprint reader.
+*/
+struct fp_dev *open_device(void) {
+    struct fp_dscv_dev *ddev;
+    struct fp_dscv_dev **discovered_devs;
+    struct fp_dev *dev;
+    int r;
+    r = fp_init();
+    if (r < 0) {
+        fprintf(stderr, "Failed to initialize libfprint\n");
+        exit(1);
+    }
+    fp_set_debug(3);
+    discovered_devs = fp_discover_devs();
+    if (!discovered_devs) {
+        fprintf(stderr, "Could not discover devices\n");
+        abort();
+    }
+    ddev = discover_device(discovered_devs);
+    if (!ddev) {
+        fprintf(stderr, "No devices detected.\n");
+        abort();
+    }
+    dev = fp_dev_open(ddev);
+    fp_dscv_devs_free(discovered_devs);
+    if (!dev) {
+        fprintf(stderr, "Could not open device.\n");
+        abort();
+    }
+    return dev;
+}
+
+struct fp_dscv_dev *discover_device(struct fp_dscv_dev **discovered_devs)
+{
+    struct fp_dscv_dev *ddev = discovered_devs[0];
+    struct fp_driver *drv;
+    if (!ddev)
+        return NULL;
+
+    drv = fp_dscv_dev_get_driver(ddev);
+    printf("Found device claimed by %s driver\n", fp_driver_get_full_name(drv));
+    return ddev;
+}
+
+struct fp_print_data *enroll(struct fp_dev *dev) {
+    struct fp_print_data *enrolled_print = NULL;
+    int r;
+
+    printf("You will need to successfully scan your finger %d times to "
+            "complete the process.\n", fp_dev_get_nr_enroll_stages(dev));
+
+    do {
+        sleep(1);
+        printf("\nScan your finger now.\n");
+
+        r = fp_enroll_finger(dev, &enrolled_print);
+        if (r < 0) {
+            printf("Enroll failed with error %d\n", r);
+            return NULL;
+        }
+        switch (r) {
+            case FP_ENROLL_COMPLETE:
+                printf("Enroll complete!\n");
+                break;
+            case FP_ENROLL_FAIL:
+                printf("Enroll failed, something wen't wrong :(\n");
+                return NULL;
+            case FP_ENROLL_PASS:
+                printf("Enroll stage passed. Yay!\n");
+                break;
+            case FP_ENROLL_RETRY:
+                printf("Didn't quite catch that. Please try again.\n");
+                break;
+            case FP_ENROLL_RETRY_TOO_SHORT:
+                printf("Your swipe was too short, please try again.\n");
+                break;
+            case FP_ENROLL_RETRY_CENTER_FINGER:
+                printf("Didn't catch that, please center your finger on the "
+                        "sensor and try again.\n");
+                break;
+            case FP_ENROLL_RETRY_REMOVE_FINGER:
+                printf("Scan failed, please remove your finger and then try "
+                        "again.\n");
+                break;
+        }
+    } while (r != FP_ENROLL_COMPLETE);
+
+    if (!enrolled_print) {
+        fprintf(stderr, "Enroll complete but no print?\n");
+        return NULL;
+    }
+
+    printf("Enrollment completed!\n\n");
+    return enrolled_print;
+}
+
+int verify(struct fp_dev *dev, struct fp_print_data *data)
+{
+    int r;
+    do {
+        sleep(1);
+        printf("\nScan your finger now.\n");
+        r = fp_verify_finger(dev, data);
+        if (r < 0) {
+            printf("verification failed with error %d :(\n", r);
+            return r;
+        }
+        switch (r) {
+            case FP_VERIFY_NO_MATCH:
+                printf("NO MATCH!\n");
+                return 0;
+            case FP_VERIFY_MATCH:
+                printf("MATCH!\n");
+                return 1;
+            case FP_VERIFY_RETRY:
+                printf("Scan didn't quite work. Please try again.\n");
+                break;
+            case FP_VERIFY_RETRY_TOO_SHORT:
+                printf("Swipe was too short, please try again.\n");
+                break;
+            case FP_VERIFY_RETRY_CENTER_FINGER:
+                printf("Please center your finger on the sensor and try again.\n");
+                break;
+            case FP_VERIFY_RETRY_REMOVE_FINGER:
+                printf("Please remove finger from the sensor and try again.\n");
+                break;
+        }
+    } while (1);
+}
@@ -0,0 +1,122 @@
+/**
+*\file print_source.c
+*This module replays fingerprint templates stored in files, so the
+*whole watermarking pipeline runs without a reader, at full speed.
+*The files are read once, when the source is opened. Every enroll
+*returns the next one, round robin, and verify takes the last one
+*enrolled, the first before any enroll, as the finger on the sensor
+*and matches it against the template it was given.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "file_io.h"
+#include "print_source.h"
+
+struct replay {
+    int n; //the number of templates
+    unsigned char **data;
+    size_t *len;
+    int enrolled; //the number of enrolls so far
+    int (*match)(const unsigned char *probe, size_t probe_len,
+            const unsigned char *data, size_t len);
+};
+
+int replay_enroll(struct print_source *ps, unsigned char **data, size_t *len);
+int replay_verify(struct print_source *ps, const unsigned char *data,
+        size_t len);
+void replay_close(struct print_source *ps);
+
+/**
+*Opens a source replaying the given templates.
+*\param[in] paths The template files, separated by commas.
+*\param[in] match The matcher verify calls, returning 1 on a match
+*and 0 otherwise, NULL for match_bytes.
+*\returns 0, or -1 if a file could not be read.
+*/
+int replay_open(struct print_source *ps, const char *paths,
+        int (*match)(const unsigned char *probe, size_t probe_len,
+            const unsigned char *data, size_t len)) {
+    struct replay *r;
+    char *list, *path, *save;
+    int n;
+    const char *p;
+    for (n = 1, p = paths; *p != '\0'; p++)
+        n += *p == ',';
+    r = (struct replay *)calloc(1, sizeof(struct replay));
+    list = strdup(paths);
+    if (r == NULL || list == NULL) {
+        free(r);
+        free(list);
+        return -1;
+    }
+    r->data = (unsigned char **)calloc(n, sizeof(unsigned char *));
+    r->len = (size_t *)calloc(n, sizeof(size_t));
+    r->match = match != NULL ? match : match_bytes;
+    ps->enroll = replay_enroll;
+    ps->verify = replay_verify;
+    ps->close = replay_close;
+    ps->state = r;
+    if (r->data == NULL || r->len == NULL) {
+        free(list);
+        replay_close(ps);
+        return -1;
+    }
+    for (path = strtok_r(list, ",", &save); path != NULL;
+            path = strtok_r(NULL, ",", &save)) {
+        r->data[r->n] = read_file(path, r->len + r->n);
+        if (r->data[r->n] == NULL) {
+            fprintf(stderr, "Cannot read the template %s\n", path);
+            free(list);
+            replay_close(ps);
+            return -1;
+        }
+        r->n++;
+    }
+    free(list);
+    if (r->n == 0) {
+        replay_close(ps);
+        return -1;
+    }
+    return 0;
+}
+
+/**
+*The byte-wise matcher: a template matches only itself.
+*/
+int match_bytes(const unsigned char *probe, size_t probe_len,
+        const unsigned char *data, size_t len) {
+    return probe_len == len && memcmp(probe, data, len) == 0;
+}
+
+int replay_enroll(struct print_source *ps, unsigned char **data, size_t *len) {
+    struct replay *r = (struct replay *)ps->state;
+    int i = r->enrolled++ % r->n;
+    *data = (unsigned char *)malloc(r->len[i]);
+    if (*data == NULL)
+        return -1;
+    memcpy(*data, r->data[i], r->len[i]);
+    *len = r->len[i];
+    return 0;
+}
+
+int replay_verify(struct print_source *ps, const unsigned char *data,
+        size_t len) {
+    struct replay *r = (struct replay *)ps->state;
+    int i = r->enrolled > 0 ? (r->enrolled - 1) % r->n : 0;
+    return r->match(r->data[i], r->len[i], data, len);
+}
+
+void replay_close(struct print_source *ps) {
+    struct replay *r = (struct replay *)ps->state;
+    int i;
+    if (r == NULL)
+        return;
+    for (i = 0; i < r->n; i++)
+        free(r->data[i]);
+    free(r->data);
+    free(r->len);
+    free(r);
+    ps->state = NULL;
+}
@@ -0,0 +1,34 @@
+#ifndef PRINT_SOURCE_H
+#define PRINT_SOURCE_H 1
+
+#include <stddef.h>
+
+/**
+*Where the front end gets the fingerprints from. The reader of
+*print_device.c is one source, the files of replay_open another.
+*/
+struct print_source {
+    /**
+    *Enrolls a finger.
+    *\param[out] data The template, which the caller frees.
+    *\returns 0, or -1 if no template could be taken.
+    */
+    int (*enroll)(struct print_source *ps, unsigned char **data, size_t *len);
+    /**
+    *Scans a finger and matches it against a template.
+    *\returns 1 on a match, 0 on a mismatch, < 0 on an error.
+    */
+    int (*verify)(struct print_source *ps, const unsigned char *data,
+            size_t len);
+    void (*close)(struct print_source *ps);
+    void *state;
+};
+
+int replay_open(struct print_source *ps, const char *paths,
+        int (*match)(const unsigned char *probe, size_t probe_len,
+            const unsigned char *data, size_t len));
+int match_bytes(const unsigned char *probe, size_t probe_len,
+        const unsigned char *data, size_t len);
+int device_open(struct print_source *ps);
+
+#endif
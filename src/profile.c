@@ -0,0 +1,198 @@
+/**
+*\file profile.c
+*This module collects the phase timers and counters of embed and
+*extract when built with -DFPWM_PROFILE, see profile.h. The clock
+*every timing of the programs reads is built in any case.
+*/
+
+#include <time.h>
+#include "profile.h"
+
+/**
+*\returns The seconds of the monotonic clock, for the differences
+*between two calls.
+*/
+double clock_seconds(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+#ifdef FPWM_PROFILE
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+
+static const char *phase_names[PROF_PHASES] = {
+    "lut", "shuffle", "score", "scan", "flip", "sum"
+};
+static const char *counter_names[PROF_COUNTERS] = {
+    "windows", "scored", "flips", "failed"
+};
+
+static FILE *output; //NULL for stderr
+static __thread struct prof local;
+static __thread double started[PROF_PHASES];
+static __thread uint64_t started_cycles[PROF_PHASES];
+static __thread uint64_t started_misses[PROF_PHASES];
+static __thread int perf_fd = -2; //-2 not opened yet, -1 not available
+static __thread int perf_member = -1; //the cache misses, read through perf_fd
+
+static int perf_group(void);
+static int perf_read(uint64_t *cycles, uint64_t *misses);
+
+void prof_begin(enum prof_phase phase) {
+    started[phase] = clock_seconds();
+    if (perf_group() >= 0)
+        perf_read(started_cycles + phase, started_misses + phase);
+}
+
+void prof_end(enum prof_phase phase) {
+    uint64_t cycles, misses;
+    if (perf_fd >= 0 && perf_read(&cycles, &misses) == 0) {
+        local.cycles[phase] += cycles - started_cycles[phase];
+        local.misses[phase] += misses - started_misses[phase];
+    }
+    local.ns[phase] += (uint64_t)((clock_seconds() - started[phase]) * 1e9);
+    local.calls[phase]++;
+}
+
+void prof_count(enum prof_counter counter, uint64_t n) {
+    local.count[counter] += n;
+}
+
+/**
+*Moves the record of the calling thread to dst, used by the worker
+*threads to hand their share to the thread that spawned them.
+*/
+void prof_take(struct prof *dst) {
+    *dst = local;
+    memset(&local, 0, sizeof(local));
+}
+
+/**
+*Adds a record taken from another thread to the calling thread's.
+*/
+void prof_merge(const struct prof *src) {
+    int i;
+    for (i = 0; i < PROF_PHASES; i++) {
+        local.ns[i] += src->ns[i];
+        local.calls[i] += src->calls[i];
+        local.cycles[i] += src->cycles[i];
+        local.misses[i] += src->misses[i];
+    }
+    for (i = 0; i < PROF_COUNTERS; i++)
+        local.count[i] += src->count[i];
+}
+
+/**
+*Sets the file the reports go to.
+*/
+void prof_output(FILE *f) {
+    output = f;
+}
+
+/**
+*Writes the record of the calling thread as one JSON line and
+*clears it for the next image. The line is written at once, so
+*the reports of concurrent threads do not mix.
+*/
+void prof_report(const char *image) {
+    char line[4096];
+    const char *p;
+    size_t n = 0;
+    int i;
+#define PUT(...) n += snprintf(line + n, n < sizeof(line) ? sizeof(line) - n : 0, __VA_ARGS__)
+    PUT("{\"image\":\"");
+    for (p = image; *p != '\0' && n + 2 < sizeof(line) / 2; p++) {
+        if (*p == '"' || *p == '\\')
+            line[n++] = '\\';
+        if ((unsigned char)*p >= 0x20)
+            line[n++] = *p;
+    }
+    PUT("\",\"phases\":{");
+    for (i = 0; i < PROF_PHASES; i++) {
+        PUT("%s\"%s\":{\"ns\":%llu,\"calls\":%llu", i ? "," : "",
+                phase_names[i], (unsigned long long)local.ns[i],
+                (unsigned long long)local.calls[i]);
+        if (perf_fd >= 0) {
+            PUT(",\"cycles\":%llu,\"cache_misses\":%llu",
+                    (unsigned long long)local.cycles[i],
+                    (unsigned long long)local.misses[i]);
+        }
+        PUT("}");
+    }
+    PUT("},\"counters\":{");
+    for (i = 0; i < PROF_COUNTERS; i++) {
+        PUT("%s\"%s\":%llu", i ? "," : "", counter_names[i],
+                (unsigned long long)local.count[i]);
+    }
+    PUT("}}\n");
+#undef PUT
+    if (n < sizeof(line)) {
+        fputs(line, output != NULL ? output : stderr);
+        fflush(output != NULL ? output : stderr);
+    }
+    memset(&local, 0, sizeof(local));
+}
+
+/**
+*Releases the perf_event counters of a thread about to exit.
+*/
+void prof_thread_end(void) {
+    if (perf_member >= 0)
+        close(perf_member);
+    if (perf_fd >= 0)
+        close(perf_fd);
+    perf_member = -1;
+    perf_fd = -2;
+}
+
+/**
+*Opens, once per thread, the cycles and cache misses of the thread
+*as one perf_event group if FPWM_PERF is set.
+*\returns The group leader, -1 if perf is not wanted or available.
+*/
+static int perf_group(void) {
+    struct perf_event_attr attr;
+    const char *wanted;
+    if (perf_fd != -2)
+        return perf_fd;
+    perf_fd = -1;
+    wanted = getenv("FPWM_PERF");
+    if (wanted == NULL || strcmp(wanted, "1") != 0)
+        return -1;
+    memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.type = PERF_TYPE_HARDWARE;
+    attr.config = PERF_COUNT_HW_CPU_CYCLES;
+    attr.read_format = PERF_FORMAT_GROUP;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    perf_fd = (int)syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+    if (perf_fd < 0)
+        return perf_fd = -1;
+    attr.config = PERF_COUNT_HW_CACHE_MISSES;
+    perf_member = (int)syscall(SYS_perf_event_open, &attr, 0, -1, perf_fd, 0);
+    if (perf_member < 0) {
+        close(perf_fd);
+        return perf_fd = -1;
+    }
+    //a member keeps its own fd, closed with the leader by prof_thread_end
+    return perf_fd;
+}
+
+static int perf_read(uint64_t *cycles, uint64_t *misses) {
+    uint64_t values[3]; //nr, cycles, cache misses
+    if (read(perf_fd, values, sizeof(values)) != sizeof(values))
+        return -1;
+    *cycles = values[1];
+    *misses = values[2];
+    return 0;
+}
+
+#endif
@@ -0,0 +1,80 @@
+#ifndef PROFILE_H
+#define PROFILE_H 1
+
+#include <stdio.h>
+#include <stdint.h>
+
+/**
+*The instrumentation of embed/extract, built only with
+*-DFPWM_PROFILE (make PROFILE=1). Otherwise every PROF_* macro
+*expands to nothing and no code is left behind.
+*
+*Every thread accumulates in its own record, PROF_REPORT writes the
+*record of the calling thread as a JSON line to the file given to
+*PROF_OUTPUT (stderr by default) and clears it. Setting
+*FPWM_PERF=1 in the environment adds the cpu cycles and cache misses
+*of every phase, read from perf_event at every phase boundary.
+*/
+
+enum prof_phase {
+    PROF_LUT, //loading the flippability table
+    PROF_SHUFFLE, //opening the shuffle and computing keyed windows
+    PROF_SCORE, //scoring the whole image
+    PROF_SCAN, //scanning the windows for candidates
+    PROF_FLIP, //flipping, rescoring and rescanning
+    PROF_SUM, //counting the blacks of the extracted windows
+    PROF_PHASES
+};
+
+enum prof_counter {
+    PROF_WINDOWS, //windows embedded or extracted
+    PROF_SCORED, //pixels scored, at build or after a flip
+    PROF_FLIPS, //pixels flipped
+    PROF_FAILED, //windows flip_pixels could not complete
+    PROF_COUNTERS
+};
+
+struct prof {
+    uint64_t ns[PROF_PHASES];
+    uint64_t calls[PROF_PHASES];
+    uint64_t cycles[PROF_PHASES];
+    uint64_t misses[PROF_PHASES];
+    uint64_t count[PROF_COUNTERS];
+};
+
+double clock_seconds(void);
+
+#ifdef FPWM_PROFILE
+
+void prof_begin(enum prof_phase phase);
+void prof_end(enum prof_phase phase);
+void prof_count(enum prof_counter counter, uint64_t n);
+void prof_take(struct prof *dst);
+void prof_merge(const struct prof *src);
+void prof_output(FILE *f);
+void prof_report(const char *image);
+void prof_thread_end(void);
+
+#define PROF_BEGIN(phase) prof_begin(phase)
+#define PROF_END(phase) prof_end(phase)
+#define PROF_COUNT(counter, n) prof_count(counter, n)
+#define PROF_TAKE(dst) prof_take(dst)
+#define PROF_MERGE(src) prof_merge(src)
+#define PROF_OUTPUT(f) prof_output(f)
+#define PROF_REPORT(image) prof_report(image)
+#define PROF_THREAD_END() prof_thread_end()
+
+#else
+
+#define PROF_BEGIN(phase) ((void)0)
+#define PROF_END(phase) ((void)0)
+#define PROF_COUNT(counter, n) ((void)0)
+#define PROF_TAKE(dst) ((void)0)
+#define PROF_MERGE(src) ((void)0)
+#define PROF_OUTPUT(f) ((void)0)
+#define PROF_REPORT(image) ((void)0)
+#define PROF_THREAD_END() ((void)0)
+
+#endif
+
+#endif
@@ -0,0 +1,501 @@
+/**
+*\file score_map.c
+*This module keeps the flippability score of every pixel of an
+*image up to date while embed flips pixels.
+*
+*The whole image is scored a row at a time by score_row, which
+*takes the 3x3 pattern indexes of 64 pixels from three shifted
+*copies of each of the three image words. On x86 cpus with AVX2 the
+*indexes of 8 pixels are built in the lanes of a vector and their
+*buckets gathered from the table at once.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "flippability.h"
+#include "score_map.h"
+#include "profile.h"
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define SCORE_AVX2 1
+#include <immintrin.h>
+#endif
+
+int rescore(struct score_map *map, struct image img, int r, int c);
+void quantize_lut(struct score_map *map, const float *lut);
+int rescore_n(struct score_map *map, struct image img, int r, int c);
+void score_rows_n(struct score_map *map, struct image img);
+unsigned __int128 neighborhood(const uint64_t *row, int k, int stride);
+#ifdef SCORE_AVX2
+void score_row_avx2(const uint64_t *up, const uint64_t *mid, const uint64_t *down,
+        int cols, const unsigned char *qlut, unsigned char *bucket,
+        uint64_t *nonzero);
+#endif
+
+/**
+*Scores every pixel of the image. The inner rows go through
+*score_row, then the border rows and columns get BORDER_BUCKET,
+*so no pixel is ever tested for being at the border.
+*\param[out] map The map to be initialized, released with score_map_free.
+*\param[in] img The image to be scored.
+*\param[in] lut The 3x3 flippability look up table.
+*\returns 0 on success, -1 if the allocation failed.
+*/
+int score_map_build(struct score_map *map, struct image img, const float *lut) {
+    map->bucket = NULL;
+    map->nonzero.words = NULL;
+    map->bucket_len = 0;
+    map->nonzero_len = 0;
+    map->n = 3;
+    map->packed = NULL;
+    return score_map_rebuild(map, img, lut);
+}
+
+/**
+*Same as score_map_build on a map already built, or zeroed, whose
+*planes are kept when they have room for img. Scoring images of the
+*same size again and again allocates only the first time. A map
+*set to larger patterns by score_map_use ignores lut.
+*/
+int score_map_rebuild(struct score_map *map, struct image img, const float *lut) {
+    int r;
+    unsigned char *bucket;
+    if (score_map_reserve(map, img.cols, img.rows) != 0)
+        return -1;
+    if (map->n > 3) {
+        score_rows_n(map, img);
+        PROF_COUNT(PROF_SCORED, (uint64_t)img.cols * img.rows);
+        return 0;
+    }
+    quantize_lut(map, lut);
+    for (r = 0; r < img.rows; r++) {
+        bucket = map->bucket + (size_t)r * img.cols;
+        if (r == 0 || r == img.rows - 1) {
+            memset(bucket, BORDER_BUCKET, img.cols);
+            memset(image_row(map->nonzero, r), 0xff,
+                    img.stride * sizeof(uint64_t));
+            //keep the padding bits past cols zero
+            if (img.cols & 63)
+                image_row(map->nonzero, r)[img.stride - 1] =
+                        ((uint64_t)1 << (img.cols & 63)) - 1;
+            continue;
+        }
+        score_row(image_row(img, r - 1), image_row(img, r),
+                image_row(img, r + 1), img.cols, map->qlut, bucket,
+                image_row(map->nonzero, r));
+        bucket[0] = BORDER_BUCKET;
+        bucket[img.cols - 1] = BORDER_BUCKET;
+        image_row(map->nonzero, r)[0] |= 1;
+        image_row(map->nonzero, r)[(img.cols - 1) >> 6] |=
+                (uint64_t)1 << ((img.cols - 1) & 63);
+    }
+    PROF_COUNT(PROF_SCORED, (uint64_t)img.cols * img.rows);
+    return 0;
+}
+
+/**
+*Gives the map the layout of img with every score 0, scoring nothing.
+*The caller scores the pixels it is about to read with
+*score_map_touch, and score_map_update keeps them current, so an image
+*that changes in a few windows is never scored whole.
+*\returns 0 on success, -1 if the allocation failed.
+*/
+int score_map_clear(struct score_map *map, struct image img, const float *lut) {
+    if (score_map_reserve(map, img.cols, img.rows) != 0)
+        return -1;
+    memset(map->bucket, 0, (size_t)img.cols * img.rows);
+    memset(map->nonzero.words, 0,
+            (size_t)map->nonzero.stride * img.rows * sizeof(uint64_t));
+    if (map->n == 3)
+        quantize_lut(map, lut);
+    return 0;
+}
+
+/**
+*Scores the pixel (r, c) of a map, see score_map_clear.
+*/
+void score_map_touch(struct score_map *map, struct image img, int r, int c) {
+    if (map->n > 3)
+        rescore_n(map, img, r, c);
+    else
+        rescore(map, img, r, c);
+}
+
+void quantize_lut(struct score_map *map, const float *lut) {
+    int i;
+    for (i = 0; i < (1 << (3 * 3)); i++)
+        map->qlut[i] = score_bucket(lut[i]);
+    memset(map->qlut + (1 << (3 * 3)), 0, sizeof(map->qlut) - (1 << (3 * 3)));
+}
+
+/**
+*Scores a row of cols pixels, the pixels out of the row counting
+*as white. The buckets of the first and last pixel are those of
+*the padded neighborhoods, the caller overwrites them.
+*\param[in] up, mid, down The rows r - 1, r, r + 1 of the image.
+*\param[in] qlut The quantized table, readable 3 bytes past its end.
+*\param[out] bucket The cols buckets of the row.
+*\param[out] nonzero The nonzero plane of the row.
+*/
+void score_row(const uint64_t *up, const uint64_t *mid, const uint64_t *down,
+        int cols, const unsigned char *qlut, unsigned char *bucket,
+        uint64_t *nonzero) {
+#ifdef SCORE_AVX2
+    if (score_simd_available()) {
+        score_row_avx2(up, mid, down, cols, qlut, bucket, nonzero);
+        return;
+    }
+#endif
+    score_row_scalar(up, mid, down, cols, qlut, bucket, nonzero);
+}
+
+/**
+*The portable score_row. The 64 pixels of a word take their
+*pattern indexes from the 66 bit neighborhoods of the three rows.
+*The words whose neighborhoods are all white or all black score 0.0
+*with the usual tables and are cleared without looking at the
+*individual pixels.
+*/
+void score_row_scalar(const uint64_t *up, const uint64_t *mid, const uint64_t *down,
+        int cols, const unsigned char *qlut, unsigned char *bucket,
+        uint64_t *nonzero) {
+    unsigned __int128 u, m, d;
+    unsigned int index;
+    uint64_t nz;
+    int j, k, n, stride = (cols + 63) >> 6;
+    for (k = 0; k < stride; k++, bucket += 64) {
+        n = cols - (k << 6) < 64 ? cols - (k << 6) : 64;
+        u = neighborhood(up, k, stride);
+        m = neighborhood(mid, k, stride);
+        d = neighborhood(down, k, stride);
+        if (u == m && m == d && qlut[(u & 1) ? 511 : 0] == 0 &&
+            (u == 0 || (n == 64 && u == ((unsigned __int128)1 << 66) - 1))) {
+            memset(bucket, 0, n);
+            nonzero[k] = 0;
+            continue;
+        }
+        nz = 0;
+        for (j = 0; j < n; j++) {
+            //row r - 1 lands in bits 0-2, row r in bits 3-5 and row r + 1 in bits 6-8
+            index = (unsigned int)((u >> j) & 7) |
+                    (unsigned int)((m >> j) & 7) << 3 |
+                    (unsigned int)((d >> j) & 7) << 6;
+            bucket[j] = qlut[index];
+            nz |= (uint64_t)(bucket[j] != 0) << j;
+        }
+        nonzero[k] = nz;
+    }
+}
+
+#ifdef SCORE_AVX2
+__attribute__((target("avx2")))
+void score_row_avx2(const uint64_t *up, const uint64_t *mid, const uint64_t *down,
+        int cols, const unsigned char *qlut, unsigned char *bucket,
+        uint64_t *nonzero) {
+    unsigned __int128 u, m, d;
+    uint64_t nz;
+    int j, k, n, stride = (cols + 63) >> 6;
+    unsigned int index;
+    const __m256i lane = _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7);
+    const __m256i seven = _mm256_set1_epi32(7);
+    const __m256i low_bytes = _mm256_setr_epi8(
+            0, 4, 8, 12, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+            0, 4, 8, 12, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1);
+    __m256i vu, vm, vd, idx, g;
+    for (k = 0; k < stride; k++, bucket += 64) {
+        n = cols - (k << 6) < 64 ? cols - (k << 6) : 64;
+        u = neighborhood(up, k, stride);
+        m = neighborhood(mid, k, stride);
+        d = neighborhood(down, k, stride);
+        nz = 0;
+        for (j = 0; j + 8 <= n; j += 8) {
+            //lane i holds the triplet of pixel j + i of every row
+            vu = _mm256_srlv_epi32(_mm256_set1_epi32((int)(u >> j) & 0x3ff), lane);
+            vm = _mm256_srlv_epi32(_mm256_set1_epi32((int)(m >> j) & 0x3ff), lane);
+            vd = _mm256_srlv_epi32(_mm256_set1_epi32((int)(d >> j) & 0x3ff), lane);
+            idx = _mm256_or_si256(_mm256_and_si256(vu, seven),
+                    _mm256_or_si256(
+                            _mm256_slli_epi32(_mm256_and_si256(vm, seven), 3),
+                            _mm256_slli_epi32(_mm256_and_si256(vd, seven), 6)));
+            //4 byte loads, the low byte is the bucket
+            g = _mm256_and_si256(_mm256_i32gather_epi32((const int *)qlut, idx, 1),
+                    _mm256_set1_epi32(0xff));
+            nz |= (uint64_t)_mm256_movemask_ps(_mm256_castsi256_ps(
+                    _mm256_cmpgt_epi32(g, _mm256_setzero_si256()))) << j;
+            g = _mm256_shuffle_epi8(g, low_bytes);
+            _mm_storel_epi64((__m128i *)(bucket + j), _mm256_castsi256_si128(
+                    _mm256_permutevar8x32_epi32(g, _mm256_setr_epi32(0, 4, 0, 0, 0, 0, 0, 0))));
+        }
+        for (; j < n; j++) {
+            index = (unsigned int)((u >> j) & 7) |
+                    (unsigned int)((m >> j) & 7) << 3 |
+                    (unsigned int)((d >> j) & 7) << 6;
+            bucket[j] = qlut[index];
+            nz |= (uint64_t)(bucket[j] != 0) << j;
+        }
+        nonzero[k] = nz;
+    }
+}
+#endif
+
+/**
+*Whether score_row runs the vectorized kernel on this cpu.
+*/
+int score_simd_available(void) {
+#ifdef SCORE_AVX2
+    return __builtin_cpu_supports("avx2");
+#else
+    return 0;
+#endif
+}
+
+/**
+*Makes the map score the n x n patterns of the packed tables
+*(flippability_packed) from its next build on, for an odd n up to
+*SCORE_MAX_N; 3 goes back to the 3x3 table given to the builds.
+*The pixels closer than n / 2 to the borders get BORDER_BUCKET.
+*\returns 0 on success, -1 if n is not supported or the table is
+*not available.
+*/
+int score_map_use(struct score_map *map, int n) {
+    if (n == 3) {
+        map->n = 3;
+        map->packed = NULL;
+        return 0;
+    }
+    if (n < 3 || n > SCORE_MAX_N || (n & 1) == 0)
+        return -1;
+    map->packed = flippability_packed(n);
+    if (map->packed == NULL)
+        return -1;
+    map->n = n;
+    return 0;
+}
+
+/**
+*Brings the map up to date after the pixel (r, c) was flipped.
+*Only the n x n neighborhood around it can change.
+*\returns The number of pixels whose score changed.
+*/
+int score_map_update(struct score_map *map, struct image img, int r, int c) {
+    int i, j, changed = 0, radius = map->n > 3 ? map->n >> 1 : 1;
+    for (i = r - radius; i <= r + radius; i++) {
+        if (i < 0 || i >= img.rows)
+            continue;
+        for (j = c - radius; j <= c + radius; j++) {
+            if (j < 0 || j >= img.cols)
+                continue;
+            if (radius == 1)
+                changed += rescore(map, img, i, j);
+            else
+                changed += rescore_n(map, img, i, j);
+            PROF_COUNT(PROF_SCORED, 1);
+        }
+    }
+    return changed;
+}
+
+void score_map_free(struct score_map *map) {
+    free(map->bucket);
+    map->bucket = NULL;
+    image_free(&map->nonzero);
+    map->bucket_len = 0;
+    map->nonzero_len = 0;
+}
+
+/**
+*Gives the planes the layout of a cols x rows image, growing them
+*only if they are too small. On failure the map is left empty.
+*/
+int score_map_reserve(struct score_map *map, int cols, int rows) {
+    size_t pixels = (size_t)cols * rows;
+    size_t words = (size_t)((cols + 63) >> 6) * rows;
+    if (map->bucket_len < pixels || map->nonzero_len < words) {
+        score_map_free(map);
+        map->bucket = (unsigned char *)malloc(pixels);
+        if (map->bucket == NULL)
+            return -1;
+        if (image_alloc(&map->nonzero, cols, rows) != 0) {
+            score_map_free(map);
+            return -1;
+        }
+        map->bucket_len = pixels;
+        map->nonzero_len = words;
+    }
+    map->nonzero.cols = cols;
+    map->nonzero.rows = rows;
+    map->nonzero.stride = (cols + 63) >> 6;
+    return 0;
+}
+
+/**
+*Returns the flippability score of the pixel at pos, where pos
+*is a row major position. The pixels at the borders of the image
+*get the constant 0.250.
+*/
+float evaluate(struct image img, int pos, const float *lut) {
+    int r, c;
+    unsigned int index;
+    r = pos / img.cols;
+    c = pos % img.cols;
+    //[r, c] is the cordinates of the central pixel of the 3x3 window
+    if (r == 0 || r == (img.rows - 1) ||
+        c == 0 || c == (img.cols - 1)) {
+        //if the position of the pixel is at the borders of the image
+        return (0.250);
+    }
+    //row r - 1 lands in bits 0-2, row r in bits 3-5 and row r + 1 in bits 6-8
+    index = image_triplet(image_row(img, r - 1), c) |
+            image_triplet(image_row(img, r), c) << 3 |
+            image_triplet(image_row(img, r + 1), c) << 6;
+    return (lut[index]);
+}
+
+/**
+*Quantizes a score to its bucket, clamped to [0, SCORE_BUCKETS).
+*/
+int score_bucket(float score) {
+    int bucket = (int)(score * (SCORE_BUCKETS - 1) + 0.5f);
+    if (bucket < 0)
+        return 0;
+    if (bucket >= SCORE_BUCKETS)
+        return SCORE_BUCKETS - 1;
+    return bucket;
+}
+
+/**
+*Recomputes the bucket of a single pixel.
+*\returns 1 if it changed, 0 otherwise.
+*/
+int rescore(struct score_map *map, struct image img, int r, int c) {
+    int bucket, old;
+    unsigned int index;
+    size_t pos = (size_t)r * img.cols + c;
+    if (r == 0 || r == (img.rows - 1) ||
+        c == 0 || c == (img.cols - 1)) {
+        bucket = BORDER_BUCKET;
+    } else {
+        index = image_triplet(image_row(img, r - 1), c) |
+                image_triplet(image_row(img, r), c) << 3 |
+                image_triplet(image_row(img, r + 1), c) << 6;
+        bucket = map->qlut[index];
+    }
+    old = map->bucket[pos];
+    if (bucket == old)
+        return 0;
+    map->bucket[pos] = bucket;
+    if ((old == 0) != (bucket == 0))
+        image_toggle(map->nonzero, r, c);
+    return 1;
+}
+
+/**
+*Returns the n pixels of a row from the column c, the lowest bit
+*being the pixel c. They must all lie within the row.
+*/
+static inline uint32_t row_bits(const uint64_t *row, int c, int n) {
+    uint64_t v = row[c >> 6] >> (c & 63);
+    if ((c & 63) + n > 64)
+        v |= row[(c >> 6) + 1] << (64 - (c & 63));
+    return (uint32_t)v & (((uint32_t)1 << n) - 1);
+}
+
+/**
+*Defines pattern_index<N>, the N x N pattern index of the pixel
+*(r, c) with the row r - N / 2 in the lowest N bits, the layout of
+*build_flippability_packed. N is a constant, every size gets its
+*own unrolled copy.
+*/
+#define DEFINE_PATTERN_INDEX(N) \
+static inline uint32_t pattern_index##N(struct image img, int r, int c) { \
+    uint32_t index = 0; \
+    int i; \
+    for (i = 0; i < (N); i++) \
+        index |= row_bits(image_row(img, r - (N) / 2 + i), c - (N) / 2, (N)) \
+                << (i * (N)); \
+    return index; \
+}
+
+DEFINE_PATTERN_INDEX(5)
+
+/**
+*The bucket of the pixel (r, c) of a map set to larger patterns.
+*/
+static inline int bucket_n(const struct score_map *map, struct image img,
+        int r, int c) {
+    int radius = map->n >> 1;
+    if (r < radius || r >= img.rows - radius ||
+        c < radius || c >= img.cols - radius)
+        return BORDER_BUCKET;
+    //SCORE_MAX_N is 5, the only size past 3 score_map_use accepts
+    return packed_bucket(map->packed, pattern_index5(img, r, c));
+}
+
+/**
+*Returns the bucket a map would give the pixel (r, c), without one,
+*for the callers that score a few pixels of a large image.
+*\param[in] lut The 3x3 flippability look up table.
+*\param[in] packed The table of flippability_packed(SCORE_MAX_N) to
+*score the larger patterns, as score_map_use does, or NULL for 3x3.
+*/
+int pixel_bucket(struct image img, int r, int c, const float *lut,
+        const unsigned char *packed) {
+    int radius = packed != NULL ? SCORE_MAX_N >> 1 : 1;
+    if (r < radius || r >= img.rows - radius ||
+        c < radius || c >= img.cols - radius)
+        return BORDER_BUCKET;
+    if (packed != NULL)
+        return packed_bucket(packed, pattern_index5(img, r, c));
+    return score_bucket(evaluate(img, r * img.cols + c, lut));
+}
+
+/**
+*The score_row loop of the larger patterns, a pixel at a time.
+*/
+void score_rows_n(struct score_map *map, struct image img) {
+    unsigned char *bucket;
+    uint64_t *nonzero;
+    int r, c;
+    for (r = 0; r < img.rows; r++) {
+        bucket = map->bucket + (size_t)r * img.cols;
+        nonzero = image_row(map->nonzero, r);
+        memset(nonzero, 0, img.stride * sizeof(uint64_t));
+        for (c = 0; c < img.cols; c++) {
+            bucket[c] = bucket_n(map, img, r, c);
+            if (bucket[c] != 0)
+                nonzero[c >> 6] |= (uint64_t)1 << (c & 63);
+        }
+    }
+}
+
+/**
+*Same as rescore, for a map set to larger patterns.
+*/
+int rescore_n(struct score_map *map, struct image img, int r, int c) {
+    int bucket, old;
+    size_t pos = (size_t)r * img.cols + c;
+    bucket = bucket_n(map, img, r, c);
+    old = map->bucket[pos];
+    if (bucket == old)
+        return 0;
+    map->bucket[pos] = bucket;
+    if ((old == 0) != (bucket == 0))
+        image_toggle(map->nonzero, r, c);
+    return 1;
+}
+
+/**
+*Returns the pixels 64k - 1 .. 64k + 64 of a row, the word k and
+*one pixel each side, white past the ends of the row. Bit j + 1
+*is the pixel 64k + j, so the triplet of the pixel 64k + j is
+*the three bits from j.
+*/
+unsigned __int128 neighborhood(const uint64_t *row, int k, int stride) {
+    unsigned __int128 v = (unsigned __int128)row[k] << 1;
+    if (k > 0)
+        v |= row[k - 1] >> 63;
+    if (k + 1 < stride)
+        v |= (unsigned __int128)(row[k + 1] & 1) << 65;
+    return v;
+}
@@ -0,0 +1,56 @@
+#ifndef SCORE_MAP_H
+#define SCORE_MAP_H 1
+
+#include "packed_image.h"
+
+#define SCORE_BUCKETS 9 //the scores are multiples of 0.125 in [0.0, 1.0]
+#define BORDER_BUCKET 2 //the 0.250 score of the pixels at the borders
+#define SCORE_MAX_N 5 //the largest neighborhood, see score_map_use
+
+/**
+*The flippability score of every pixel of an image, quantized to
+*SCORE_BUCKETS buckets (bucket = score * 8). The nonzero plane has
+*the layout of the image and marks the pixels with a score above
+*0.0, the sparse index of the pixels worth flipping.
+*/
+struct score_map {
+    unsigned char *bucket;
+    struct image nonzero;
+    size_t bucket_len; //the room of the planes, reused by score_map_rebuild
+    size_t nonzero_len;
+    int n; //the side of the scored patterns, 3 unless set by score_map_use
+    const unsigned char *packed; //the table of the larger patterns
+    unsigned char qlut[(1 << (3 * 3)) + 3]; //padded for the 4 byte gathers
+};
+
+int score_map_build(struct score_map *map, struct image img, const float *lut);
+int score_map_rebuild(struct score_map *map, struct image img, const float *lut);
+int score_map_reserve(struct score_map *map, int cols, int rows);
+int score_map_clear(struct score_map *map, struct image img, const float *lut);
+void score_map_touch(struct score_map *map, struct image img, int r, int c);
+int score_map_use(struct score_map *map, int n);
+int score_map_update(struct score_map *map, struct image img, int r, int c);
+void score_map_free(struct score_map *map);
+void score_row(const uint64_t *up, const uint64_t *mid, const uint64_t *down,
+        int cols, const unsigned char *qlut, unsigned char *bucket,
+        uint64_t *nonzero);
+void score_row_scalar(const uint64_t *up, const uint64_t *mid, const uint64_t *down,
+        int cols, const unsigned char *qlut, unsigned char *bucket,
+        uint64_t *nonzero);
+int score_simd_available(void);
+float evaluate(struct image img, int pos, const float *lut);
+int score_bucket(float score);
+int pixel_bucket(struct image img, int r, int c, const float *lut,
+        const unsigned char *packed);
+
+/**
+*Returns the bucket of the pixel (r, c), looking at the nonzero
+*plane first so the zero score pixels never touch the byte plane.
+*/
+static inline int score_map_get(const struct score_map *map, int r, int c) {
+    if (!image_get(map->nonzero, r, c))
+        return 0;
+    return map->bucket[(size_t)r * map->nonzero.cols + c];
+}
+
+#endif
@@ -0,0 +1,314 @@
+/**
+*\file shuffle_cache.c
+*This module keeps the generated pixel shuffles in a directory so
+*that later processes map them read-only instead of generating them
+*again. The mappings are shared, every worker of a machine reads the
+*same pages from the page cache. The crc of a file is checked when it
+*is first mapped; the verified mapping is then kept for the process,
+*up to SHUFFLE_CACHE_KEPT of them, and later opens reuse it.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <zlib.h>
+#include "shuffle_cache.h"
+
+#define CACHE_MAGIC "FPWMPERM"
+
+/**
+*The header of a cache file, followed by pix_N native integers.
+*/
+struct cache_header {
+    char magic[8];
+    uint32_t version;
+    uint32_t mode;
+    uint32_t seed;
+    uint32_t pix_N;
+    uint32_t crc; //crc32 of the sequence
+    uint32_t reserved;
+};
+
+/**
+*A verified mapping, shared by every shuffle opened from its file.
+*/
+struct kept_mapping {
+    char path[4096];
+    void *mapping;
+    size_t len;
+};
+
+static struct kept_mapping kept[SHUFFLE_CACHE_KEPT];
+static int kept_n;
+static pthread_mutex_t kept_lock = PTHREAD_MUTEX_INITIALIZER;
+
+int open_kept(struct shuffle *sh, const char *dir, long limit,
+        const char *path, const struct cache_header *expected);
+void keep_mapping(struct shuffle *sh, const char *path);
+int map_cache_file(struct shuffle *sh, const char *path,
+        const struct cache_header *expected);
+int write_cache_file(const char *dir, const char *path,
+        const struct cache_header *hd, const int *sequence);
+int cache_write(int fd, const void *buf, size_t len);
+void enforce_limit(const char *dir, long limit, long incoming);
+
+/**
+*Opens the shuffle like shuffle_open, going through the cache
+*directory dir. A valid cached file is mapped read-only, otherwise
+*the sequence is generated and saved for the next callers. Any cache
+*failure (missing or read-only directory, corrupt file) falls back
+*to the private sequence shuffle_open would give.
+*\param[in] dir The cache directory, NULL disables the cache.
+*\param[in] limit The size limit of the directory in bytes, the least
+*recently used files are removed to stay under it.
+*\returns 0 on success, -1 on failure.
+*/
+int shuffle_open_cached(struct shuffle *sh, int pix_N, unsigned int seed,
+        enum shuffle_mode mode, const char *dir, long limit) {
+    struct cache_header hd;
+    char path[4096];
+    int *sequence;
+    long bytes;
+    sh->blocks = NULL;
+    sh->block_window = 0;
+    //the keyed shuffle has nothing worth caching
+    if (dir == NULL || mode == SHUFFLE_FEISTEL || pix_N <= 0)
+        return shuffle_open(sh, pix_N, seed, mode);
+    memset(&hd, 0, sizeof(hd));
+    memcpy(hd.magic, CACHE_MAGIC, sizeof(hd.magic));
+    hd.version = SHUFFLE_CACHE_VERSION;
+    hd.mode = mode;
+    hd.seed = seed;
+    hd.pix_N = pix_N;
+    snprintf(path, sizeof(path), "%s/perm-v%d-m%d-s%u-n%d.bin", dir,
+            SHUFFLE_CACHE_VERSION, (int)mode, seed, pix_N);
+    if (open_kept(sh, dir, limit, path, &hd) == 0)
+        return 0;
+    if (map_cache_file(sh, path, &hd) == 0) {
+        keep_mapping(sh, path);
+        return 0;
+    }
+    //miss, generate it and try to publish it
+    sequence = shuffle_sequence(pix_N, seed, mode);
+    if (sequence == NULL)
+        return -1;
+    bytes = (long)sizeof(hd) + (long)pix_N * sizeof(int);
+    if (bytes <= limit) {
+        hd.crc = crc32(0L, (const Bytef *)sequence, (uInt)pix_N * sizeof(int));
+        enforce_limit(dir, limit, bytes);
+        if (write_cache_file(dir, path, &hd, sequence) == 0 &&
+            map_cache_file(sh, path, &hd) == 0) {
+            keep_mapping(sh, path);
+            free(sequence);
+            return 0;
+        }
+    }
+    sh->pix_N = pix_N;
+    sh->mode = mode;
+    sh->sequence = sequence;
+    sh->mapping = NULL;
+    sh->map_len = 0;
+    return 0;
+}
+
+/**
+*Unmaps the mappings kept by shuffle_open_cached, so the next opens
+*map and check their files again. No shuffle opened from the cache
+*may be in use.
+*/
+void shuffle_cache_forget(void) {
+    pthread_mutex_lock(&kept_lock);
+    while (kept_n > 0) {
+        kept_n--;
+        munmap(kept[kept_n].mapping, kept[kept_n].len);
+    }
+    pthread_mutex_unlock(&kept_lock);
+}
+
+/**
+*Points sh into the kept mapping of path, if there is one, without
+*checking the crc again. A file removed since, by enforce_limit for
+*instance, is written back from it.
+*\returns 0 if sh now points into a kept mapping, -1 otherwise.
+*/
+int open_kept(struct shuffle *sh, const char *dir, long limit,
+        const char *path, const struct cache_header *expected) {
+    const struct cache_header *hd;
+    long len;
+    int i;
+    pthread_mutex_lock(&kept_lock);
+    for (i = 0; i < kept_n && strcmp(kept[i].path, path) != 0; i++)
+        ;
+    if (i == kept_n) {
+        pthread_mutex_unlock(&kept_lock);
+        return -1;
+    }
+    hd = (const struct cache_header *)kept[i].mapping;
+    sh->pix_N = expected->pix_N;
+    sh->mode = (enum shuffle_mode)expected->mode;
+    sh->sequence = (int *)(hd + 1);
+    sh->mapping = kept[i].mapping;
+    sh->map_len = 0;
+    len = (long)kept[i].len;
+    pthread_mutex_unlock(&kept_lock);
+    //mark it recently used for enforce_limit
+    if (utimensat(AT_FDCWD, path, NULL, 0) != 0 && errno == ENOENT &&
+        len <= limit) {
+        enforce_limit(dir, limit, len);
+        write_cache_file(dir, path, hd, sh->sequence);
+    }
+    return 0;
+}
+
+/**
+*Hands the mapping sh owns over to the kept ones, if there is room
+*and no other thread kept the same file meanwhile.
+*/
+void keep_mapping(struct shuffle *sh, const char *path) {
+    int i;
+    pthread_mutex_lock(&kept_lock);
+    for (i = 0; i < kept_n && strcmp(kept[i].path, path) != 0; i++)
+        ;
+    if (i == kept_n && kept_n < SHUFFLE_CACHE_KEPT) {
+        snprintf(kept[kept_n].path, sizeof(kept[kept_n].path), "%s", path);
+        kept[kept_n].mapping = sh->mapping;
+        kept[kept_n].len = sh->map_len;
+        kept_n++;
+        sh->map_len = 0;
+    }
+    pthread_mutex_unlock(&kept_lock);
+}
+
+/**
+*Maps a cache file and checks it against the expected header,
+*including the crc of the whole sequence. A corrupt file is removed.
+*\returns 0 if sh now points into the mapping, -1 otherwise.
+*/
+int map_cache_file(struct shuffle *sh, const char *path,
+        const struct cache_header *expected) {
+    struct cache_header *hd;
+    struct stat st;
+    void *mapping;
+    size_t len;
+    int fd, valid;
+    fd = open(path, O_RDONLY);
+    if (fd < 0)
+        return -1;
+    len = sizeof(*hd) + (size_t)expected->pix_N * sizeof(int);
+    if (fstat(fd, &st) != 0 || st.st_size != (off_t)len) {
+        close(fd);
+        unlink(path);
+        return -1;
+    }
+    mapping = mmap(NULL, len, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (mapping == MAP_FAILED)
+        return -1;
+    hd = (struct cache_header *)mapping;
+    valid = memcmp(hd->magic, expected->magic, sizeof(hd->magic)) == 0 &&
+            hd->version == expected->version && hd->mode == expected->mode &&
+            hd->seed == expected->seed && hd->pix_N == expected->pix_N &&
+            hd->crc == crc32(0L, (const Bytef *)(hd + 1),
+                    (uInt)hd->pix_N * sizeof(int));
+    if (!valid) {
+        munmap(mapping, len);
+        unlink(path);
+        return -1;
+    }
+    //mark it recently used for enforce_limit
+    utimensat(AT_FDCWD, path, NULL, 0);
+    sh->pix_N = expected->pix_N;
+    sh->mode = (enum shuffle_mode)expected->mode;
+    sh->sequence = (int *)(hd + 1);
+    sh->mapping = mapping;
+    sh->map_len = len;
+    return 0;
+}
+
+/**
+*Writes the file under a temporary name and renames it in place,
+*so concurrent readers see either no file or a complete one.
+*\returns 0 on success, -1 on failure.
+*/
+int write_cache_file(const char *dir, const char *path,
+        const struct cache_header *hd, const int *sequence) {
+    char tmp[4096];
+    int fd, status;
+    snprintf(tmp, sizeof(tmp), "%s/.perm-XXXXXX", dir);
+    fd = mkstemp(tmp);
+    if (fd < 0)
+        return -1;
+    fchmod(fd, 0644);
+    status = cache_write(fd, hd, sizeof(*hd)) == 0 &&
+            cache_write(fd, sequence, (size_t)hd->pix_N * sizeof(int)) == 0 &&
+            fsync(fd) == 0 ? 0 : -1;
+    //closed whatever happened, a failed close loses the data as well
+    if (close(fd) != 0)
+        status = -1;
+    if (status != 0 || rename(tmp, path) != 0) {
+        unlink(tmp);
+        return -1;
+    }
+    return 0;
+}
+
+/**
+*Writes len bytes, going on after the short writes.
+*\returns 0, or -1 if the file could not take them all.
+*/
+int cache_write(int fd, const void *buf, size_t len) {
+    const char *p = (const char *)buf;
+    ssize_t n;
+    while (len > 0) {
+        n = write(fd, p, len);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return -1;
+        p += n;
+        len -= n;
+    }
+    return 0;
+}
+
+/**
+*Removes the least recently used cache files of dir until the
+*incoming bytes fit under limit.
+*/
+void enforce_limit(const char *dir, long limit, long incoming) {
+    DIR *d;
+    struct dirent *e;
+    struct stat st;
+    char path[4096], oldest[4096];
+    long total;
+    time_t oldest_time;
+    do {
+        d = opendir(dir);
+        if (d == NULL)
+            return;
+        total = incoming;
+        oldest[0] = '\0';
+        oldest_time = 0;
+        while ((e = readdir(d)) != NULL) {
+            if (strncmp(e->d_name, "perm-", 5) != 0)
+                continue;
+            snprintf(path, sizeof(path), "%s/%s", dir, e->d_name);
+            if (stat(path, &st) != 0)
+                continue;
+            total += st.st_size;
+            if (oldest[0] == '\0' || st.st_mtime < oldest_time) {
+                oldest_time = st.st_mtime;
+                snprintf(oldest, sizeof(oldest), "%s", path);
+            }
+        }
+        closedir(d);
+    } while (total > limit && oldest[0] != '\0' && unlink(oldest) == 0);
+}
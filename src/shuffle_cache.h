@@ -0,0 +1,19 @@
+#ifndef SHUFFLE_CACHE_H
+#define SHUFFLE_CACHE_H
+
+#include "shuffling.h"
+
+/**
+*Bump whenever a generator changes its output, the cached files
+*of the previous versions are then ignored.
+*/
+#define SHUFFLE_CACHE_VERSION 1
+#define SHUFFLE_CACHE_LIMIT (1L << 30) //default size limit of a cache directory
+
+#define SHUFFLE_CACHE_KEPT 32 //the verified mappings kept for the process
+
+int shuffle_open_cached(struct shuffle *sh, int pix_N, unsigned int seed,
+        enum shuffle_mode mode, const char *dir, long limit);
+void shuffle_cache_forget(void);
+
+#endif
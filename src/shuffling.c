@@ -6,21 +6,18 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdint.h>
 #include <assert.h>
 #include <string.h>
+#include <sys/mman.h>
 #include "shuffling.h"
 
-/**
-*Yet another auxiliary structure
-*used for the sequence generation.
-*/
-struct seq_node {
-    int i;
-    struct seq_node *next;
-};
-
-struct seq_node *add_node(struct seq_node *hd,  int value);
-void destroy_sequence(struct seq_node *hd);
+int *floyd_permutation(int pix_N, unsigned int seed);
+int *fisher_yates_permutation(int pix_N, unsigned int seed);
+void feistel_init(struct shuffle *sh, unsigned int seed);
+uint64_t feistel(const struct shuffle *sh, uint64_t x);
+uint64_t splitmix64(uint64_t *state);
+uint32_t bounded_rand(uint64_t *state, uint32_t range);
 
 /**
 *Random permutation without replacement: Floyd
@@ -30,60 +27,284 @@ void destroy_sequence(struct seq_node *hd);
 *\param[in] pix_N An integer indicating the total number of pixels.
 *\returns An array of random integers in the range [0, pix_N - 1]
 */
-
 int *random_permutation(int pix_N) {
-    int J, i;
-    int seedp = 7; //magic seed. It is randomly choosen to be lucky number 7
-    int T, *final;
-    struct seq_node *new, *hd;
-    struct seq_node **picked;
-    new = hd = NULL;
-    //create sentinel node
-    hd = (struct seq_node *)malloc(sizeof(struct seq_node));
-    picked = (struct seq_node **)calloc(pix_N + 1, sizeof(struct seq_node *)); //picked[0] is not used
-    assert(hd != NULL && picked != NULL);
-    for (i = 0; i < pix_N; i++) {
-        picked[i] = NULL;
+    return floyd_permutation(pix_N, SHUFFLE_SEED);
+}
+
+/**
+*Generates the shuffled sequence of pix_N pixels with the given
+*generator. The same (pix_N, seed, mode) always gives the same
+*sequence.
+*\returns An array of the integers [0, pix_N - 1] shuffled,
+*or NULL on failure. The caller frees it.
+*/
+int *shuffle_sequence(int pix_N, unsigned int seed, enum shuffle_mode mode) {
+    struct shuffle sh;
+    int i, *final;
+    if (pix_N <= 0)
+        return NULL;
+    switch (mode) {
+    case SHUFFLE_FLOYD:
+        return floyd_permutation(pix_N, seed);
+    case SHUFFLE_FISHER_YATES:
+        return fisher_yates_permutation(pix_N, seed);
+    case SHUFFLE_FEISTEL:
+        final = (int *)malloc((size_t)pix_N * sizeof(int));
+        if (final == NULL)
+            return NULL;
+        sh.pix_N = pix_N;
+        sh.sequence = NULL;
+        feistel_init(&sh, seed);
+        for (i = 0; i < pix_N; i++)
+            final[i] = shuffle_at(&sh, i);
+        return final;
+    default:
+        return NULL;
+    }
+}
+
+/**
+*Prepares the shuffle of pix_N pixels. Only the materialized
+*modes allocate, SHUFFLE_FEISTEL just derives its round keys.
+*\returns 0 on success, -1 on failure.
+*/
+int shuffle_open(struct shuffle *sh, int pix_N, unsigned int seed,
+        enum shuffle_mode mode) {
+    sh->pix_N = pix_N;
+    sh->mode = mode;
+    sh->sequence = NULL;
+    sh->mapping = NULL;
+    sh->map_len = 0;
+    sh->blocks = NULL;
+    sh->block_window = 0;
+    if (pix_N <= 0)
+        return -1;
+    if (mode == SHUFFLE_FEISTEL) {
+        feistel_init(sh, seed);
+        return 0;
+    }
+    sh->sequence = shuffle_sequence(pix_N, seed, mode);
+    return sh->sequence != NULL ? 0 : -1;
+}
+
+void shuffle_close(struct shuffle *sh) {
+    //a kept mapping outlives the shuffle, see shuffle_cache_forget
+    if (sh->mapping != NULL && sh->map_len != 0)
+        munmap(sh->mapping, sh->map_len);
+    else if (sh->mapping == NULL)
+        free(sh->sequence);
+    free(sh->blocks);
+    sh->sequence = NULL;
+    sh->mapping = NULL;
+    sh->blocks = NULL;
+    sh->block_window = 0;
+}
+
+/**
+*Returns the i-th pixel of the shuffled sequence.
+*/
+int shuffle_at(const struct shuffle *sh, int i) {
+    uint64_t x = (uint64_t)i;
+    if (sh->sequence != NULL)
+        return sh->sequence[i];
+    //cycle walking: the network permutes [0, 4^half_bits), stay in [0, pix_N)
+    do {
+        x = feistel(sh, x);
+    } while (x >= (uint64_t)sh->pix_N);
+    return (int)x;
+}
+
+/**
+*Returns the positions [first, first + len) of the shuffled sequence.
+*The materialized modes point into their sequence, or into its sorted
+*blocks for the windows shuffle_sort_windows sorted, the keyed one
+*fills scratch, which must have room for len integers.
+*/
+const int *shuffle_window(const struct shuffle *sh, int first, int len,
+        int *scratch) {
+    int i;
+    if (sh->blocks != NULL && len == sh->block_window && first % len == 0)
+        return sh->blocks + first;
+    if (sh->sequence != NULL)
+        return sh->sequence + first;
+    for (i = 0; i < len; i++)
+        scratch[i] = shuffle_at(sh, first + i);
+    return scratch;
+}
+
+/**
+*Sorts the pixels of every window of the given size by position, in
+*blocks kept with the shuffle that shuffle_window returns from then
+*on. A window is read as a set: its blacks do not depend on the order
+*and scan_window breaks its ties by position, so the watermark is the
+*same, but the gathers walk the image forward instead of missing the
+*cache and the TLB on almost every pixel. A bucket pass over the
+*positions builds all the blocks in O(pix_N), no comparison sort.
+*Only the materialized modes have a sequence to sort, the others are
+*left as they are.
+*\returns 0, or -1 if out of memory, the shuffle still working unsorted.
+*/
+int shuffle_sort_windows(struct shuffle *sh, int window) {
+    int *owner, *next, *blocks;
+    int i, w, windows;
+    if (sh->sequence == NULL || window <= 0 || window > sh->pix_N)
+        return 0;
+    if (sh->blocks != NULL && sh->block_window == window)
+        return 0;
+    windows = sh->pix_N / window;
+    blocks = sh->blocks;
+    if (blocks == NULL)
+        blocks = (int *)malloc((size_t)sh->pix_N * sizeof(int));
+    sh->blocks = NULL;
+    sh->block_window = 0;
+    owner = (int *)malloc((size_t)sh->pix_N * sizeof(int));
+    next = (int *)malloc((size_t)windows * sizeof(int));
+    if (blocks == NULL || owner == NULL || next == NULL) {
+        free(blocks);
+        free(owner);
+        free(next);
+        return -1;
+    }
+    //the window of every pixel, -1 past the last whole window
+    for (i = 0, w = 0; w < windows; w++) {
+        next[w] = i;
+        for (; i < next[w] + window; i++)
+            owner[sh->sequence[i]] = w;
+    }
+    for (; i < sh->pix_N; i++)
+        owner[sh->sequence[i]] = -1;
+    //deal the positions in ascending order to their windows
+    for (i = 0; i < sh->pix_N; i++) {
+        if (owner[i] >= 0)
+            blocks[next[owner[i]]++] = i;
+    }
+    free(owner);
+    free(next);
+    sh->blocks = blocks;
+    sh->block_window = window;
+    return 0;
+}
+
+/**
+*Floyd's algorithm P with the linked list kept in a flat array,
+*next[v] being the value after v and next[0] the head. After the
+*step J the list holds exactly [1, J], so the step inserts J either
+*at the head (T == J) or right after T. That is the sequence the
+*original list of malloc'd nodes produced, for the same seed.
+*/
+int *floyd_permutation(int pix_N, unsigned int seed) {
+    int J, T, i, v;
+    int *next, *final;
+    next = (int *)calloc((size_t)pix_N + 1, sizeof(int)); //next[0] is the sentinel
+    final = (int *)calloc(pix_N, sizeof(int));
+    if (next == NULL || final == NULL) {
+        free(next);
+        free(final);
+        return NULL;
     }
-    hd->next = NULL;
     for (J = 1; J <= pix_N; J++) {
-        T = rand_r(&seedp) % J + 1;
-        if (picked[T] == NULL) {
-            picked[T] = add_node(hd, T);
+        T = rand_r(&seed) % J + 1;
+        if (T == J) {
+            next[J] = next[0];
+            next[0] = J;
         } else {
-            assert(picked[J] == NULL);
-            picked[J] = add_node(picked[T], J);
+            next[J] = next[T];
+            next[T] = J;
         }
     }
-    final = (int *)calloc(pix_N, sizeof(int));
-    for (i = 0, new = hd->next; i < pix_N; i++, new = new->next)
-        final[i] = new->i - 1; /* we have to substract every value by 1
-                                  because the algorithm calculates random
-                                  permutations of integers in the interval
-                                  [1, pix_N]. We need [0, pix_N - 1]. */
-    destroy_sequence(hd);
-    free(picked);
+    for (i = 0, v = next[0]; i < pix_N; i++, v = next[v])
+        final[i] = v - 1; /* we have to substract every value by 1
+                             because the algorithm calculates random
+                             permutations of integers in the interval
+                             [1, pix_N]. We need [0, pix_N - 1]. */
+    free(next);
+    return final;
+}
+
+/**
+*In place Fisher-Yates shuffle of the identity. A single array and
+*a splitmix64 stream, no rand_r and no modulo bias.
+*/
+int *fisher_yates_permutation(int pix_N, unsigned int seed) {
+    int i, j, tmp, *final;
+    uint64_t state = seed;
+    final = (int *)malloc((size_t)pix_N * sizeof(int));
+    if (final == NULL)
+        return NULL;
+    for (i = 0; i < pix_N; i++)
+        final[i] = i;
+    for (i = pix_N - 1; i > 0; i--) {
+        j = bounded_rand(&state, i + 1);
+        tmp = final[i];
+        final[i] = final[j];
+        final[j] = tmp;
+    }
     return final;
 }
 
-struct seq_node *add_node(struct seq_node *hd,  int value) {
-    struct seq_node *new;
-    new = (struct seq_node *)malloc(sizeof(struct seq_node));
-    assert(new != NULL);
-    new->i = value;
-    new->next = hd->next;
-    hd->next = new;
-    return new;
+uint64_t splitmix64(uint64_t *state) {
+    uint64_t z = (*state += 0x9e3779b97f4a7c15ULL);
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+    return z ^ (z >> 31);
 }
 
-void destroy_sequence(struct seq_node *hd) {
-    struct seq_node *previous, *current;
-    previous = hd;
-    current = previous->next;
-    free(previous);
-    while (current != NULL) {
-        previous = current;
-        current = current->next;
-        free(previous);
+/**
+*Uniform integer in [0, range), Lemire's multiply and reject.
+*/
+uint32_t bounded_rand(uint64_t *state, uint32_t range) {
+    uint64_t m = (uint64_t)(uint32_t)splitmix64(state) * range;
+    uint32_t low = (uint32_t)m, threshold;
+    if (low < range) {
+        threshold = -range % range;
+        while (low < threshold) {
+            m = (uint64_t)(uint32_t)splitmix64(state) * range;
+            low = (uint32_t)m;
+        }
     }
+    return (uint32_t)(m >> 32);
+}
+
+/**
+*Derives the round keys from the seed and sizes the balanced
+*network to the smallest even bit width covering pix_N.
+*/
+void feistel_init(struct shuffle *sh, unsigned int seed) {
+    int i, bits = 1;
+    uint64_t state = seed;
+    while (bits < 62 && ((uint64_t)1 << bits) < (uint64_t)sh->pix_N)
+        bits++;
+    sh->half_bits = (bits + 1) / 2;
+    for (i = 0; i < FEISTEL_ROUNDS; i++)
+        sh->keys[i] = splitmix64(&state);
+}
+
+uint64_t feistel(const struct shuffle *sh, uint64_t x) {
+    int i;
+    uint64_t mask = ((uint64_t)1 << sh->half_bits) - 1, l, r, f;
+    l = x >> sh->half_bits;
+    r = x & mask;
+    for (i = 0; i < FEISTEL_ROUNDS; i++) {
+        f = (r ^ sh->keys[i]) * 0xbf58476d1ce4e5b9ULL;
+        f = (f ^ (f >> 31)) * 0x94d049bb133111ebULL;
+        f ^= f >> 29;
+        f = l ^ (f & mask);
+        l = r;
+        r = f;
+    }
+    return (l << sh->half_bits) | r;
+}
+
+/**
+*Reads a shuffle mode given by its number, as the -s of the programs.
+*\returns 0, or -1 if s is not a number from SHUFFLE_FLOYD to
+*SHUFFLE_BANDED, mode being left untouched.
+*/
+int shuffle_mode_parse(const char *s, enum shuffle_mode *mode) {
+    char *end;
+    long n = strtol(s, &end, 10);
+    if (end == s || *end != '\0' || n < SHUFFLE_FLOYD || n > SHUFFLE_BANDED)
+        return -1;
+    *mode = (enum shuffle_mode)n;
+    return 0;
 }
@@ -1,6 +1,49 @@
 #ifndef SHUFFLING_H
 #define SHUFFLING_H
 
+#include <stdint.h>
+#include <stddef.h>
+
+#define SHUFFLE_SEED 7 //magic seed. It is randomly choosen to be lucky number 7
+#define FEISTEL_ROUNDS 4
+
+/**
+*The pixel shuffling generators. The value is stored with the
+*watermark, so existing values must never change meaning.
+*/
+enum shuffle_mode {
+    SHUFFLE_FLOYD = 0, //the historical sequence, Floyd's algorithm P over rand_r
+    SHUFFLE_FISHER_YATES = 1, //in place Fisher-Yates over a 64 bit generator
+    SHUFFLE_FEISTEL = 2, //keyed bijection, computed position by position
+    SHUFFLE_BANDED = 3 //keyed bijections within row bands, see banding.h
+};
+
+/**
+*A pixel shuffle ready to be walked. The materialized modes keep
+*the whole sequence, SHUFFLE_FEISTEL keeps only its round keys and
+*computes any position on demand in O(1) memory.
+*/
+struct shuffle {
+    int pix_N;
+    enum shuffle_mode mode;
+    int *sequence; //NULL for SHUFFLE_FEISTEL
+    void *mapping; //the cache file holding the sequence, if mapped
+    size_t map_len; //0 if shuffle_cache.c keeps the mapping
+    int *blocks; //the windows of block_window pixels sorted, or NULL
+    int block_window;
+    int half_bits; //the Feistel network works on 2 * half_bits bits
+    uint64_t keys[FEISTEL_ROUNDS];
+};
+
 int *random_permutation(int pix_N);
+int *shuffle_sequence(int pix_N, unsigned int seed, enum shuffle_mode mode);
+int shuffle_mode_parse(const char *s, enum shuffle_mode *mode);
+int shuffle_open(struct shuffle *sh, int pix_N, unsigned int seed,
+        enum shuffle_mode mode);
+void shuffle_close(struct shuffle *sh);
+int shuffle_at(const struct shuffle *sh, int i);
+const int *shuffle_window(const struct shuffle *sh, int first, int len,
+        int *scratch);
+int shuffle_sort_windows(struct shuffle *sh, int window);
 
 #endif
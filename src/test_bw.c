@@ -2,23 +2,90 @@
 #include <stdlib.h>
 #include <string.h>
 #include <assert.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/stat.h>
 #include <pbm.h>
 #include <zlib.h>
 #include "flippability.h"
 #include "shuffling.h"
 #include "bin_watermarking.h"
+#include "score_map.h"
+#include "shuffle_cache.h"
+#include "pbm_io.h"
+#include "band_stream.h"
+#include "batch.h"
+#include "profile.h"
+#include "capacity.h"
+#include "fpwm.h"
+#include "wm_header.h"
+#include "inflate_sink.h"
+#include "print_source.h"
+#include "wm_daemon.h"
+#include "image_diff.h"
 
 
 int test_flip_lut(int n);
+int test_builtin_lut(void);
+int test_packed_lut(void);
+int test_neighborhood(char *path);
 int test_shuffling(int n);
+int test_legacy_shuffling(void);
+int test_shuffle_cache(int n);
+int test_packed_image(char *path);
+int test_score_map(char *path);
+int test_score_kernel(char *path);
+int test_pbm_io(char *path);
+int test_shuffle_modes(char *path);
+int test_banded(char *path);
 int test_bin_watermarking(char *path);
+int test_batch(char *path);
+int test_profile(char *path);
+int test_capacity(char *path);
+int test_fpwm(char *path);
+int test_header(char *path);
+int header_flips_no_specks(struct image orig, struct image img, int rows);
+int test_inflate_sink(char *path);
+int test_print_source(char *path);
+int test_daemon(char *path);
+int test_extract_range(char *path);
+int test_embed_update(char *path);
+long changed_pixels(struct image a, struct image b);
+int test_image_diff(char *path);
+int test_sort_windows(char *path);
+void *serve_thread(void *arg);
 
 int main(int argc, char **argv) {
     int status = 0;
     pbm_init(&argc, argv);
     status += test_flip_lut(3);
+    status += test_builtin_lut();
+    status += test_packed_lut();
     status += test_shuffling(1000000);
+    status += test_legacy_shuffling();
+    status += test_shuffle_cache(100000);
+    status += test_packed_image(argv[1]);
+    status += test_score_map(argv[1]);
+    status += test_score_kernel(argv[1]);
+    status += test_pbm_io(argv[1]);
+    status += test_shuffle_modes(argv[1]);
+    status += test_banded(argv[1]);
     status += test_bin_watermarking(argv[1]);
+    status += test_batch(argv[1]);
+    status += test_profile(argv[1]);
+    status += test_capacity(argv[1]);
+    status += test_fpwm(argv[1]);
+    status += test_neighborhood(argv[1]);
+    status += test_header(argv[1]);
+    status += test_inflate_sink(argv[1]);
+    status += test_print_source(argv[1]);
+    status += test_daemon(argv[1]);
+    status += test_extract_range(argv[1]);
+    status += test_embed_update(argv[1]);
+    status += test_image_diff(argv[1]);
+    status += test_sort_windows(argv[1]);
     if (status == 0) {
         printf("PASSED\n");
     } else {
@@ -53,56 +120,1494 @@ int test_flip_lut(int n) {
     return 0;
 }
 
+int test_builtin_lut(void) {
+    FILE *f;
+    float lut[1 << (3 * 3)];
+    size_t items;
+    //the built-in table must match the one init_flippability_lut writes
+    assert(system("rm -f flippalut.data") == 0);
+    init_flippability_lut(3);
+    f = fopen("flippalut.data", "r");
+    assert(f != NULL);
+    items = fread(lut, sizeof(float), 1 << (3 * 3), f);
+    assert(items == (1 << (3 * 3)));
+    fclose(f);
+    assert(memcmp(lut, flippability_lut(3), sizeof(lut)) == 0);
+    return 0;
+}
+
+/**
+*The score of a pattern straight from the criteria, with arrays and
+*a recursive flood fill, to check the bit kernel against.
+*/
+void naive_fill(const int *px, int *seen, int n, int r, int c) {
+    seen[r * n + c] = 1;
+    if (c + 1 < n && !seen[r * n + c + 1] && px[r * n + c + 1] == px[r * n + c])
+        naive_fill(px, seen, n, r, c + 1);
+    if (c > 0 && !seen[r * n + c - 1] && px[r * n + c - 1] == px[r * n + c])
+        naive_fill(px, seen, n, r, c - 1);
+    if (r + 1 < n && !seen[(r + 1) * n + c] && px[(r + 1) * n + c] == px[r * n + c])
+        naive_fill(px, seen, n, r + 1, c);
+    if (r > 0 && !seen[(r - 1) * n + c] && px[(r - 1) * n + c] == px[r * n + c])
+        naive_fill(px, seen, n, r - 1, c);
+}
+
+void naive_features(const int *px, int n, int *sm, int *con) {
+    int r, c, seen[25] = {0};
+    sm[0] = sm[1] = sm[2] = 0;
+    con[0] = con[1] = 0;
+    for (r = 0; r < n; r++) {
+        for (c = 0; c < n; c++) {
+            if (c + 1 < n)
+                sm[0] += px[r * n + c] != px[r * n + c + 1];
+            if (r + 1 < n)
+                sm[1] += px[r * n + c] != px[(r + 1) * n + c];
+            //both diagonals add to the same count
+            if (r + 1 < n && c + 1 < n)
+                sm[2] += px[r * n + c] != px[(r + 1) * n + c + 1];
+            if (r > 0 && c + 1 < n)
+                sm[2] += px[r * n + c] != px[(r - 1) * n + c + 1];
+            if (!seen[r * n + c]) {
+                naive_fill(px, seen, n, r, c);
+                con[px[r * n + c]]++;
+            }
+        }
+    }
+}
+
+float naive_score(uint32_t pattern, int n) {
+    int px[25], sm[3], sm_fl[3], con[2], con_fl[2], j;
+    float score;
+    for (j = 0; j < n * n; j++)
+        px[j] = (pattern >> j) & 1;
+    naive_features(px, n, sm, con);
+    px[(n >> 1) * n + (n >> 1)] ^= 1;
+    naive_features(px, n, sm_fl, con_fl);
+    if (sm[0] + sm[1] + sm[2] == 0 || sm_fl[0] + sm_fl[1] + sm_fl[2] == 0)
+        return 0.0;
+    if (sm[0] == 0 || sm[1] == 0)
+        return 0.0;
+    //the anti-diagonal count is always 0
+    score = 0.5 - 0.250;
+    if (sm[0] == sm_fl[0] && sm[1] == sm_fl[1] && sm[2] == sm_fl[2])
+        score += 0.250;
+    else if (sm[0] < sm_fl[0] || sm[1] < sm_fl[1] || sm[2] < sm_fl[2])
+        score -= 0.125;
+    if (con[0] != con_fl[0] || con[1] != con_fl[1])
+        score -= 0.125;
+    return score;
+}
+
+int test_packed_lut(void) {
+    const unsigned char *packed;
+    const float *lut = flippability_lut(3);
+    unsigned int seed = 5;
+    uint32_t i, pattern;
+    struct timespec t0, t1;
+    int n;
+    //the 3x3 buckets are those of the built-in table
+    packed = flippability_packed(3);
+    assert(packed != NULL);
+    for (i = 0; i < (1 << (3 * 3)); i++) {
+        assert(packed_bucket(packed, i) == score_bucket(lut[i]));
+        assert(pattern_score(i, 3) == lut[i]);
+        assert(naive_score(i, 3) == lut[i]);
+    }
+    for (n = 4; n <= FLIPPABILITY_MAX_N; n++) {
+        assert(system(n == 4 ? "rm -f flippalut4.q4" : "rm -f flippalut5.q4") == 0);
+        clock_gettime(CLOCK_MONOTONIC, &t0);
+        packed = flippability_packed(n);
+        clock_gettime(CLOCK_MONOTONIC, &t1);
+        assert(packed != NULL);
+        printf("flippability_packed(%d): %.3f s\n", n,
+                (t1.tv_sec - t0.tv_sec) + (t1.tv_nsec - t0.tv_nsec) / 1e9);
+        for (i = 0; i < 20000; i++) {
+            pattern = (uint32_t)rand_r(&seed) & ((1u << (n * n)) - 1);
+            assert(pattern_score(pattern, n) == naive_score(pattern, n));
+            assert(packed_bucket(packed, pattern) ==
+                    score_bucket(naive_score(pattern, n)));
+        }
+    }
+    return 0;
+}
+
 int test_shuffling(int n) {
     long sum = 0;
-    int *sequence, idx;
+    int *sequence, idx, mode;
+    char *seen;
     sequence = random_permutation(n);
     for (idx = 0; idx < n; idx++) {
         sum += (long)sequence[idx];
     }
     assert(sum == ((long)n - 1) * (long)n / 2);
     free(sequence);
+    //the other generators must give permutations as well
+    for (mode = SHUFFLE_FISHER_YATES; mode <= SHUFFLE_FEISTEL; mode++) {
+        sequence = shuffle_sequence(n, SHUFFLE_SEED, mode);
+        seen = calloc(n, 1);
+        assert(sequence != NULL && seen != NULL);
+        for (idx = 0; idx < n; idx++) {
+            assert(sequence[idx] >= 0 && sequence[idx] < n && !seen[sequence[idx]]);
+            seen[sequence[idx]] = 1;
+        }
+        free(seen);
+        free(sequence);
+    }
+    return 0;
+}
+
+int test_legacy_shuffling(void) {
+    //FNV-1a hashes of the sequences the original linked list Floyd produced
+    const unsigned long long expected[] = {
+        10163482909702124452ULL, 11931154459833983999ULL,
+        12423068200943539475ULL, 4733044303912700935ULL,
+        17085745805312488719ULL, 13331226853090605565ULL
+    };
+    unsigned long long h;
+    int *sequence, n, i, k;
+    for (k = 0, n = 10; n <= 1000000; k++, n *= 10) {
+        sequence = random_permutation(n);
+        assert(sequence != NULL);
+        h = 1469598103934665603ULL;
+        for (i = 0; i < n; i++)
+            h = (h ^ (unsigned int)sequence[i]) * 1099511628211ULL;
+        assert(h == expected[k]);
+        free(sequence);
+    }
+    return 0;
+}
+
+
+int test_shuffle_cache(int n) {
+    struct shuffle sh;
+    int *sequence, status, fd;
+    void *mapping;
+    long size = 32 + (long)n * sizeof(int);
+    char path[128];
+    const char *dir = "shuffle_cache.test";
+    assert(system("rm -rf shuffle_cache.test && mkdir shuffle_cache.test") == 0);
+    sequence = shuffle_sequence(n, SHUFFLE_SEED, SHUFFLE_FLOYD);
+    assert(sequence != NULL);
+    //the miss generates and publishes, the hit maps the file
+    status = shuffle_open_cached(&sh, n, SHUFFLE_SEED, SHUFFLE_FLOYD, dir, 2 * size);
+    assert(status == 0 && sh.mapping != NULL);
+    assert(memcmp(sh.sequence, sequence, n * sizeof(int)) == 0);
+    mapping = sh.mapping;
+    shuffle_close(&sh);
+    //the hit reuses the verified mapping instead of checking it again
+    status = shuffle_open_cached(&sh, n, SHUFFLE_SEED, SHUFFLE_FLOYD, dir, 2 * size);
+    assert(status == 0 && sh.mapping == mapping && sh.map_len == 0);
+    assert(memcmp(sh.sequence, sequence, n * sizeof(int)) == 0);
+    shuffle_close(&sh);
+    //a new process maps it again
+    shuffle_cache_forget();
+    status = shuffle_open_cached(&sh, n, SHUFFLE_SEED, SHUFFLE_FLOYD, dir, 2 * size);
+    assert(status == 0 && sh.mapping != NULL);
+    assert(memcmp(sh.sequence, sequence, n * sizeof(int)) == 0);
+    shuffle_close(&sh);
+    shuffle_cache_forget();
+    //a corrupt file is detected and replaced by the next mapping
+    snprintf(path, sizeof(path), "%s/perm-v%d-m%d-s%u-n%d.bin", dir,
+            SHUFFLE_CACHE_VERSION, SHUFFLE_FLOYD, SHUFFLE_SEED, n);
+    fd = open(path, O_WRONLY);
+    assert(fd >= 0);
+    assert(pwrite(fd, "\xff\xff\xff\xff", 4, size - 4) == 4);
+    close(fd);
+    status = shuffle_open_cached(&sh, n, SHUFFLE_SEED, SHUFFLE_FLOYD, dir, 2 * size);
+    assert(status == 0);
+    assert(memcmp(sh.sequence, sequence, n * sizeof(int)) == 0);
+    shuffle_close(&sh);
+    //the limit evicts the least recently used file
+    status = shuffle_open_cached(&sh, n, SHUFFLE_SEED + 1, SHUFFLE_FLOYD, dir, size);
+    assert(status == 0 && sh.mapping != NULL);
+    shuffle_close(&sh);
+    assert(access(path, F_OK) != 0);
+    //a kept mapping writes its evicted file back
+    status = shuffle_open_cached(&sh, n, SHUFFLE_SEED, SHUFFLE_FLOYD, dir, size);
+    assert(status == 0 && sh.map_len == 0);
+    shuffle_close(&sh);
+    assert(access(path, F_OK) == 0);
+    shuffle_cache_forget();
+    free(sequence);
+    assert(system("rm -rf shuffle_cache.test") == 0);
     return 0;
 }
 
+int test_packed_image(char *path) {
+    int r, c, cols, rows, status;
+    long blacks = 0;
+    struct image img;
+    bit **bitmap, **unpacked;
+    FILE *fr;
+    fr = pm_openr(path);
+    assert(fr != NULL);
+    bitmap = pbm_readpbm(fr, &cols, &rows);
+    assert(bitmap != NULL);
+    status = image_from_bitmap(&img, bitmap, cols, rows);
+    assert(status == 0);
+    unpacked = image_to_bitmap(img);
+    for (r = 0; r < rows; r++) {
+        for (c = 0; c < cols; c++) {
+            assert(unpacked[r][c] == bitmap[r][c]);
+            assert(image_get(img, r, c) == (bitmap[r][c] == PBM_BLACK));
+            blacks += bitmap[r][c] == PBM_BLACK;
+        }
+    }
+    assert(image_count_blacks(img) == blacks);
+    pbm_freearray(unpacked, rows);
+    pbm_freearray(bitmap, rows);
+    image_free(&img);
+    pm_close(fr);
+    return 0;
+}
+
+int test_score_kernel(char *path) {
+    static const int widths[] = {1, 2, 3, 63, 64, 65, 130, 200};
+    int i, r, c, w, rep;
+    unsigned int seed = 13;
+    struct image img;
+    struct score_map map, plain;
+    const float *lut = flippability_lut(3);
+    struct timespec t0, t1, t2;
+    double sum = 0.0, scalar_s, kernel_s;
+    //the dispatched kernel against the portable one, odd widths included
+    for (w = 0; w < sizeof(widths) / sizeof(widths[0]); w++) {
+        assert(image_alloc(&img, widths[w], 5) == 0);
+        for (r = 0; r < img.rows; r++) {
+            for (c = 0; c < img.cols; c++) {
+                if (rand_r(&seed) % 3 == 0)
+                    image_toggle(img, r, c);
+            }
+        }
+        assert(score_map_build(&map, img, lut) == 0);
+        assert(score_map_build(&plain, img, lut) == 0);
+        for (r = 1; r < img.rows - 1; r++) {
+            score_row_scalar(image_row(img, r - 1), image_row(img, r),
+                    image_row(img, r + 1), img.cols, map.qlut,
+                    plain.bucket + r * img.cols, image_row(plain.nonzero, r));
+            plain.bucket[r * img.cols] = BORDER_BUCKET;
+            plain.bucket[r * img.cols + img.cols - 1] = BORDER_BUCKET;
+            image_row(plain.nonzero, r)[0] |= 1;
+            image_row(plain.nonzero, r)[(img.cols - 1) >> 6] |=
+                    (uint64_t)1 << ((img.cols - 1) & 63);
+        }
+        assert(memcmp(map.bucket, plain.bucket, (size_t)img.cols * img.rows) == 0);
+        assert(memcmp(map.nonzero.words, plain.nonzero.words,
+                (size_t)img.stride * img.rows * sizeof(uint64_t)) == 0);
+        for (i = 0; i < img.cols * img.rows; i++) {
+            assert(score_map_get(&map, i / img.cols, i % img.cols) ==
+                    score_bucket(evaluate(img, i, lut)));
+        }
+        score_map_free(&map);
+        score_map_free(&plain);
+        image_free(&img);
+    }
+    //the whole image kernel against evaluate pixel by pixel
+    assert(pbm_load(path, &img, NULL) == 0);
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    for (rep = 0; rep < 10; rep++) {
+        for (i = 0; i < img.cols * img.rows; i++)
+            sum += evaluate(img, i, lut);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    for (rep = 0; rep < 10; rep++) {
+        assert(score_map_build(&map, img, lut) == 0);
+        score_map_free(&map);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &t2);
+    scalar_s = (t1.tv_sec - t0.tv_sec) + (t1.tv_nsec - t0.tv_nsec) / 1e9;
+    kernel_s = (t2.tv_sec - t1.tv_sec) + (t2.tv_nsec - t1.tv_nsec) / 1e9;
+    printf("score: evaluate %.1f Mpx/s, score_map_build (%s) %.1f Mpx/s\n",
+            10e-6 * img.cols * img.rows / scalar_s,
+            score_simd_available() ? "avx2" : "scalar",
+            10e-6 * img.cols * img.rows / kernel_s);
+    assert(sum > 0.0);
+    image_free(&img);
+    return 0;
+}
+
+int test_pbm_io(char *path) {
+    int r, c, cols, rows, status;
+    unsigned int seed = 11;
+    size_t words;
+    struct image img, ref;
+    struct wm_trailer tr, back;
+    bit **bitmap;
+    FILE *f;
+    //the mapped raster must match the libnetpbm one
+    f = pm_openr(path);
+    assert(f != NULL);
+    bitmap = pbm_readpbm(f, &cols, &rows);
+    assert(bitmap != NULL);
+    status = image_from_bitmap(&ref, bitmap, cols, rows);
+    assert(status == 0);
+    pm_close(f);
+    status = pbm_load(path, &img, &tr);
+    assert(status == 0 && img.cols == cols && img.rows == rows);
+    words = (size_t)img.stride * img.rows;
+    assert(memcmp(img.words, ref.words, words * sizeof(uint64_t)) == 0);
+    //and the written file the one of pbm_writepbm
+    tr.length = 1234;
+    tr.mode = SHUFFLE_FEISTEL;
+    assert(pbm_save("pbm_io.test", img, &tr) == 0);
+    f = pm_openw("pbm_io.ref");
+    assert(f != NULL);
+    pbm_writepbm(f, bitmap, cols, rows, FALSE);
+    fprintf(f, "\n#%ld %d", tr.length, tr.mode);
+    pm_close(f);
+    assert(system("cmp -s pbm_io.test pbm_io.ref") == 0);
+    image_free(&img);
+    status = pbm_load("pbm_io.test", &img, &back);
+    assert(status == 0);
+    assert(back.length == tr.length && back.mode == tr.mode);
+    assert(memcmp(img.words, ref.words, words * sizeof(uint64_t)) == 0);
+    pbm_freearray(bitmap, rows);
+    image_free(&img);
+    image_free(&ref);
+    //a width that ends mid byte and mid word
+    assert(image_alloc(&ref, 70, 3) == 0);
+    for (r = 0; r < ref.rows; r++) {
+        for (c = 0; c < ref.cols; c++) {
+            if (rand_r(&seed) & 1)
+                image_toggle(ref, r, c);
+        }
+    }
+    assert(pbm_save("pbm_io.test", ref, NULL) == 0);
+    assert(pbm_load("pbm_io.test", &img, &back) == 0);
+    assert(back.length == 0 && back.mode == SHUFFLE_FLOYD);
+    assert(memcmp(img.words, ref.words, 2 * 3 * sizeof(uint64_t)) == 0);
+    image_free(&img);
+    image_free(&ref);
+    //the plain format goes through libnetpbm
+    f = fopen("pbm_io.test", "w");
+    assert(f != NULL);
+    fprintf(f, "P1\n3 2\n1 0 1\n0 1 0\n#42");
+    fclose(f);
+    assert(pbm_load("pbm_io.test", &img, &back) == 0);
+    assert(img.cols == 3 && img.rows == 2 && back.length == 42);
+    assert(image_get(img, 0, 0) && !image_get(img, 0, 1) && image_get(img, 1, 1));
+    image_free(&img);
+    assert(pbm_load("pbm_io.missing", &img, NULL) == -1);
+    assert(system("rm -f pbm_io.test pbm_io.ref") == 0);
+    return 0;
+}
+
+int test_score_map(char *path) {
+    int i, r, c, cols, rows, status;
+    unsigned int seed = 11;
+    struct image img;
+    struct score_map map, fresh;
+    const float *lut = flippability_lut(3);
+    bit **bitmap;
+    FILE *fr;
+    fr = pm_openr(path);
+    assert(fr != NULL);
+    bitmap = pbm_readpbm(fr, &cols, &rows);
+    assert(bitmap != NULL);
+    status = image_from_bitmap(&img, bitmap, cols, rows);
+    assert(status == 0);
+    pbm_freearray(bitmap, rows);
+    status = score_map_build(&map, img, lut);
+    assert(status == 0);
+    for (i = 0; i < cols * rows; i++) {
+        assert(score_map_get(&map, i / cols, i % cols) ==
+                score_bucket(evaluate(img, i, lut)));
+    }
+    //the incremental updates must agree with a rebuild from scratch
+    for (i = 0; i < 10000; i++) {
+        r = rand_r(&seed) % rows;
+        c = rand_r(&seed) % cols;
+        image_toggle(img, r, c);
+        score_map_update(&map, img, r, c);
+    }
+    status = score_map_build(&fresh, img, lut);
+    assert(status == 0);
+    assert(memcmp(map.bucket, fresh.bucket, (size_t)cols * rows) == 0);
+    assert(memcmp(map.nonzero.words, fresh.nonzero.words,
+            (size_t)img.stride * rows * sizeof(uint64_t)) == 0);
+    score_map_free(&fresh);
+    score_map_free(&map);
+    image_free(&img);
+    pm_close(fr);
+    return 0;
+}
+
+int test_shuffle_modes(char *path) {
+    int i, cols, rows, status, mode;
+    unsigned int seed = 5;
+    unsigned char payload[200], extracted[200];
+    struct image img;
+    struct wm_options opt;
+    enum shuffle_mode parsed = SHUFFLE_FEISTEL;
+    bit **bitmap;
+    FILE *fr;
+    //-s takes the modes by number, nothing else
+    assert(shuffle_mode_parse("3", &parsed) == 0 && parsed == SHUFFLE_BANDED);
+    assert(shuffle_mode_parse("0", &parsed) == 0 && parsed == SHUFFLE_FLOYD);
+    assert(shuffle_mode_parse("4", &parsed) == -1);
+    assert(shuffle_mode_parse("-1", &parsed) == -1);
+    assert(shuffle_mode_parse("", &parsed) == -1);
+    assert(shuffle_mode_parse("1x", &parsed) == -1);
+    assert(parsed == SHUFFLE_FLOYD);
+    fr = pm_openr(path);
+    assert(fr != NULL);
+    bitmap = pbm_readpbm(fr, &cols, &rows);
+    assert(bitmap != NULL);
+    for (mode = SHUFFLE_FLOYD; mode <= SHUFFLE_FEISTEL; mode++) {
+        status = image_from_bitmap(&img, bitmap, cols, rows);
+        assert(status == 0);
+        for (i = 0; i < sizeof(payload); i++)
+            payload[i] = rand_r(&seed);
+        wm_default_options(&opt);
+        opt.shuffle = mode;
+        opt.threads = 2;
+        embed_opt(img, payload, sizeof(payload), &opt);
+        extract_opt(img, extracted, sizeof(extracted), &opt);
+        assert(memcmp(payload, extracted, sizeof(payload)) == 0);
+        image_free(&img);
+    }
+    pbm_freearray(bitmap, rows);
+    pm_close(fr);
+    return 0;
+}
+
+int test_banded(char *path) {
+    int i, r;
+    unsigned int seed = 9;
+    unsigned char payload[300], extracted[300];
+    struct image img, tall, back;
+    struct band_layout bl;
+    struct wm_options opt;
+    struct wm_trailer tr;
+    assert(pbm_load(path, &img, NULL) == 0);
+    //stack copies so that the image spans a few bands
+    assert(image_alloc(&tall, img.cols, 3 * img.rows) == 0);
+    for (r = 0; r < tall.rows; r++) {
+        memcpy(image_row(tall, r), image_row(img, r % img.rows),
+                img.stride * sizeof(uint64_t));
+    }
+    assert(band_layout_init(&bl, tall.cols, tall.rows, sizeof(payload), 0) == 0);
+    assert(bl.nbands > 1);
+    assert(pbm_save("band.test", tall, NULL) == 0);
+    for (i = 0; i < sizeof(payload); i++)
+        payload[i] = rand_r(&seed);
+    wm_default_options(&opt);
+    opt.shuffle = SHUFFLE_BANDED;
+    assert(embed_opt(tall, payload, sizeof(payload), &opt) == WM_OK);
+    assert(extract_opt(tall, extracted, sizeof(extracted), &opt) == WM_OK);
+    assert(memcmp(payload, extracted, sizeof(payload)) == 0);
+    //streaming band by band must give the very same image
+    assert(embed_stream("band.test", "band.out.test", payload, sizeof(payload),
+            opt.seed, opt.neighborhood) == WM_OK);
+    assert(pbm_load("band.out.test", &back, &tr) == 0);
+    assert(tr.length == sizeof(payload) && tr.mode == SHUFFLE_BANDED);
+    assert(memcmp(back.words, tall.words,
+            (size_t)tall.stride * tall.rows * sizeof(uint64_t)) == 0);
+    memset(extracted, 0, sizeof(extracted));
+    assert(extract_stream("band.out.test", extracted, sizeof(extracted),
+            opt.seed) == WM_OK);
+    assert(memcmp(payload, extracted, sizeof(payload)) == 0);
+    assert(extract_stream("band.missing", extracted, sizeof(extracted),
+            opt.seed) == WM_EIO);
+    image_free(&img);
+    image_free(&tall);
+    image_free(&back);
+    assert(system("rm -f band.test band.out.test") == 0);
+    return 0;
+}
 
 int test_bin_watermarking(char *path) {
-    int i, j, items, status;
+    int items, status, cols, rows;
     struct image img;
+    bit **bitmap;
     FILE *fr, *fw, *f;
     Bytef *orig_pl = calloc(800, 1);
     Bytef *payload = calloc(800, 1);
     uLongf buflen = compressBound(800);
     uLongf dest, src = 800;
     Bytef *zipped = calloc(buflen, 1);
+    Bytef *extracted;
+    struct wm_options opt;
     //INIT
     fr = pm_openr(path);
     assert(fr != NULL);
-    img.bitmap = pbm_readpbm(fr, &img.cols, &img.rows);
-    assert(img.bitmap != NULL);
+    bitmap = pbm_readpbm(fr, &cols, &rows);
+    assert(bitmap != NULL);
+    status = image_from_bitmap(&img, bitmap, cols, rows);
+    assert(status == 0);
+    pbm_freearray(bitmap, rows);
     //PROCESS
     f = fopen("imba.data.gz", "r");
     items = fread(payload, 1, 800, f);
     assert(items == 800);
+    fclose(f);
     memcpy(orig_pl, payload, 800);
     dest = buflen;
     status = compress(zipped, &dest, payload, src);
     assert(status == Z_OK);
-    embed(img, zipped, dest);
-    extract(img, zipped, dest);
+    assert(embed(img, zipped, dest) == WM_OK);
+    extracted = calloc(dest, 1);
+    assert(extracted != NULL);
+    wm_default_options(&opt);
+    opt.threads = 4;
+    assert(extract_opt(img, extracted, dest, &opt) == WM_OK);
+    assert(extract(img, zipped, dest) == WM_OK);
+    //the parallel path must give the exact same bytes
+    assert(memcmp(extracted, zipped, dest) == 0);
     status = uncompress(payload, &src, zipped, dest);
     assert(status == Z_OK);
     status = memcmp(payload, orig_pl, 800);
     assert(status == 0);
     //WRITE_BACK
+    bitmap = image_to_bitmap(img);
     fw = pm_openw("out.pbm");
     assert(fw != NULL);
-    pbm_writepbm(fw, img.bitmap, img.cols, img.rows, FALSE);
+    pbm_writepbm(fw, bitmap, img.cols, img.rows, FALSE);
     //FREE
-    pbm_freearray(img.bitmap, img.rows);
+    pbm_freearray(bitmap, img.rows);
+    image_free(&img);
     free(zipped);
+    free(extracted);
     free(payload);
+    free(orig_pl);
     pm_close(fr);
     pm_close(fw);
     return 0;
 }
+
+int test_batch(char *path) {
+    int i, failed;
+    FILE *f;
+    struct image img;
+    struct wm_trailer tr;
+    struct wm_options opt;
+    unsigned char byte = 0xff;
+    wm_default_options(&opt);
+    opt.shuffle = SHUFFLE_FEISTEL;
+    //bad arguments are reported, not asserted
+    assert(image_alloc(&img, 8, 1) == 0);
+    assert(embed_opt(img, &byte, 0, &opt) == WM_EINVAL);
+    assert(embed_opt(img, &byte, 2, &opt) == WM_EINVAL);
+    //one pixel per window, three of them to flip for a 1
+    assert(embed_opt(img, &byte, 1, &opt) == WM_ECAPACITY);
+    image_free(&img);
+    //the broken items fail alone
+    f = fopen("batch.test", "w");
+    assert(f != NULL);
+    fprintf(f, "# watermark\n\n");
+    for (i = 0; i < 4; i++)
+        fprintf(f, "w %s batch%d.pbm imba.data.gz\n", path, i);
+    fprintf(f, "w missing.pbm batch.pbm imba.data.gz\n");
+    fprintf(f, "x %s\n", path);
+    fclose(f);
+    failed = run_batch("batch.test", &opt, 3);
+    assert(failed == 2);
+    //a trailer with a mode no generator has fails alone
+    assert(pbm_load(path, &img, NULL) == 0);
+    tr.length = 100;
+    tr.mode = SHUFFLE_BANDED + 1;
+    assert(pbm_save("batch4.pbm", img, &tr) == 0);
+    image_free(&img);
+    //the headers carry the mode, the default options must not matter
+    wm_default_options(&opt);
+    f = fopen("batch.test", "w");
+    assert(f != NULL);
+    for (i = 0; i < 5; i++)
+        fprintf(f, "a batch%d.pbm batch%d.data\n", i, i);
+    fclose(f);
+    failed = run_batch("batch.test", &opt, 2);
+    assert(failed == 1);
+    for (i = 0; i < 4; i++) {
+        char cmd[128];
+        snprintf(cmd, sizeof(cmd), "cmp -s batch%d.data imba.data.gz", i);
+        assert(system(cmd) == 0);
+    }
+    assert(system("rm -f batch.test batch?.pbm batch?.data") == 0);
+    return 0;
+}
+
+int test_profile(char *path) {
+#ifdef FPWM_PROFILE
+    struct image img;
+    struct wm_options opt;
+    struct prof prof;
+    unsigned char payload[100], extracted[100];
+    char line[4096];
+    FILE *f;
+    memset(payload, 0x5a, sizeof(payload));
+    assert(pbm_load(path, &img, NULL) == 0);
+    wm_default_options(&opt);
+    opt.threads = 3;
+    //the counters of the worker threads come back to the caller
+    PROF_TAKE(&prof);
+    assert(embed_opt(img, payload, sizeof(payload), &opt) == WM_OK);
+    assert(extract_opt(img, extracted, sizeof(extracted), &opt) == WM_OK);
+    PROF_TAKE(&prof);
+    assert(prof.count[PROF_WINDOWS] == 2 * 8 * sizeof(payload));
+    assert(prof.count[PROF_FAILED] == 0 && prof.count[PROF_FLIPS] > 0);
+    assert(prof.count[PROF_SCORED] >= (uint64_t)img.cols * img.rows);
+    assert(prof.calls[PROF_SUM] == 8 * sizeof(payload));
+    assert(prof.calls[PROF_SCAN] == 8 * sizeof(payload));
+    //one JSON line per report
+    f = tmpfile();
+    assert(f != NULL);
+    PROF_OUTPUT(f);
+    PROF_MERGE(&prof);
+    PROF_REPORT(path);
+    PROF_OUTPUT(NULL);
+    rewind(f);
+    assert(fgets(line, sizeof(line), f) != NULL);
+    assert(strncmp(line, "{\"image\":\"", 10) == 0);
+    assert(strstr(line, "\"windows\":1600") != NULL);
+    assert(fgets(line, sizeof(line), f) == NULL);
+    fclose(f);
+    image_free(&img);
+#else
+    (void)path;
+#endif
+    return 0;
+}
+
+int test_capacity(char *path) {
+    struct image img, dark, copy;
+    struct wm_options opt;
+    struct capacity_report rep;
+    unsigned char payload[512];
+    size_t bytes;
+    int r, c, mode, status;
+    srand(7);
+    for (c = 0; c < (int)sizeof(payload); c++)
+        payload[c] = rand() & 0xff;
+    assert(pbm_load(path, &img, NULL) == 0);
+    wm_default_options(&opt);
+    //the sample payload fits with room to spare
+    assert(analyze_capacity(img, 800, NULL, &opt, &rep) == WM_OK);
+    assert(rep.go && rep.unsafe == 0 && rep.max_safe_bytes >= 800);
+    assert(rep.n_weak == CAPACITY_WEAK);
+    assert(rep.weakest[0].margin <= rep.weakest[CAPACITY_WEAK - 1].margin);
+    image_free(&img);
+    //a nearly black image, where the windows run out of whites
+    assert(image_alloc(&dark, 96, 64) == 0);
+    assert(image_alloc(&copy, 96, 64) == 0);
+    for (r = 0; r < dark.rows; r++)
+        for (c = 0; c < dark.cols; c++)
+            if (rand() % 24 != 0)
+                image_toggle(dark, r, c);
+    for (mode = SHUFFLE_FLOYD; mode <= SHUFFLE_BANDED; mode++) {
+        opt.shuffle = (enum shuffle_mode)mode;
+        for (bytes = 1; bytes <= 96; bytes += 5) {
+            memcpy(copy.words, dark.words,
+                    (size_t)dark.rows * dark.stride * sizeof(uint64_t));
+            assert(analyze_capacity(copy, bytes, payload, &opt, &rep) == WM_OK);
+            status = embed_opt(copy, payload, bytes, &opt);
+            //the dry run predicts the embed exactly
+            assert((rep.failing == 0) == (status == WM_OK));
+            assert(rep.failing <= rep.unsafe);
+        }
+        //the size found safe embeds whatever the payload
+        assert(analyze_capacity(dark, 96, NULL, &opt, &rep) == WM_OK);
+        assert(rep.max_safe_bytes > 0 && rep.max_safe_bytes < 96);
+        memcpy(copy.words, dark.words,
+                (size_t)dark.rows * dark.stride * sizeof(uint64_t));
+        assert(embed_opt(copy, payload, rep.max_safe_bytes, &opt) == WM_OK);
+    }
+    image_free(&dark);
+    image_free(&copy);
+    return 0;
+}
+
+int test_fpwm(char *path) {
+    struct fpwm *ctx;
+    struct image orig, img, ref;
+    struct wm_options opt;
+    unsigned char payload[300], extracted[300];
+    size_t len;
+    long warm;
+    int mode, round;
+    for (len = 0; len < sizeof(payload); len++)
+        payload[len] = (unsigned char)(len * 37 + 11);
+    assert(pbm_load(path, &orig, NULL) == 0);
+    len = (size_t)orig.rows * orig.stride * sizeof(uint64_t);
+    assert(image_alloc(&img, orig.cols, orig.rows) == 0);
+    assert(image_alloc(&ref, orig.cols, orig.rows) == 0);
+    for (mode = SHUFFLE_FLOYD; mode <= SHUFFLE_BANDED; mode++) {
+        wm_default_options(&opt);
+        opt.shuffle = (enum shuffle_mode)mode;
+        memcpy(ref.words, orig.words, len);
+        assert(embed_opt(ref, payload, sizeof(payload), &opt) == WM_OK);
+        assert(fpwm_open(&ctx, &opt) == WM_OK);
+        warm = 0;
+        for (round = 0; round < 3; round++) {
+            //the context gives the images of embed_opt, call after call
+            memcpy(img.words, orig.words, len);
+            assert(fpwm_embed(ctx, img, payload, sizeof(payload)) == WM_OK);
+            assert(memcmp(img.words, ref.words, len) == 0);
+            assert(fpwm_extract(ctx, img, extracted, sizeof(extracted)) == WM_OK);
+            assert(memcmp(extracted, payload, sizeof(payload)) == 0);
+            //warm after the first round
+            if (round == 0)
+                warm = fpwm_allocations(ctx);
+            assert(fpwm_allocations(ctx) == warm);
+        }
+        assert(fpwm_embed(ctx, img, payload, 0) == WM_EINVAL);
+        assert(fpwm_allocations(ctx) == warm);
+        //another size on the same context
+        assert(fpwm_embed(ctx, img, payload, 100) == WM_OK);
+        assert(fpwm_extract(ctx, img, extracted, 100) == WM_OK);
+        assert(memcmp(extracted, payload, 100) == 0);
+        fpwm_close(ctx);
+    }
+    image_free(&orig);
+    image_free(&img);
+    image_free(&ref);
+    return 0;
+}
+
+int test_neighborhood(char *path) {
+    struct image img, copy;
+    struct score_map map, fresh;
+    struct wm_options opt;
+    struct wm_trailer tr;
+    const unsigned char *packed = flippability_packed(5);
+    unsigned char payload[200], extracted[200];
+    unsigned int seed = 3;
+    uint32_t pattern;
+    size_t len;
+    int i, r, c, dr, dc, mode;
+    for (i = 0; i < (int)sizeof(payload); i++)
+        payload[i] = (unsigned char)rand_r(&seed);
+    assert(pbm_load(path, &img, NULL) == 0);
+    len = (size_t)img.rows * img.stride * sizeof(uint64_t);
+    assert(image_alloc(&copy, img.cols, img.rows) == 0);
+    memcpy(copy.words, img.words, len);
+    //every 5x5 score, from the table and the image
+    memset(&map, 0, sizeof(map));
+    assert(score_map_use(&map, 4) != 0);
+    assert(score_map_use(&map, 5) == 0);
+    assert(score_map_rebuild(&map, copy, flippability_lut(3)) == 0);
+    for (r = 2; r < copy.rows - 2; r++) {
+        for (c = 2; c < copy.cols - 2; c++) {
+            pattern = 0;
+            for (dr = 0; dr < 5; dr++)
+                for (dc = 0; dc < 5; dc++)
+                    pattern |= (uint32_t)image_get(copy, r - 2 + dr, c - 2 + dc)
+                            << (dr * 5 + dc);
+            assert(score_map_get(&map, r, c) == packed_bucket(packed, pattern));
+        }
+    }
+    assert(score_map_get(&map, 1, 1) == BORDER_BUCKET);
+    //the updates reach the whole 5x5 neighborhood
+    for (i = 0; i < 2000; i++) {
+        r = rand_r(&seed) % copy.rows;
+        c = rand_r(&seed) % copy.cols;
+        image_toggle(copy, r, c);
+        score_map_update(&map, copy, r, c);
+    }
+    memset(&fresh, 0, sizeof(fresh));
+    assert(score_map_use(&fresh, 5) == 0);
+    assert(score_map_rebuild(&fresh, copy, flippability_lut(3)) == 0);
+    assert(memcmp(map.bucket, fresh.bucket, (size_t)copy.cols * copy.rows) == 0);
+    assert(memcmp(map.nonzero.words, fresh.nonzero.words, len) == 0);
+    score_map_free(&map);
+    score_map_free(&fresh);
+    //the embed picks other pixels, the extract does not care
+    wm_default_options(&opt);
+    opt.neighborhood = 5;
+    for (mode = SHUFFLE_FLOYD; mode <= SHUFFLE_BANDED; mode++) {
+        opt.shuffle = (enum shuffle_mode)mode;
+        memcpy(copy.words, img.words, len);
+        assert(embed_opt(copy, payload, sizeof(payload), &opt) == WM_OK);
+        assert(extract_opt(copy, extracted, sizeof(extracted), &opt) == WM_OK);
+        assert(memcmp(extracted, payload, sizeof(payload)) == 0);
+    }
+    //the stream keeps up with the wider context rows, over several bands
+    image_free(&copy);
+    assert(image_alloc(&copy, img.cols, 3 * img.rows) == 0);
+    for (i = 0; i < 3; i++)
+        memcpy(image_row(copy, i * img.rows), img.words, len);
+    image_free(&img);
+    assert(pbm_save("band.test", copy, NULL) == 0);
+    assert(embed_stream("band.test", "band.out.test", payload, sizeof(payload),
+            opt.seed, opt.neighborhood) == WM_OK);
+    assert(embed_opt(copy, payload, sizeof(payload), &opt) == WM_OK);
+    assert(pbm_load("band.out.test", &img, &tr) == 0);
+    assert(tr.mode == SHUFFLE_BANDED);
+    assert(memcmp(img.words, copy.words, 3 * len) == 0);
+    assert(system("rm -f band.test band.out.test") == 0);
+    image_free(&img);
+    image_free(&copy);
+    return 0;
+}
+
+int test_header(char *path) {
+    struct image orig, img, top, rest;
+    struct wm_options opt;
+    struct wm_header h;
+    struct timespec t0, t1, t2;
+    unsigned char payload[500], extracted[500];
+    unsigned int seed = 5;
+    size_t len;
+    int i, mode, level, strip, margin = 0;
+    for (i = 0; i < (int)sizeof(payload); i++)
+        payload[i] = (unsigned char)rand_r(&seed);
+    assert(pbm_load(path, &orig, NULL) == 0);
+    len = (size_t)orig.rows * orig.stride * sizeof(uint64_t);
+    assert(image_alloc(&img, orig.cols, orig.rows) == 0);
+    //an unmarked image has no header
+    wm_default_options(&opt);
+    memcpy(img.words, orig.words, len);
+    assert(read_header(img, &opt, &h) == WM_ENOHEADER);
+    for (mode = SHUFFLE_FLOYD; mode <= SHUFFLE_BANDED; mode++) {
+        wm_default_options(&opt);
+        opt.shuffle = (enum shuffle_mode)mode;
+        memcpy(img.words, orig.words, len);
+        assert(embed_with_header(img, payload, sizeof(payload), 1234,
+                &opt) == WM_OK);
+        //the header alone tells how to extract
+        wm_default_options(&opt);
+        assert(read_header(img, &opt, &h) == WM_OK);
+        assert(h.version == WM_HEADER_VERSION && (int)h.mode == mode);
+        assert(h.length == sizeof(payload) && h.raw_length == 1234);
+        assert(header_split(img, &h, &top, &rest) == 0);
+        assert(top.rows + rest.rows == img.rows);
+        assert(rest.words == image_row(img, top.rows));
+        assert(header_flips_no_specks(orig, img, h.rows));
+        assert(extract_with_header(img, extracted, &h, &opt) == WM_OK);
+        assert(memcmp(extracted, payload, sizeof(payload)) == 0);
+        //another seed finds nothing
+        opt.seed++;
+        assert(read_header(img, &opt, &h) == WM_ENOHEADER);
+    }
+    //a white top margin taller than the largest strip moves the strip down
+    for (level = 0; header_rows(orig.cols, orig.rows, level) != 0; level++)
+        margin = header_rows(orig.cols, orig.rows, level) + 1;
+    image_free(&img);
+    assert(image_alloc(&img, orig.cols, orig.rows + margin) == 0);
+    memcpy(image_row(img, margin), orig.words, len);
+    wm_default_options(&opt);
+    assert(embed_with_header(img, payload, sizeof(payload), 0, &opt) == WM_OK);
+    assert(read_header(img, &opt, &h) == WM_OK);
+    assert(h.start >= margin / WM_HEADER_ALIGN * WM_HEADER_ALIGN);
+    assert(h.start == header_start(img));
+    assert(extract_with_header(img, extracted, &h, &opt) == WM_OK);
+    assert(memcmp(extracted, payload, sizeof(payload)) == 0);
+    image_free(&img);
+    assert(image_alloc(&img, orig.cols, orig.rows) == 0);
+    memcpy(img.words, orig.words, len);
+    assert(embed_with_header(img, payload, sizeof(payload), 0, &opt) == WM_OK);
+    //the strip of another page of the size, as the batch shares it
+    memcpy(img.words, orig.words, len);
+    level = header_rows(img.cols, img.rows - header_start(img), 2) != 0 ? 2 : 1;
+    strip = header_start(img) + header_rows(img.cols,
+            img.rows - header_start(img), level);
+    header_init(&h, payload, sizeof(payload), 0, &opt);
+    assert(embed_header_at(img, &h, &opt, strip + 1) == WM_ECAPACITY);
+    assert(embed_header_at(img, &h, &opt, strip) == WM_OK);
+    assert(h.rows == strip);
+    assert(read_header(img, &opt, &h) == WM_OK && h.rows == strip);
+    //a payload that does not match its header fails the checksum
+    wm_default_options(&opt);
+    assert(read_header(img, &opt, &h) == WM_OK);
+    h.crc ^= 1;
+    assert(extract_with_header(img, extracted, &h, &opt) == WM_ECHECKSUM);
+    //too small for a header
+    image_free(&img);
+    assert(image_alloc(&img, 64, 64) == 0);
+    assert(header_rows(64, 64, 0) == 0);
+    h.rows = 0;
+    assert(header_split(img, &h, &top, &rest) == -1);
+    assert(embed_with_header(img, payload, 1, 0, &opt) == WM_EINVAL);
+    assert(read_header(img, &opt, &h) == WM_ENOHEADER);
+    image_free(&img);
+    //a blank page has no strip where the header is not a speck
+    assert(image_alloc(&img, orig.cols, orig.rows) == 0);
+    assert(embed_with_header(img, payload, 1, 0, &opt) == WM_ECAPACITY);
+    assert(image_count_blacks(img) == 0);
+    image_free(&img);
+    //the early reject against a full extraction of the trailer era
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    for (i = 0; i < 10; i++)
+        assert(read_header(orig, &opt, &h) == WM_ENOHEADER);
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    for (i = 0; i < 10; i++)
+        assert(extract_opt(orig, extracted, sizeof(extracted), &opt) == WM_OK);
+    clock_gettime(CLOCK_MONOTONIC, &t2);
+    printf("header: reject %.2f ms, full extract %.2f ms\n",
+            ((t1.tv_sec - t0.tv_sec) * 1e3 + (t1.tv_nsec - t0.tv_nsec) / 1e6) / 10,
+            ((t2.tv_sec - t1.tv_sec) * 1e3 + (t2.tv_nsec - t1.tv_nsec) / 1e6) / 10);
+    image_free(&orig);
+    return 0;
+}
+
+/**
+*Checks that no pixel of the top rows the header flipped is a speck:
+*a pixel whose 3x3 neighborhood in the original, the pixels out of the
+*image being white, had its color all over, which scores 0.
+*/
+int header_flips_no_specks(struct image orig, struct image img, int rows) {
+    const float *lut = flippability_lut(3);
+    unsigned int index;
+    int r, c, i, j, k;
+    for (r = 0; r < rows; r++) {
+        for (c = 0; c < orig.cols; c++) {
+            if (image_get(orig, r, c) == image_get(img, r, c))
+                continue;
+            index = 0;
+            k = 0;
+            for (i = r - 1; i <= r + 1; i++) {
+                for (j = c - 1; j <= c + 1; j++, k++) {
+                    if (i >= 0 && i < orig.rows && j >= 0 && j < orig.cols)
+                        index |= (unsigned int)image_get(orig, i, j) << k;
+                }
+            }
+            if (index == 0 || index == 511) {
+                assert(lut[index] == 0.0f);
+                return 0;
+            }
+        }
+    }
+    return 1;
+}
+
+int test_inflate_sink(char *path) {
+    struct image orig, img;
+    struct wm_options opt;
+    struct inflate_sink sink;
+    unsigned char raw[3000], zipped[3100], *out;
+    uLongf zipped_len = sizeof(zipped);
+    size_t len, out_len;
+    uint32_t crc;
+    unsigned int seed = 9;
+    int i, mode, threads;
+    //text like data, a few hundred bytes once compressed
+    for (i = 0; i < (int)sizeof(raw); i++)
+        raw[i] = i % 64 ? "fingerprint minutiae "[i % 21] : rand_r(&seed);
+    assert(compress(zipped, &zipped_len, raw, sizeof(raw)) == Z_OK);
+    assert(zipped_len < 500);
+    assert(pbm_load(path, &orig, NULL) == 0);
+    len = (size_t)orig.rows * orig.stride * sizeof(uint64_t);
+    assert(image_alloc(&img, orig.cols, orig.rows) == 0);
+    for (mode = SHUFFLE_FLOYD; mode <= SHUFFLE_BANDED; mode++) {
+        wm_default_options(&opt);
+        opt.shuffle = (enum shuffle_mode)mode;
+        memcpy(img.words, orig.words, len);
+        assert(embed_opt(img, zipped, zipped_len, &opt) == WM_OK);
+        for (threads = 1; threads <= 3; threads += 2) {
+            //a small hint, the output grows to fit
+            opt.threads = threads;
+            assert(extract_inflate(img, zipped_len, &opt, 100, &out, &out_len,
+                    &crc) == WM_OK);
+            assert(out_len == sizeof(raw) && memcmp(out, raw, out_len) == 0);
+            assert(crc == (uint32_t)crc32(crc32(0L, Z_NULL, 0), zipped,
+                    zipped_len));
+            free(out);
+        }
+    }
+    //garbage stops the extraction at the first chunk inflate rejects
+    for (i = 0; i < (int)zipped_len; i++)
+        zipped[i] = (unsigned char)rand_r(&seed);
+    zipped[0] = 0x78;
+    zipped[1] = 0x9c;
+    wm_default_options(&opt);
+    opt.shuffle = SHUFFLE_FEISTEL;
+    memcpy(img.words, orig.words, len);
+    assert(embed_opt(img, zipped, zipped_len, &opt) == WM_OK);
+    for (threads = 1; threads <= 3; threads += 2) {
+        opt.threads = threads;
+        assert(inflate_sink_init(&sink, 0) == WM_OK);
+        assert(extract_each(img, zipped_len, &opt, inflate_sink_write,
+                &sink) == WM_ECORRUPT);
+        assert(sink.zs.total_in < zipped_len);
+        inflate_sink_free(&sink);
+    }
+    //a stream cut short is corrupt too
+    assert(inflate_sink_init(&sink, 0) == WM_OK);
+    assert(inflate_sink_write(&sink, zipped, 0) == WM_OK);
+    assert(inflate_sink_finish(&sink, &out, &out_len) == WM_ECORRUPT);
+    image_free(&orig);
+    image_free(&img);
+    return 0;
+}
+
+int test_print_source(char *path) {
+    struct print_source ps;
+    struct image img, top, rest;
+    struct wm_options opt;
+    struct wm_header h;
+    unsigned char tmpl[2][700], *data, *zipped, *out;
+    uLongf zipped_len;
+    size_t len, out_len;
+    unsigned int seed = 11;
+    int i, t;
+    FILE *f;
+    for (t = 0; t < 2; t++) {
+        for (i = 0; i < (int)sizeof(tmpl[t]); i++)
+            tmpl[t][i] = i % 7 ? (unsigned char)(i >> 4) : rand_r(&seed);
+        f = fopen(t == 0 ? "print0.test" : "print1.test", "wb");
+        assert(f != NULL);
+        assert(fwrite(tmpl[t], 1, sizeof(tmpl[t]), f) == sizeof(tmpl[t]));
+        fclose(f);
+    }
+    assert(replay_open(&ps, "print0.test,missing.test", NULL) == -1);
+    assert(replay_open(&ps, "print0.test,print1.test", NULL) == 0);
+    //before any enroll the first template is on the sensor
+    assert(ps.verify(&ps, tmpl[0], sizeof(tmpl[0])) == 1);
+    assert(ps.verify(&ps, tmpl[1], sizeof(tmpl[1])) == 0);
+    wm_default_options(&opt);
+    opt.shuffle = SHUFFLE_FEISTEL;
+    for (t = 0; t < 3; t++) {
+        //the templates round robin, through the whole pipeline
+        assert(ps.enroll(&ps, &data, &len) == 0);
+        assert(len == sizeof(tmpl[t % 2]) && memcmp(data, tmpl[t % 2], len) == 0);
+        zipped_len = compressBound(len);
+        zipped = (unsigned char *)malloc(zipped_len);
+        assert(compress(zipped, &zipped_len, data, len) == Z_OK);
+        assert(pbm_load(path, &img, NULL) == 0);
+        assert(embed_with_header(img, zipped, zipped_len, len, &opt) == WM_OK);
+        assert(pbm_save("print.pbm", img, NULL) == 0);
+        image_free(&img);
+        assert(pbm_load("print.pbm", &img, NULL) == 0);
+        assert(read_header(img, &opt, &h) == WM_OK);
+        assert(header_split(img, &h, &top, &rest) == 0);
+        assert(h.mode == opt.shuffle);
+        assert(extract_inflate(rest, h.length, &opt, h.raw_length, &out,
+                &out_len, NULL) == WM_OK);
+        assert(ps.verify(&ps, out, out_len) == 1);
+        //the other template does not match
+        assert(ps.verify(&ps, tmpl[(t + 1) % 2], sizeof(tmpl[0])) == 0);
+        image_free(&img);
+        free(out);
+        free(zipped);
+        free(data);
+    }
+    ps.close(&ps);
+    assert(system("rm -f print0.test print1.test print.pbm") == 0);
+    return 0;
+}
+
+struct serve_args {
+    const char *path;
+    struct wm_options opt;
+    int status;
+};
+
+void *serve_thread(void *arg) {
+    struct serve_args *a = (struct serve_args *)arg;
+    a->status = daemon_serve(a->path, &a->opt);
+    return NULL;
+}
+
+int test_daemon(char *path) {
+    struct serve_args args;
+    struct daemon_request rq;
+    struct daemon_reply rp;
+    struct image orig, img, ref, plain;
+    struct stat st;
+    pthread_t thread;
+    double embed_ms = 0.0;
+    unsigned char payload[400], extracted[400];
+    unsigned int seed = 13;
+    size_t len;
+    int i, sock, fd, payload_fd, out_fd;
+    FILE *f;
+    for (i = 0; i < (int)sizeof(payload); i++)
+        payload[i] = (unsigned char)rand_r(&seed);
+    f = fopen("daemon.payload", "wb");
+    assert(f != NULL);
+    assert(fwrite(payload, 1, sizeof(payload), f) == sizeof(payload));
+    fclose(f);
+    args.path = "daemon.sock";
+    wm_default_options(&args.opt);
+    args.opt.shuffle = SHUFFLE_FEISTEL;
+    args.opt.threads = 2;
+    assert(pthread_create(&thread, NULL, serve_thread, &args) == 0);
+    for (i = 0; i < 200 && (sock = daemon_connect(args.path)) < 0; i++)
+        usleep(10000);
+    assert(sock >= 0);
+    //only the owner of the daemon may connect
+    assert(stat(args.path, &st) == 0 && (st.st_mode & 0777) == 0600);
+    assert(pbm_load(path, &orig, NULL) == 0);
+    len = (size_t)orig.rows * orig.stride * sizeof(uint64_t);
+    assert(shared_image_create(orig.cols, orig.rows, &fd, &img) == 0);
+    //the daemon embeds in place what embed_with_header would
+    assert(image_alloc(&ref, orig.cols, orig.rows) == 0);
+    memcpy(ref.words, orig.words, len);
+    assert(embed_with_header(ref, payload, sizeof(payload), 0, &args.opt) ==
+            WM_OK);
+    memset(&rq, 0, sizeof(rq));
+    for (i = 0; i < 2; i++) {
+        memcpy(img.words, orig.words, len);
+        payload_fd = open("daemon.payload", O_RDONLY);
+        rq.op = DAEMON_EMBED;
+        assert(daemon_call(sock, &rq, fd, payload_fd, &rp) == WM_OK);
+        close(payload_fd);
+        assert(rp.status == WM_OK && rp.length == sizeof(payload));
+        assert(memcmp(img.words, ref.words, len) == 0);
+        embed_ms = rp.work_ms;
+        out_fd = open("daemon.extracted", O_RDWR | O_CREAT | O_TRUNC, 0644);
+        rq.op = DAEMON_EXTRACT;
+        assert(daemon_call(sock, &rq, fd, out_fd, &rp) == WM_OK);
+        assert(rp.status == WM_OK && rp.length == sizeof(payload));
+        assert(pread(out_fd, extracted, sizeof(extracted), 0) ==
+                (ssize_t)sizeof(extracted));
+        assert(memcmp(extracted, payload, sizeof(payload)) == 0);
+        close(out_fd);
+    }
+    printf("daemon: embed %.2f ms, extract %.2f ms warm\n", embed_ms,
+            rp.work_ms);
+    //an unmarked image and a request without its fds are refused
+    memcpy(img.words, orig.words, len);
+    out_fd = open("daemon.extracted", O_RDWR | O_CREAT | O_TRUNC, 0644);
+    rq.op = DAEMON_EXTRACT;
+    assert(daemon_call(sock, &rq, fd, out_fd, &rp) == WM_OK);
+    assert(rp.status == WM_ENOHEADER);
+    close(out_fd);
+    assert(daemon_call(sock, &rq, -1, -1, &rp) == WM_OK);
+    assert(rp.status == WM_EINVAL);
+    //a file whose size is not sealed could shrink under the mapping
+    payload_fd = open("daemon.payload", O_RDWR);
+    assert(shared_image_map(payload_fd, 0, &plain) == -1);
+    out_fd = open("daemon.extracted", O_RDWR | O_CREAT | O_TRUNC, 0644);
+    assert(daemon_call(sock, &rq, payload_fd, out_fd, &rp) == WM_OK);
+    assert(rp.status == WM_EIO);
+    close(out_fd);
+    close(payload_fd);
+    rq.op = DAEMON_QUIT;
+    assert(daemon_call(sock, &rq, -1, -1, &rp) == WM_OK);
+    assert(rp.status == WM_OK);
+    close(sock);
+    pthread_join(thread, NULL);
+    assert(args.status == WM_OK);
+    assert(access(args.path, F_OK) != 0);
+    shared_image_unmap(&img);
+    close(fd);
+    image_free(&orig);
+    image_free(&ref);
+    assert(system("rm -f daemon.payload daemon.extracted") == 0);
+    return 0;
+}
+
+int test_extract_range(char *path) {
+    struct image orig, img;
+    struct wm_options opt;
+    struct timespec t0, t1, t2;
+    unsigned char payload[300], extracted[300], range[300];
+    static const size_t ranges[][2] = {
+        {0, 1}, {0, 300}, {17, 16}, {299, 1}, {100, 50}, {250, 0}
+    };
+    unsigned int seed = 17;
+    size_t len;
+    int i, mode, level, margin = 0;
+    for (i = 0; i < (int)sizeof(payload); i++)
+        payload[i] = (unsigned char)rand_r(&seed);
+    assert(pbm_load(path, &orig, NULL) == 0);
+    len = (size_t)orig.rows * orig.stride * sizeof(uint64_t);
+    assert(image_alloc(&img, orig.cols, orig.rows) == 0);
+    for (mode = SHUFFLE_FLOYD; mode <= SHUFFLE_BANDED; mode++) {
+        wm_default_options(&opt);
+        opt.shuffle = (enum shuffle_mode)mode;
+        memcpy(img.words, orig.words, len);
+        assert(embed_opt(img, payload, sizeof(payload), &opt) == WM_OK);
+        assert(extract_opt(img, extracted, sizeof(extracted), &opt) == WM_OK);
+        //a range is the same bytes as the whole payload, even where the
+        //embed could not set them
+        for (i = 0; i < (int)(sizeof(ranges) / sizeof(ranges[0])); i++) {
+            memset(range, 0xa5, sizeof(range));
+            assert(extract_range(img, range, sizeof(payload), ranges[i][0],
+                    ranges[i][1], &opt) == WM_OK);
+            assert(memcmp(range, extracted + ranges[i][0], ranges[i][1]) == 0);
+        }
+        assert(extract_range(img, range, sizeof(payload), 290, 11, &opt) ==
+                WM_EINVAL);
+        assert(extract_range(img, range, sizeof(payload), 301, 0, &opt) ==
+                WM_EINVAL);
+    }
+    //a field of 16 bytes against the whole payload, keyed shuffle
+    wm_default_options(&opt);
+    opt.shuffle = SHUFFLE_FEISTEL;
+    memcpy(img.words, orig.words, len);
+    assert(embed_opt(img, payload, sizeof(payload), &opt) == WM_OK);
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    for (i = 0; i < 10; i++)
+        assert(extract_range(img, range, sizeof(payload), 40, 16, &opt) == WM_OK);
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    for (i = 0; i < 10; i++)
+        assert(extract_opt(img, extracted, sizeof(payload), &opt) == WM_OK);
+    clock_gettime(CLOCK_MONOTONIC, &t2);
+    assert(memcmp(range, extracted + 40, 16) == 0);
+    printf("extract_range: 16 of %lu bytes %.3f ms, whole %.3f ms\n",
+            (unsigned long)sizeof(payload),
+            ((t1.tv_sec - t0.tv_sec) * 1e3 + (t1.tv_nsec - t0.tv_nsec) / 1e6) / 10,
+            ((t2.tv_sec - t1.tv_sec) * 1e3 + (t2.tv_nsec - t1.tv_nsec) / 1e6) / 10);
+    image_free(&orig);
+    image_free(&img);
+    return 0;
+}
+
+int test_embed_update(char *path) {
+    struct image orig, img, marked, again;
+    struct wm_options opt;
+    struct wm_header h;
+    struct timespec t0, t1, t2;
+    unsigned char payload[300], was[300], now[300], extracted[300];
+    unsigned int seed = 23;
+    size_t len;
+    long touched, diff;
+    int i, mode;
+    for (i = 0; i < (int)sizeof(payload); i++)
+        payload[i] = (unsigned char)rand_r(&seed);
+    assert(pbm_load(path, &orig, NULL) == 0);
+    len = (size_t)orig.rows * orig.stride * sizeof(uint64_t);
+    assert(image_alloc(&img, orig.cols, orig.rows) == 0);
+    assert(image_alloc(&marked, orig.cols, orig.rows) == 0);
+    assert(image_alloc(&again, orig.cols, orig.rows) == 0);
+    for (mode = SHUFFLE_FLOYD; mode <= SHUFFLE_BANDED; mode++) {
+        wm_default_options(&opt);
+        opt.shuffle = (enum shuffle_mode)mode;
+        memcpy(marked.words, orig.words, len);
+        assert(embed_opt(marked, payload, sizeof(payload), &opt) == WM_OK);
+        //what the image carries, even where the embed could not set it
+        assert(extract_opt(marked, was, sizeof(was), &opt) == WM_OK);
+        memcpy(now, was, sizeof(now));
+        now[0] ^= 0x01;
+        now[150] ^= 0x81;
+        now[299] ^= 0x10;
+        memcpy(img.words, marked.words, len);
+        assert(embed_update(img, was, now, sizeof(now), &opt, &touched) ==
+                WM_OK);
+        assert(touched == 4);
+        assert(extract_opt(img, extracted, sizeof(extracted), &opt) == WM_OK);
+        assert(memcmp(extracted, now, sizeof(now)) == 0);
+        //at most 3 flips per window touched
+        diff = changed_pixels(img, marked);
+        assert(diff > 0 && diff <= 3 * touched);
+        //reading the old bits from the image flips the same pixels
+        memcpy(again.words, marked.words, len);
+        assert(embed_update(again, NULL, now, sizeof(now), &opt, &touched) ==
+                WM_OK);
+        assert(touched == 4);
+        assert(memcmp(again.words, img.words, len) == 0);
+        //nothing to change, nothing touched
+        assert(embed_update(again, NULL, now, sizeof(now), &opt, &touched) ==
+                WM_OK);
+        assert(touched == 0);
+        assert(memcmp(again.words, img.words, len) == 0);
+    }
+    //the header follows the payload
+    wm_default_options(&opt);
+    memcpy(marked.words, orig.words, len);
+    assert(embed_with_header(marked, payload, sizeof(payload), 0, &opt) ==
+            WM_OK);
+    memcpy(now, payload, sizeof(now));
+    now[42] ^= 0x04;
+    memcpy(img.words, marked.words, len);
+    assert(update_with_header(img, now, sizeof(now), 1000, &opt, &touched) ==
+            WM_OK);
+    assert(touched > 1);
+    assert(read_header(img, &opt, &h) == WM_OK);
+    assert(h.raw_length == 1000);
+    //the rewritten header is held to the speck rule too
+    assert(header_flips_no_specks(marked, img, h.rows));
+    assert(extract_with_header(img, extracted, &h, &opt) == WM_OK);
+    assert(memcmp(extracted, now, sizeof(now)) == 0);
+    assert(update_with_header(img, now, 299, 0, &opt, &touched) == WM_EINVAL);
+    assert(update_with_header(orig, now, sizeof(now), 0, &opt, &touched) ==
+            WM_ENOHEADER);
+    //one byte changed against the full embed of the new payload
+    opt.shuffle = SHUFFLE_FEISTEL;
+    memcpy(marked.words, orig.words, len);
+    assert(embed_opt(marked, payload, sizeof(payload), &opt) == WM_OK);
+    assert(extract_opt(marked, was, sizeof(was), &opt) == WM_OK);
+    memcpy(now, was, sizeof(now));
+    now[7] ^= 0xff;
+    memcpy(img.words, marked.words, len);
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    assert(embed_update(img, was, now, sizeof(now), &opt, &touched) == WM_OK);
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    diff = changed_pixels(img, marked);
+    memcpy(again.words, marked.words, len);
+    assert(embed_opt(again, now, sizeof(now), &opt) == WM_OK);
+    clock_gettime(CLOCK_MONOTONIC, &t2);
+    printf("embed_update: %ld windows, %ld pixels in %.3f ms, "
+            "embed %ld pixels in %.3f ms\n", touched, diff,
+            (t1.tv_sec - t0.tv_sec) * 1e3 + (t1.tv_nsec - t0.tv_nsec) / 1e6,
+            changed_pixels(again, marked),
+            (t2.tv_sec - t1.tv_sec) * 1e3 + (t2.tv_nsec - t1.tv_nsec) / 1e6);
+    image_free(&orig);
+    image_free(&img);
+    image_free(&marked);
+    image_free(&again);
+    return 0;
+}
+
+long changed_pixels(struct image a, struct image b) {
+    size_t i, words = (size_t)a.rows * a.stride;
+    long n = 0;
+    for (i = 0; i < words; i++)
+        n += __builtin_popcountll(a.words[i] ^ b.words[i]);
+    return n;
+}
+
+int test_image_diff(char *path) {
+    struct image orig, img, bitmap, big, other;
+    struct diff_report rep;
+    struct score_map map;
+    struct timespec t0, t1;
+    unsigned char payload[300];
+    const float *lut;
+    unsigned int seed = 29;
+    size_t len, i;
+    long sum, low, tile_sum, scores[SCORE_BUCKETS];
+    int r, c, k, n, tile;
+    FILE *f;
+    char line[64];
+    for (i = 0; i < sizeof(payload); i++)
+        payload[i] = (unsigned char)rand_r(&seed);
+    assert(pbm_load(path, &orig, NULL) == 0);
+    len = (size_t)orig.rows * orig.stride * sizeof(uint64_t);
+    assert(image_alloc(&img, orig.cols, orig.rows) == 0);
+    memcpy(img.words, orig.words, len);
+    assert(embed(img, payload, sizeof(payload)) == WM_OK);
+    lut = flippability_lut(3);
+    //every tile size against the pixel by pixel comparison, the scores
+    //against the map of the original the embed would build
+    for (tile = 1; tile <= 200; tile += tile < 8 ? 1 : 37) {
+        n = tile & 1 ? 3 : 5;
+        memset(&map, 0, sizeof(map));
+        assert(score_map_use(&map, n) == 0);
+        assert(score_map_rebuild(&map, orig, lut) == 0);
+        assert(image_diff(orig, img, tile, n, &bitmap, &rep) == WM_OK);
+        assert(rep.flips == changed_pixels(orig, img));
+        assert(rep.flips == image_count_blacks(bitmap));
+        assert(rep.neighborhood == n);
+        sum = low = 0;
+        memset(scores, 0, sizeof(scores));
+        for (r = 0; r < orig.rows; r++) {
+            for (c = 0; c < orig.cols; c++) {
+                if (image_get(orig, r, c) == image_get(img, r, c))
+                    continue;
+                assert(image_get(bitmap, r, c) == 1);
+                sum++;
+                scores[score_map_get(&map, r, c)]++;
+            }
+        }
+        for (k = 0; k < SCORE_BUCKETS; k++) {
+            assert(scores[k] == rep.score_flips[k]);
+            if (k < DIFF_LOW_BUCKET)
+                low += scores[k];
+        }
+        score_map_free(&map);
+        tile_sum = 0;
+        for (i = 0; i < (size_t)rep.tiles_x * rep.tiles_y; i++) {
+            tile_sum += rep.tile_flips[i];
+            assert(rep.tile_flips[i] <= (long)tile * tile);
+        }
+        assert(sum == rep.flips && tile_sum == rep.flips);
+        assert(low == rep.low_score);
+        assert(rep.max_density > 0 && rep.max_density <= 1.0);
+        assert(rep.tile_flips[(size_t)rep.densest_y * rep.tiles_x +
+                rep.densest_x] > 0);
+        image_free(&bitmap);
+        diff_report_free(&rep);
+    }
+    //the same image, nothing to report
+    assert(image_diff(orig, orig, 0, 3, NULL, &rep) == WM_OK);
+    assert(rep.flips == 0 && rep.tile == DIFF_TILE && rep.max_density == 0);
+    f = tmpfile();
+    assert(f != NULL);
+    diff_report_json(f, "a\"b", "c", &rep);
+    rewind(f);
+    assert(fgets(line, sizeof(line), f) != NULL);
+    assert(strncmp(line, "{\"a\":\"a\\\"b\",\"b\":\"c\",\"cols\":", 27) == 0);
+    fclose(f);
+    diff_report_free(&rep);
+    assert(image_alloc(&bitmap, orig.cols, orig.rows + 1) == 0);
+    assert(image_diff(orig, bitmap, 0, 3, NULL, &rep) == WM_EINVAL);
+    assert(image_diff(orig, orig, 0, 4, NULL, &rep) == WM_EINVAL);
+    image_free(&bitmap);
+    //a 100 megapixel pair, a flip every 997 pixels
+    assert(image_alloc(&big, 10000, 10000) == 0);
+    assert(image_alloc(&other, 10000, 10000) == 0);
+    for (i = 0; i < (size_t)big.stride * big.rows; i++)
+        big.words[i] = other.words[i] = 0x00ff00ff00ff00ffULL * (i & 1);
+    for (i = 0; i < 100000000; i += 997)
+        image_toggle(other, (int)(i / 10000), (int)(i % 10000));
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    assert(image_diff(big, other, 0, 3, NULL, &rep) == WM_OK);
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    assert(rep.flips == (100000000 + 996) / 997);
+    printf("image_diff: 100 Mpx, %ld flips in %.3f ms\n", rep.flips,
+            (t1.tv_sec - t0.tv_sec) * 1e3 + (t1.tv_nsec - t0.tv_nsec) / 1e6);
+    diff_report_free(&rep);
+    image_free(&big);
+    image_free(&other);
+    image_free(&orig);
+    image_free(&img);
+    return 0;
+}
+
+int test_sort_windows(char *path) {
+    struct image orig, img, sorted;
+    struct shuffle sh, plain;
+    unsigned char payload[300], extracted[300];
+    const int *seq, *block;
+    unsigned char *seen;
+    unsigned int seed = 31;
+    size_t len;
+    int i, k, w, window, mode;
+    for (i = 0; i < (int)sizeof(payload); i++)
+        payload[i] = (unsigned char)rand_r(&seed);
+    assert(pbm_load(path, &orig, NULL) == 0);
+    len = (size_t)orig.rows * orig.stride * sizeof(uint64_t);
+    assert(image_alloc(&img, orig.cols, orig.rows) == 0);
+    assert(image_alloc(&sorted, orig.cols, orig.rows) == 0);
+    window = payload_window(orig, sizeof(payload));
+    seen = (unsigned char *)calloc(orig.cols * orig.rows, 1);
+    assert(seen != NULL);
+    for (mode = SHUFFLE_FLOYD; mode <= SHUFFLE_FISHER_YATES; mode++) {
+        assert(shuffle_open(&plain, orig.cols * orig.rows, SHUFFLE_SEED,
+                (enum shuffle_mode)mode) == 0);
+        assert(shuffle_open(&sh, orig.cols * orig.rows, SHUFFLE_SEED,
+                (enum shuffle_mode)mode) == 0);
+        assert(shuffle_sort_windows(&sh, window) == 0);
+        assert(sh.block_window == window);
+        //every block is its window, ascending
+        for (w = 0; w < 8 * (int)sizeof(payload); w++) {
+            seq = shuffle_window(&plain, w * window, window, NULL);
+            block = shuffle_window(&sh, w * window, window, NULL);
+            for (k = 0; k < window; k++)
+                seen[seq[k]] = 1;
+            for (k = 0; k < window; k++) {
+                assert(seen[block[k]] == 1);
+                seen[block[k]] = 0;
+                assert(k == 0 || block[k - 1] < block[k]);
+            }
+        }
+        //the windows are sets, the watermark does not change
+        memcpy(img.words, orig.words, len);
+        memcpy(sorted.words, orig.words, len);
+        assert(embed_shuffled(img, payload, sizeof(payload), &plain) == WM_OK);
+        assert(embed_shuffled(sorted, payload, sizeof(payload), &sh) == WM_OK);
+        assert(memcmp(img.words, sorted.words, len) == 0);
+        assert(extract_shuffled(sorted, extracted, sizeof(extracted), &sh, 1) ==
+                WM_OK);
+        assert(memcmp(extracted, payload, sizeof(payload)) == 0);
+        //another size sorts again, windows of the old size are not used
+        assert(shuffle_sort_windows(&sh, window / 2) == 0);
+        assert(shuffle_window(&sh, window, window, NULL) ==
+                shuffle_window(&plain, window, window, NULL) - plain.sequence +
+                sh.sequence);
+        shuffle_close(&sh);
+        shuffle_close(&plain);
+    }
+    //the keyed shuffle has nothing to sort
+    assert(shuffle_open(&sh, orig.cols * orig.rows, SHUFFLE_SEED,
+            SHUFFLE_FEISTEL) == 0);
+    assert(shuffle_sort_windows(&sh, window) == 0 && sh.blocks == NULL);
+    shuffle_close(&sh);
+    free(seen);
+    image_free(&orig);
+    image_free(&img);
+    image_free(&sorted);
+    return 0;
+}
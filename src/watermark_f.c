@@ -7,86 +7,159 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <assert.h>
+#include <unistd.h>
 #include <pbm.h>
 #include <zlib.h>
-#include <libfprint/fprint.h>
 #include "bin_watermarking.h"
+#include "pbm_io.h"
+#include "band_stream.h"
+#include "batch.h"
+#include "capacity.h"
+#include "wm_header.h"
+#include "inflate_sink.h"
+#include "print_source.h"
+#include "image_diff.h"
+#include "profile.h"
 
-void watermark(struct fp_dev *dev, char *path);
-void authenticate(struct fp_dev *dev, char *path);
-struct fp_dscv_dev *discover_device(struct fp_dscv_dev **discovered_devs);
-struct fp_print_data *enroll(struct fp_dev *dev);
-int verify(struct fp_dev *dev, struct fp_print_data *data);
+int watermark(struct print_source *ps, char *path, const struct wm_options *opt);
+int authenticate(struct print_source *ps, char *path,
+        const struct wm_options *opt);
+int estimate(char *path, size_t bytes, const struct wm_options *opt);
+int throughput(struct print_source *ps, char *path, int rounds,
+        const struct wm_options *opt);
+int compare(char *pair, int tile, int neighborhood, const char *bitmap);
 
 int main(int argc, char **argv) {
     int opt;
-    int r = 1;
-    struct fp_dscv_dev *ddev;
-    struct fp_dscv_dev **discovered_devs;
-    struct fp_dev *dev;
+    int r = 0;
+    int rounds = 1;
+    int tile = DIFF_TILE;
+    const char *bitmap = NULL;
+    struct print_source source;
+    struct print_source *ps = NULL;
+    struct wm_options options;
+    FILE *profile = NULL;
+    size_t bytes = 2414; //fingerprint data standard size, uncompressed
     //INIT
     pbm_init(&argc, argv);
-    r = fp_init();
-    if (r < 0) {
-        fprintf(stderr, "Failed to initialize libfprint\n");
-        exit(1);
-    }
-    fp_set_debug(3);
-    discovered_devs = fp_discover_devs();
-    if (!discovered_devs) {
-        fprintf(stderr, "Could not discover devices\n");
-        abort();
-    }
-    ddev = discover_device(discovered_devs);
-    if (!ddev) {
-        fprintf(stderr, "No devices detected.\n");
-        abort();
-    }
-    dev = fp_dev_open(ddev);
-    fp_dscv_devs_free(discovered_devs);
-    if (!dev) {
-        fprintf(stderr, "Could not open device.\n");
-        abort();
-    }
+    wm_default_options(&options);
+    options.threads = 0;
+    options.shuffle = SHUFFLE_FISHER_YATES;
     //PROCESS
-    while ((opt = getopt(argc, argv, "w:a:h")) != -1) {
+    while ((opt = getopt(argc, argv, "c:j:s:n:p:l:e:g:o:d:r:t:T:w:a:b:h")) != -1) {
         switch (opt) {
+        case 'p':
+#ifdef FPWM_PROFILE
+            profile = fopen(optarg, "a");
+            if (profile == NULL)
+                fprintf(stderr, "Cannot open %s\n", optarg);
+            PROF_OUTPUT(profile);
+#else
+            fprintf(stderr, "Built without profiling (make PROFILE=1)\n");
+#endif
+            break;
+        case 'c':
+            options.cache_dir = optarg;
+            break;
+        case 'j':
+            options.threads = atoi(optarg);
+            break;
+        case 's':
+            if (shuffle_mode_parse(optarg, &options.shuffle) != 0) {
+                fprintf(stderr, "-s takes a shuffle mode from %d to %d\n",
+                        SHUFFLE_FLOYD, SHUFFLE_BANDED);
+                return 1;
+            }
+            break;
+        case 'n':
+            options.neighborhood = atoi(optarg);
+            break;
+        case 'l':
+            bytes = (size_t)atol(optarg);
+            break;
+        case 'e':
+            //a dry run, the image is not touched
+            if (estimate(optarg, bytes, &options) != 0)
+                r = 1;
+            break;
+        case 'g':
+            tile = atoi(optarg);
+            break;
+        case 'o':
+            bitmap = optarg;
+            break;
+        case 'd':
+            //no reader needed to compare two images
+            if (compare(optarg, tile, options.neighborhood, bitmap) != 0)
+                r = 1;
+            break;
+        case 'r':
+            //replay stored templates instead of scanning fingers
+            if (ps != NULL)
+                ps->close(ps);
+            ps = NULL;
+            if (replay_open(&source, optarg, NULL) != 0)
+                return 1;
+            ps = &source;
+            break;
+        case 't':
+            rounds = atoi(optarg);
+            break;
+        case 'T':
+            if (ps == NULL && device_open(&source) == 0)
+                ps = &source;
+            if (throughput(ps, optarg, rounds, &options) != 0)
+                r = 1;
+            break;
         case 'w':
-            watermark(dev, optarg);
+            if (ps == NULL && device_open(&source) == 0)
+                ps = &source;
+            if (watermark(ps, optarg, &options) != 0)
+                r = 1;
             break;
         case 'a':
-            authenticate(dev,optarg);
+            if (ps == NULL && device_open(&source) == 0)
+                ps = &source;
+            if (authenticate(ps, optarg, &options) != 1)
+                r = 1;
+            break;
+        case 'b':
+            //the batch jobs carry their payloads, no reader needed
+            if (run_batch(optarg, &options, options.threads) != 0)
+                r = 1;
             break;
         default:
             printf("Bad argument\n");
         }
     }
     //FREE
-    fp_dev_close(dev);
-    return 0;
+    if (ps != NULL)
+        ps->close(ps);
+    if (profile != NULL)
+        fclose(profile);
+    return r;
 }
 
 /**
-*  Check the source
+*Enrolls a finger and embeds its compressed template in the image,
+*saved as out.pbm.
+*\returns 0, or -1 if the image could not be watermarked.
 */
-void watermark(struct fp_dev *dev, char *path) {
-    FILE *fr, *fw;
+int watermark(struct print_source *ps, char *path, const struct wm_options *opt) {
     int status;
     unsigned char *buf;
-    struct fp_print_data *data;
-    size_t bytes;
     struct image img;
+    size_t bytes;
     uLongf d_len, s_len;
     Bytef *dest, *src;
 
     /*Get the fingerprint*/
-    printf("Opened device. It's now time to enroll your finger.\n");
-    data = enroll(dev);
-    assert(data != NULL);
+    if (ps->enroll(ps, &buf, &bytes) != 0)
+        return -1;
 
     /*Compress the fingerprint data*/
-    bytes = fp_print_data_get_data(data, &buf);
     s_len = bytes;
     src = (Bytef *)buf;
     d_len = compressBound(s_len);
@@ -94,166 +167,221 @@ void watermark(struct fp_dev *dev, char *path) {
     status = compress(dest, &d_len, src, s_len);
     assert(status == Z_OK);
 
-    /*Read image to be watermarked*/
-    printf("Got it, wait...\n");
-    fr = pm_openr(path);
-    assert(fr != NULL);
-    img.bitmap = pbm_readpbm(fr, &img.cols, &img.rows);
-    assert(img.bitmap != NULL);
+    if (opt->shuffle == SHUFFLE_BANDED) {
+        /*Embed band by band, the image is never held whole*/
+        status = embed_stream(path, "out.pbm", dest, d_len, opt->seed,
+                opt->neighborhood);
+    } else {
+        /*Read image to be watermarked*/
+        status = pbm_load(path, &img, NULL);
+        assert(status == 0);
 
-    /*Embed the fingerprint to the image*/
-    embed(img, dest, d_len);
-    fw = pm_openw("out.pbm");
-    pbm_writepbm(fw, img.bitmap, img.cols, img.rows, FALSE);
-    fprintf(fw, "\n#%ld", d_len);
+        /*Embed the fingerprint to the image, framed by its header*/
+        status = embed_with_header(img, dest, d_len, s_len, opt);
+        //the header tells the extraction everything, no trailer
+        if (status == WM_OK && pbm_save("out.pbm", img, NULL) != 0)
+            status = WM_EIO;
+        image_free(&img);
+    }
+    if (status != WM_OK)
+        fprintf(stderr, "%s: %s\n", path, wm_strerror(status));
+    PROF_REPORT(path);
 
     /*Release the resources*/
-    pbm_freearray(img.bitmap, img.rows);
     free(buf);
     free(dest);
-    fp_print_data_free(data);
-    fclose(fr);
-    fclose(fw);
+    return status == WM_OK ? 0 : -1;
 }
 
 /**
- *  Check the source
- */
-void authenticate(struct fp_dev *dev, char *path) {
-    FILE *fr;
-    int status;
-    struct image img;
-    struct fp_print_data *data;
-    uLongf d_len, s_len = 0;
-    Bytef *dest, *src;
-
-    /*Read the watermarked image*/
-    fr = pm_openr(path);
-    assert(fr != NULL);
-    img.bitmap = pbm_readpbm(fr, &img.cols, &img.rows);
-    assert(img.bitmap != NULL);
-    fscanf(fr, "\n#%ld", &s_len);
-
-    /*Extract the fingerpint data*/
-    src = (Bytef *)calloc(s_len, sizeof(Bytef));
-    assert(src != NULL);
-    extract(img, src, s_len);
+*Extracts the template embedded in the image and matches a finger
+*against it.
+*\returns 1 on a match, 0 on a mismatch, < 0 if there is no template.
+*/
+int authenticate(struct print_source *ps, char *path,
+        const struct wm_options *opt) {
+    int status, framed;
+    struct image img, top, view;
+    struct wm_options options = *opt;
+    struct wm_trailer tr;
+    struct wm_header h;
+    struct inflate_sink sink;
+    size_t d_len, s_len, hint = 2414; //fingerprint data standard size
+    uint32_t crc;
+    unsigned char *dest;
+    Bytef *src;
 
-    /*Uncompress the extracted data*/
-    d_len = 2414; //fingerprint data standard size
-    dest = (Bytef *)calloc(d_len, sizeof(Bytef));
-    assert(dest != NULL);
-    status = uncompress(dest, &d_len, src, s_len);
-    assert(status == Z_OK);
+    /*Extract and uncompress the fingerpint data*/
+    if (pbm_read_trailer(path, &tr) == 0 && tr.mode == SHUFFLE_BANDED) {
+        s_len = tr.length;
+        src = (Bytef *)calloc(s_len, sizeof(Bytef));
+        assert(src != NULL);
+        status = extract_stream(path, src, s_len, options.seed);
+        assert(status == WM_OK);
+        status = inflate_sink_init(&sink, hint);
+        assert(status == WM_OK);
+        status = inflate_sink_write(&sink, src, s_len);
+        if (status == WM_OK)
+            status = inflate_sink_finish(&sink, &dest, &d_len);
+        else
+            inflate_sink_free(&sink);
+        free(src);
+    } else {
+        status = pbm_load(path, &img, &tr);
+        assert(status == 0);
+        //the header, if any, rejects an unmarked image at a small cost
+        status = read_header(img, &options, &h);
+        framed = status == WM_OK;
+        if (framed) {
+            header_split(img, &h, &top, &view);
+            s_len = h.length;
+            options.shuffle = h.mode;
+            if (h.raw_length != 0)
+                hint = h.raw_length;
+        } else if (tr.length > 0 &&
+                (tr.mode < SHUFFLE_FLOYD || tr.mode > SHUFFLE_BANDED)) {
+            printf("%s: the trailer has an unknown shuffle mode\n", path);
+            image_free(&img);
+            return WM_EINVAL;
+        } else if (tr.length > 0) {
+            //images watermarked before the header carry a trailer
+            view = img;
+            s_len = tr.length;
+            //images watermarked before the mode was recorded use Floyd
+            options.shuffle = (enum shuffle_mode)tr.mode;
+        } else {
+            printf("%s: %s\n", path, wm_strerror(status));
+            image_free(&img);
+            return status;
+        }
+        //inflate takes every chunk as soon as it is extracted
+        status = extract_inflate(view, s_len, &options, hint, &dest, &d_len,
+                &crc);
+        if (status == WM_OK && framed && crc != h.crc) {
+            free(dest);
+            status = WM_ECHECKSUM;
+        }
+        image_free(&img);
+    }
+    PROF_REPORT(path);
+    if (status != WM_OK) {
+        printf("%s: %s\n", path, wm_strerror(status));
+        return status;
+    }
 
     /*Authenticate the fingerprint*/
-    data = fp_print_data_from_data(dest, d_len);
-    verify(dev, data);
+    status = ps->verify(ps, dest, d_len);
 
     /*Release the resources*/
-    pbm_freearray(img.bitmap, img.rows);
     free(dest);
-    free(src);
-    fp_print_data_free(data);
-    fclose(fr);
+    return status;
 }
 
-struct fp_dscv_dev *discover_device(struct fp_dscv_dev **discovered_devs)
-{
-    struct fp_dscv_dev *ddev = discovered_devs[0];
-    struct fp_driver *drv;
-    if (!ddev)
-        return NULL;
-
-    drv = fp_dscv_dev_get_driver(ddev);
-    printf("Found device claimed by %s driver\n", fp_driver_get_full_name(drv));
-    return ddev;
+/**
+*Reports whether a payload of the given size (-l) fits the image,
+*without enrolling nor embedding.
+*\returns 0 if the embed is certain to succeed.
+*/
+int estimate(char *path, size_t bytes, const struct wm_options *opt) {
+    struct image img, top, rest;
+    struct capacity_report rep;
+    struct wm_header h;
+    int status, i;
+    status = pbm_load(path, &img, NULL);
+    assert(status == 0);
+    rest = img;
+    if (opt->shuffle != SHUFFLE_BANDED) {
+        //the payload goes below the header, whose strip depends on the page
+        header_init(&h, NULL, bytes, 0, opt);
+        status = embed_header(img, &h, opt);
+        if (status == WM_OK)
+            header_split(img, &h, &top, &rest);
+    } else {
+        //the banded watermark streams the whole image, without a header
+        status = WM_OK;
+    }
+    if (status == WM_OK)
+        status = analyze_capacity(rest, bytes, NULL, opt, &rep);
+    image_free(&img);
+    if (status != WM_OK) {
+        fprintf(stderr, "%s: %s\n", path, wm_strerror(status));
+        return 1;
+    }
+    printf("%s: %lu bytes, %s\n", path, (unsigned long)bytes,
+            rep.go ? "go" : "no go");
+    printf("window %d pixels, %ld unsafe windows, max safe %lu bytes\n",
+            rep.window, rep.unsafe, (unsigned long)rep.max_safe_bytes);
+    for (i = 0; i < rep.n_weak; i++)
+        printf("  bit %ld: %d blacks, %d whites, margin %d\n",
+                rep.weakest[i].index, rep.weakest[i].blacks,
+                rep.weakest[i].whites, rep.weakest[i].margin);
+    return !rep.go;
 }
 
-struct fp_print_data *enroll(struct fp_dev *dev) {
-    struct fp_print_data *enrolled_print = NULL;
-    int r;
-
-    printf("You will need to successfully scan your finger %d times to "
-            "complete the process.\n", fp_dev_get_nr_enroll_stages(dev));
-
-    do {
-        struct fp_img *img = NULL;
-
-        sleep(1);
-        printf("\nScan your finger now.\n");
-
-        r = fp_enroll_finger(dev, &enrolled_print);
-        if (r < 0) {
-            printf("Enroll failed with error %d\n", r);
-            return NULL;
-        }
-        switch (r) {
-            case FP_ENROLL_COMPLETE:
-                printf("Enroll complete!\n");
-                break;
-            case FP_ENROLL_FAIL:
-                printf("Enroll failed, something wen't wrong :(\n");
-                return NULL;
-            case FP_ENROLL_PASS:
-                printf("Enroll stage passed. Yay!\n");
-                break;
-            case FP_ENROLL_RETRY:
-                printf("Didn't quite catch that. Please try again.\n");
-                break;
-            case FP_ENROLL_RETRY_TOO_SHORT:
-                printf("Your swipe was too short, please try again.\n");
-                break;
-            case FP_ENROLL_RETRY_CENTER_FINGER:
-                printf("Didn't catch that, please center your finger on the "
-                        "sensor and try again.\n");
-                break;
-            case FP_ENROLL_RETRY_REMOVE_FINGER:
-                printf("Scan failed, please remove your finger and then try "
-                        "again.\n");
-                break;
-        }
-    } while (r != FP_ENROLL_COMPLETE);
-
-    if (!enrolled_print) {
-        fprintf(stderr, "Enroll complete but no print?\n");
-        return NULL;
+/**
+*Compares the images of "original,watermarked", scoring the flips with
+*the n x n patterns of -n, and prints the report as JSON, saving the differing pixels to bitmap if not NULL.
+*\returns 0, or -1 if they could not be compared.
+*/
+int compare(char *pair, int tile, int neighborhood, const char *bitmap) {
+    struct image a, b, diff;
+    struct diff_report rep;
+    char *second;
+    int status;
+    second = strchr(pair, ',');
+    if (second == NULL) {
+        fprintf(stderr, "-d needs original.pbm,watermarked.pbm\n");
+        return -1;
     }
-
-    printf("Enrollment completed!\n\n");
-    return enrolled_print;
+    *second++ = '\0';
+    if (pbm_load(pair, &a, NULL) != 0) {
+        fprintf(stderr, "Cannot read %s\n", pair);
+        return -1;
+    }
+    if (pbm_load(second, &b, NULL) != 0) {
+        fprintf(stderr, "Cannot read %s\n", second);
+        image_free(&a);
+        return -1;
+    }
+    status = image_diff(a, b, tile, neighborhood,
+            bitmap != NULL ? &diff : NULL, &rep);
+    if (status == WM_OK) {
+        diff_report_json(stdout, pair, second, &rep);
+        if (bitmap != NULL && pbm_save(bitmap, diff, NULL) != 0)
+            status = WM_EIO;
+        if (bitmap != NULL)
+            image_free(&diff);
+        diff_report_free(&rep);
+    }
+    if (status != WM_OK)
+        fprintf(stderr, "%s: %s\n", second, wm_strerror(status));
+    image_free(&a);
+    image_free(&b);
+    return status == WM_OK ? 0 : -1;
 }
 
-int verify(struct fp_dev *dev, struct fp_print_data *data)
-{
-    int r;
-    do {
-        sleep(1);
-        printf("\nScan your finger now.\n");
-        r = fp_verify_finger(dev, data);
-        if (r < 0) {
-            printf("verification failed with error %d :(\n", r);
-            return r;
-        }
-        switch (r) {
-            case FP_VERIFY_NO_MATCH:
-                printf("NO MATCH!\n");
-                return 0;
-            case FP_VERIFY_MATCH:
-                printf("MATCH!\n");
-                return 0;
-            case FP_VERIFY_RETRY:
-                printf("Scan didn't quite work. Please try again.\n");
-                break;
-            case FP_VERIFY_RETRY_TOO_SHORT:
-                printf("Swipe was too short, please try again.\n");
-                break;
-            case FP_VERIFY_RETRY_CENTER_FINGER:
-                printf("Please center your finger on the sensor and try again.\n");
-                break;
-            case FP_VERIFY_RETRY_REMOVE_FINGER:
-                printf("Please remove finger from the sensor and try again.\n");
-                break;
+/**
+*Runs the whole pipeline, from the enrollment to the match, the given
+*number of times on the image and reports the end to end throughput.
+*Meant for the replay source (-r), which takes no time to scan.
+*\returns 0 if every round matched.
+*/
+int throughput(struct print_source *ps, char *path, int rounds,
+        const struct wm_options *opt) {
+    double start, wall;
+    int i, matched = 0, failed = 0;
+    start = clock_seconds();
+    for (i = 0; i < rounds; i++) {
+        if (watermark(ps, path, opt) != 0) {
+            failed++;
+            continue;
         }
-    } while (1);
+        matched += authenticate(ps, "out.pbm", opt) == 1;
+    }
+    wall = clock_seconds() - start;
+    printf("%s: %d rounds, %d matched, %d failed, %.3f s, %.2f rounds/s, "
+            "%.2f ms per round\n", path, rounds, matched, failed, wall,
+            wall > 0.0 ? rounds / wall : 0.0,
+            rounds > 0 ? 1000.0 * wall / rounds : 0.0);
+    return matched == rounds ? 0 : 1;
 }
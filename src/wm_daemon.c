@@ -0,0 +1,529 @@
+/**
+*\file wm_daemon.c
+*This module keeps the watermarking warm between requests. The
+*daemon listens on a unix socket with a pool of threads, each one
+*owning a libfpwm context per shuffle mode, so the flippability
+*table, the shuffle of the last image size and the scratch outlive
+*the requests. The images are not sent over the socket: the client
+*passes the file descriptor of a shared packed image (see
+*shared_image_create), which the daemon maps and watermarks in place.
+*The payload is framed with the header of wm_header.c, an extraction
+*needs nothing but the image.
+*/
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <pbm.h>
+#include "fpwm.h"
+#include "wm_header.h"
+#include "wm_daemon.h"
+#include "profile.h"
+
+#define SHARED_MAGIC 0x49575046U //"FPWI"
+#define SHARED_HEADER 64 //the bytes before the words, keeps them aligned
+#define DAEMON_BACKLOG 16
+#define SHARED_SEALS (F_SEAL_SHRINK | F_SEAL_GROW) //the size is fixed
+
+/**
+*The first bytes of a shared image.
+*/
+struct shared_header {
+    uint32_t magic;
+    int32_t cols;
+    int32_t rows;
+    int32_t stride;
+};
+
+/**
+*The state the threads of the daemon share.
+*/
+struct daemon {
+    int listener;
+    const struct wm_options *opt;
+    volatile int quit; //set by a DAEMON_QUIT request
+};
+
+struct daemon_worker {
+    pthread_t thread;
+    struct daemon *d;
+    struct fpwm *ctx[SHUFFLE_BANDED + 1]; //opened on the first use of a mode
+    int started;
+};
+
+void *daemon_worker(void *arg);
+int serve_connection(struct daemon_worker *w, int sock);
+/**
+*\returns Whether the client runs as the user of the daemon, the one
+*allowed to stop it.
+*/
+int peer_is_owner(int sock) {
+    struct ucred cred;
+    socklen_t len = sizeof(cred);
+    if (getsockopt(sock, SOL_SOCKET, SO_PEERCRED, &cred, &len) != 0)
+        return 0;
+    return cred.uid == geteuid();
+}
+
+int handle_embed(struct daemon_worker *w, const struct daemon_request *rq,
+        int image_fd, int payload_fd, struct daemon_reply *rp);
+int handle_extract(struct daemon_worker *w, int image_fd, int out_fd,
+        struct daemon_reply *rp);
+struct fpwm *worker_context(struct daemon_worker *w, enum shuffle_mode mode);
+int receive_request(int sock, struct daemon_request *rq, int *fds);
+int peer_is_owner(int sock);
+int daemon_write(int fd, const void *buf, size_t len);
+int daemon_read(int fd, void *buf, size_t len);
+
+/**
+*Serves embed/extract requests on a unix socket until a DAEMON_QUIT
+*request comes. The socket file is replaced if it exists, only its
+*owner may connect, and it is removed on exit.
+*\param[in] opt The shuffle mode of the embeds, the seed, cache and
+*neighborhood of every request, and the number of threads serving
+*them, <= 0 meaning one per online cpu.
+*\returns WM_OK, WM_EIO if the socket could not be set up, or one of
+*the other WM_E* error codes.
+*/
+int daemon_serve(const char *path, const struct wm_options *opt) {
+    struct daemon d;
+    struct daemon_worker *workers;
+    struct sockaddr_un addr;
+    int t, mode, threads, bound, status = WM_OK;
+    mode_t mask;
+    if (strlen(path) >= sizeof(addr.sun_path))
+        return WM_EINVAL;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, path);
+    d.listener = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (d.listener < 0)
+        return WM_EIO;
+    unlink(path);
+    //the socket file is created 0600; no worker runs yet to share the umask
+    mask = umask(0177);
+    bound = bind(d.listener, (struct sockaddr *)&addr, sizeof(addr)) == 0;
+    umask(mask);
+    if (!bound || listen(d.listener, DAEMON_BACKLOG) != 0) {
+        close(d.listener);
+        return WM_EIO;
+    }
+    d.opt = opt;
+    d.quit = 0;
+    threads = opt->threads;
+    if (threads <= 0)
+        threads = (int)sysconf(_SC_NPROCESSORS_ONLN);
+    if (threads < 1)
+        threads = 1;
+    workers = (struct daemon_worker *)calloc(threads,
+            sizeof(struct daemon_worker));
+    if (workers == NULL) {
+        close(d.listener);
+        unlink(path);
+        return WM_ENOMEM;
+    }
+    //warm up every thread before the first request
+    for (t = 0; t < threads && status == WM_OK; t++) {
+        workers[t].d = &d;
+        if (worker_context(workers + t, opt->shuffle) == NULL)
+            status = WM_ENOLUT;
+    }
+    for (t = 1; t < threads && status == WM_OK; t++) {
+        workers[t].started = pthread_create(&workers[t].thread, NULL,
+                daemon_worker, workers + t) == 0;
+    }
+    if (status == WM_OK)
+        daemon_worker(workers);
+    for (t = 0; t < threads; t++) {
+        if (workers[t].started)
+            pthread_join(workers[t].thread, NULL);
+    }
+    //FREE
+    for (t = 0; t < threads; t++) {
+        for (mode = 0; mode <= SHUFFLE_BANDED; mode++)
+            fpwm_close(workers[t].ctx[mode]);
+    }
+    free(workers);
+    close(d.listener);
+    unlink(path);
+    return status;
+}
+
+/**
+*Accepts connections and serves them until the daemon quits. The
+*threads block in accept together, the kernel hands every connection
+*to one of them.
+*/
+void *daemon_worker(void *arg) {
+    struct daemon_worker *w = (struct daemon_worker *)arg;
+    int sock;
+    while (!w->d->quit) {
+        sock = accept(w->d->listener, NULL, NULL);
+        if (sock < 0) {
+            if (errno == EINTR || errno == ECONNABORTED)
+                continue;
+            break;
+        }
+        if (serve_connection(w, sock) == DAEMON_QUIT) {
+            //wakes the threads blocked in accept
+            w->d->quit = 1;
+            shutdown(w->d->listener, SHUT_RDWR);
+        }
+        close(sock);
+    }
+    return NULL;
+}
+
+/**
+*Answers the requests of a connection until the client closes it.
+*\returns DAEMON_QUIT if the client asked the daemon to stop, 0
+*otherwise.
+*/
+int serve_connection(struct daemon_worker *w, int sock) {
+    struct daemon_request rq;
+    struct daemon_reply rp;
+    int fds[2], n;
+    double start;
+    while ((n = receive_request(sock, &rq, fds)) >= 0) {
+        start = clock_seconds();
+        memset(&rp, 0, sizeof(rp));
+        if (rq.op == DAEMON_EMBED && n == 2)
+            rp.status = handle_embed(w, &rq, fds[0], fds[1], &rp);
+        else if (rq.op == DAEMON_EXTRACT && n == 2)
+            rp.status = handle_extract(w, fds[0], fds[1], &rp);
+        else if (rq.op == DAEMON_QUIT)
+            rp.status = peer_is_owner(sock) ? WM_OK : WM_EINVAL;
+        else
+            rp.status = WM_EINVAL;
+        while (n > 0)
+            close(fds[--n]);
+        rp.total_ms = 1e3 * (clock_seconds() - start);
+        if (daemon_write(sock, &rp, sizeof(rp)) != 0)
+            return 0;
+        if (rq.op == DAEMON_QUIT && rp.status == WM_OK)
+            return DAEMON_QUIT;
+    }
+    return 0;
+}
+
+int handle_embed(struct daemon_worker *w, const struct daemon_request *rq,
+        int image_fd, int payload_fd, struct daemon_reply *rp) {
+    struct image img, top, rest;
+    struct wm_header h;
+    struct stat st;
+    struct fpwm *ctx;
+    void *payload = NULL;
+    double t0, t1;
+    int status;
+    t0 = clock_seconds();
+    if (shared_image_map(image_fd, 1, &img) != 0)
+        return WM_EIO;
+    //read, not mapped: the client may truncate an unsealed file any time
+    if (fstat(payload_fd, &st) == 0 && st.st_size > 0)
+        payload = malloc(st.st_size);
+    if (payload != NULL && daemon_read(payload_fd, payload, st.st_size) != 0) {
+        free(payload);
+        payload = NULL;
+    }
+    t1 = clock_seconds();
+    rp->map_ms = 1e3 * (t1 - t0);
+    if (payload == NULL) {
+        status = WM_EIO;
+    } else {
+        //the strip of the header decides where the payload rows start
+        header_init(&h, payload, st.st_size, rq->raw_length, w->d->opt);
+        status = embed_header(img, &h, w->d->opt);
+    }
+    if (status == WM_OK) {
+        header_split(img, &h, &top, &rest);
+        ctx = worker_context(w, w->d->opt->shuffle);
+        status = ctx == NULL ? WM_ENOLUT :
+            fpwm_embed(ctx, rest, payload, st.st_size);
+    }
+    if (status == WM_OK)
+        rp->length = (uint32_t)st.st_size;
+    rp->work_ms = 1e3 * (clock_seconds() - t1);
+    free(payload);
+    shared_image_unmap(&img);
+    return status;
+}
+
+int handle_extract(struct daemon_worker *w, int image_fd, int out_fd,
+        struct daemon_reply *rp) {
+    struct image img, top, rest;
+    struct wm_header h;
+    struct fpwm *ctx;
+    unsigned char *payload = NULL;
+    double t0, t1;
+    int status;
+    t0 = clock_seconds();
+    if (shared_image_map(image_fd, 0, &img) != 0)
+        return WM_EIO;
+    t1 = clock_seconds();
+    rp->map_ms = 1e3 * (t1 - t0);
+    status = read_header(img, w->d->opt, &h);
+    if (status == WM_OK) {
+        header_split(img, &h, &top, &rest);
+        payload = (unsigned char *)malloc(h.length);
+        ctx = worker_context(w, h.mode);
+        if (payload == NULL)
+            status = WM_ENOMEM;
+        else if (ctx == NULL)
+            status = WM_ENOLUT;
+        else
+            status = fpwm_extract(ctx, rest, payload, h.length);
+    }
+    if (status == WM_OK)
+        status = header_check(&h, payload);
+    rp->work_ms = 1e3 * (clock_seconds() - t1);
+    if (status == WM_OK) {
+        rp->length = h.length;
+        if (daemon_write(out_fd, payload, h.length) != 0)
+            status = WM_EIO;
+    }
+    free(payload);
+    shared_image_unmap(&img);
+    return status;
+}
+
+/**
+*Returns the context of the thread for a mode, opening it on first use.
+*/
+struct fpwm *worker_context(struct daemon_worker *w, enum shuffle_mode mode) {
+    struct wm_options opt;
+    if ((int)mode < 0 || mode > SHUFFLE_BANDED)
+        return NULL;
+    if (w->ctx[mode] == NULL) {
+        opt = *w->d->opt;
+        opt.shuffle = mode;
+        fpwm_open(&w->ctx[mode], &opt);
+    }
+    return w->ctx[mode];
+}
+
+/**
+*Connects to the daemon listening on path.
+*\returns The socket, or -1.
+*/
+int daemon_connect(const char *path) {
+    struct sockaddr_un addr;
+    int sock;
+    if (strlen(path) >= sizeof(addr.sun_path))
+        return -1;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, path);
+    sock = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (sock < 0)
+        return -1;
+    if (connect(sock, (struct sockaddr *)&addr, sizeof(addr)) != 0) {
+        close(sock);
+        return -1;
+    }
+    return sock;
+}
+
+/**
+*Sends a request with its file descriptors and waits for the reply.
+*\param[in] image_fd The shared image, -1 for DAEMON_QUIT.
+*\param[in] payload_fd The payload to embed, or the file the payload
+*is extracted to, -1 for DAEMON_QUIT.
+*\returns WM_OK, or WM_EIO if the daemon could not be reached; the
+*outcome of the request is in rp->status.
+*/
+int daemon_call(int sock, const struct daemon_request *rq, int image_fd,
+        int payload_fd, struct daemon_reply *rp) {
+    struct msghdr msg;
+    struct iovec iov;
+    struct cmsghdr *cmsg;
+    union {
+        char buf[CMSG_SPACE(2 * sizeof(int))];
+        struct cmsghdr align;
+    } control;
+    int fds[2] = {image_fd, payload_fd};
+    size_t got = 0;
+    ssize_t n;
+    memset(&msg, 0, sizeof(msg));
+    iov.iov_base = (void *)rq;
+    iov.iov_len = sizeof(*rq);
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    if (image_fd >= 0 && payload_fd >= 0) {
+        memset(&control, 0, sizeof(control));
+        msg.msg_control = control.buf;
+        msg.msg_controllen = sizeof(control.buf);
+        cmsg = CMSG_FIRSTHDR(&msg);
+        cmsg->cmsg_level = SOL_SOCKET;
+        cmsg->cmsg_type = SCM_RIGHTS;
+        cmsg->cmsg_len = CMSG_LEN(sizeof(fds));
+        memcpy(CMSG_DATA(cmsg), fds, sizeof(fds));
+    }
+    if (sendmsg(sock, &msg, MSG_NOSIGNAL) != (ssize_t)sizeof(*rq))
+        return WM_EIO;
+    while (got < sizeof(*rp)) {
+        n = read(sock, (char *)rp + got, sizeof(*rp) - got);
+        if (n <= 0) {
+            if (n < 0 && errno == EINTR)
+                continue;
+            return WM_EIO;
+        }
+        got += n;
+    }
+    return WM_OK;
+}
+
+/**
+*Reads a request and the file descriptors that came with it.
+*\returns The number of file descriptors, or -1 once the client is
+*gone.
+*/
+int receive_request(int sock, struct daemon_request *rq, int *fds) {
+    struct msghdr msg;
+    struct iovec iov;
+    struct cmsghdr *cmsg;
+    union {
+        char buf[CMSG_SPACE(2 * sizeof(int))];
+        struct cmsghdr align;
+    } control;
+    ssize_t n;
+    int count = 0;
+    memset(&msg, 0, sizeof(msg));
+    iov.iov_base = rq;
+    iov.iov_len = sizeof(*rq);
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control.buf;
+    msg.msg_controllen = sizeof(control.buf);
+    do {
+        n = recvmsg(sock, &msg, MSG_CMSG_CLOEXEC);
+    } while (n < 0 && errno == EINTR);
+    for (cmsg = CMSG_FIRSTHDR(&msg); n >= 0 && cmsg != NULL;
+            cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+        if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS) {
+            count = (int)((cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int));
+            if (count > 2)
+                count = 2;
+            memcpy(fds, CMSG_DATA(cmsg), count * sizeof(int));
+        }
+    }
+    //the requests are tiny, a short one is a broken client
+    if (n != (ssize_t)sizeof(*rq)) {
+        while (count > 0)
+            close(fds[--count]);
+        return -1;
+    }
+    return count;
+}
+
+/**
+*Creates an image in anonymous shared memory, white, to be passed to
+*the daemon by its file descriptor. Its size is sealed, the daemon
+*maps it without fearing a truncation under its feet.
+*\param[out] fd The file descriptor, closed by the caller.
+*\param[out] img The image, mapped, released with shared_image_unmap.
+*\returns 0, or -1 on failure.
+*/
+int shared_image_create(int cols, int rows, int *fd, struct image *img) {
+    struct shared_header hdr;
+    size_t len;
+    if (cols <= 0 || rows <= 0)
+        return -1;
+    hdr.magic = SHARED_MAGIC;
+    hdr.cols = cols;
+    hdr.rows = rows;
+    hdr.stride = (cols + 63) >> 6;
+    len = SHARED_HEADER + (size_t)hdr.stride * rows * sizeof(uint64_t);
+    *fd = memfd_create("fpwm-image", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+    if (*fd < 0)
+        return -1;
+    if (ftruncate(*fd, len) != 0 || daemon_write(*fd, &hdr, sizeof(hdr)) != 0 ||
+        fcntl(*fd, F_ADD_SEALS, SHARED_SEALS) != 0 ||
+        shared_image_map(*fd, 1, img) != 0) {
+        close(*fd);
+        return -1;
+    }
+    return 0;
+}
+
+/**
+*Maps a shared image, checking its size against its header.
+*\param[in] writable Whether the pixels are to be written.
+*\returns 0, or -1 if fd is not a shared image or its size is not
+*sealed: a file shrunk while mapped would fault the daemon.
+*/
+int shared_image_map(int fd, int writable, struct image *img) {
+    struct shared_header hdr;
+    struct stat st;
+    void *base;
+    int seals;
+    seals = fcntl(fd, F_GET_SEALS);
+    if (seals < 0 || (seals & SHARED_SEALS) != SHARED_SEALS ||
+        fstat(fd, &st) != 0 || st.st_size < SHARED_HEADER ||
+        pread(fd, &hdr, sizeof(hdr), 0) != (ssize_t)sizeof(hdr))
+        return -1;
+    if (hdr.magic != SHARED_MAGIC || hdr.cols <= 0 || hdr.rows <= 0 ||
+        hdr.stride != (hdr.cols + 63) >> 6 ||
+        (size_t)st.st_size != SHARED_HEADER +
+            (size_t)hdr.stride * hdr.rows * sizeof(uint64_t))
+        return -1;
+    base = mmap(NULL, st.st_size, writable ? PROT_READ | PROT_WRITE : PROT_READ,
+            MAP_SHARED, fd, 0);
+    if (base == MAP_FAILED)
+        return -1;
+    img->cols = hdr.cols;
+    img->rows = hdr.rows;
+    img->stride = hdr.stride;
+    img->words = (uint64_t *)((char *)base + SHARED_HEADER);
+    return 0;
+}
+
+void shared_image_unmap(struct image *img) {
+    munmap((char *)img->words - SHARED_HEADER, SHARED_HEADER +
+            (size_t)img->stride * img->rows * sizeof(uint64_t));
+    img->words = NULL;
+}
+
+/**
+*Reads len bytes of fd from its start.
+*\returns 0, or -1 if the file holds fewer.
+*/
+int daemon_read(int fd, void *buf, size_t len) {
+    char *p = (char *)buf;
+    off_t offset = 0;
+    ssize_t n;
+    while (len > 0) {
+        n = pread(fd, p, len, offset);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return -1;
+        p += n;
+        offset += n;
+        len -= n;
+    }
+    return 0;
+}
+
+int daemon_write(int fd, const void *buf, size_t len) {
+    const char *p = (const char *)buf;
+    ssize_t n;
+    while (len > 0) {
+        n = write(fd, p, len);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return -1;
+        p += n;
+        len -= n;
+    }
+    return 0;
+}
@@ -0,0 +1,39 @@
+#ifndef WM_DAEMON_H
+#define WM_DAEMON_H 1
+
+#include <stddef.h>
+#include <stdint.h>
+#include "bin_watermarking.h"
+
+#define DAEMON_EMBED 1 //fds: the shared image, the payload
+#define DAEMON_EXTRACT 2 //fds: the shared image, the file the payload goes to
+#define DAEMON_QUIT 3 //no fd, the daemon stops once the request is answered
+
+/**
+*A request to the daemon, sent with its file descriptors.
+*/
+struct daemon_request {
+    int op;
+    uint32_t raw_length; //recorded in the header of an embed
+};
+
+/**
+*The answer to a request. The times are measured by the daemon.
+*/
+struct daemon_reply {
+    int status; //WM_OK or one of the WM_E* error codes
+    uint32_t length; //the payload bytes embedded or extracted
+    double map_ms; //mapping the image and reading the payload
+    double work_ms; //embedding or extracting
+    double total_ms; //from the request to the reply
+};
+
+int daemon_serve(const char *path, const struct wm_options *opt);
+int daemon_connect(const char *path);
+int daemon_call(int sock, const struct daemon_request *rq, int image_fd,
+        int payload_fd, struct daemon_reply *rp);
+int shared_image_create(int cols, int rows, int *fd, struct image *img);
+int shared_image_map(int fd, int writable, struct image *img);
+void shared_image_unmap(struct image *img);
+
+#endif
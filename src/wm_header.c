@@ -0,0 +1,516 @@
+/**
+*\file wm_header.c
+*This module frames the payload with a header. The top rows of the
+*image are reserved for it and shuffled with their own keyed
+*Feistel bijection, so the header is found without knowing anything
+*about the payload and decoding it reads only a few thousand pixels.
+*The payload is embedded below, in the rest of the image, with the
+*options of the caller.
+*
+*The top of a page is often blank margin, where a flip is a speck on
+*white. The strip therefore starts at the first row with black pixels
+*(header_start), which the reader finds the same way since the flips
+*stay below it, and comes in WM_HEADER_LEVELS sizes, each twice the
+*one before: the header takes the smallest whose flips all land on
+*flippable pixels, the largest if none does, and the reader tries
+*them in the same order until one decodes.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <zlib.h>
+#include "flippability.h"
+#include "score_map.h"
+#include "wm_header.h"
+
+#define HEADER_BITS (8 * WM_HEADER_BYTES)
+#define HEADER_SEED 0x48454144U //mixed into the seed, "HEAD"
+#define STRIP_HALO 2 //the context around a strip, the radius of 5x5
+
+void header_pack(const struct wm_header *h, unsigned char *buf);
+int embed_strip(struct image img, int start, int hrows,
+        const unsigned char *buf, const struct wm_options *opt,
+        const float *lut, int specks);
+int strip_speck(struct image img, int r, int c);
+int first_black_row(struct image img);
+int read_strip(struct image img, int start, int hrows,
+        const struct wm_options *opt, struct wm_header *h);
+int header_unpack(const unsigned char *buf, struct wm_header *h);
+void put32(unsigned char *p, uint32_t v);
+uint32_t get32(const unsigned char *p);
+
+/**
+*Fills the header describing a payload embedded with opt.
+*\param[in] payload NULL for a dry run, which only needs the lengths.
+*\param[in] raw_length The size of the payload before compression,
+*recorded for the caller that uncompresses it, 0 if it does not apply.
+*/
+void header_init(struct wm_header *h, const void *payload, size_t bytes,
+        size_t raw_length, const struct wm_options *opt) {
+    h->version = WM_HEADER_VERSION;
+    h->mode = opt->shuffle;
+    h->neighborhood = opt->neighborhood;
+    h->length = (uint32_t)bytes;
+    h->raw_length = (uint32_t)raw_length;
+    h->crc = (uint32_t)crc32(crc32(0L, Z_NULL, 0), (const Bytef *)payload,
+            bytes);
+    h->start = 0;
+    h->rows = 0;
+}
+
+/**
+*\returns WM_OK if the payload matches the checksum of the header,
+*WM_ECHECKSUM otherwise.
+*/
+int header_check(const struct wm_header *h, const void *payload) {
+    uint32_t crc = (uint32_t)crc32(crc32(0L, Z_NULL, 0),
+            (const Bytef *)payload, h->length);
+    return crc == h->crc ? WM_OK : WM_ECHECKSUM;
+}
+
+/**
+*Returns the rows of the header strip of the given level in an image
+*of the given size, enough for WM_HEADER_WINDOW << level pixels per
+*header bit, or 0 if there is no such level. The strips past the
+*first one stop at half of the image.
+*/
+int header_rows(int cols, int rows, int level) {
+    long hrows;
+    if (cols <= 0 || rows <= 0 || level < 0 || level >= WM_HEADER_LEVELS)
+        return 0;
+    hrows = ((long)HEADER_BITS * (WM_HEADER_WINDOW << level) + cols - 1) / cols;
+    if (hrows >= rows || (level > 0 && 2 * hrows > rows))
+        return 0;
+    return (int)hrows;
+}
+
+/**
+*Returns the first row of the header strip of an image: the first
+*row with a black pixel, rounded down to WM_HEADER_ALIGN rows so the
+*header flips below it leave it in place, or 0 if the first strip
+*does not fit below it.
+*/
+int header_start(struct image img) {
+    int start = first_black_row(img) / WM_HEADER_ALIGN * WM_HEADER_ALIGN;
+    if (start > WM_HEADER_MAX_START)
+        start = WM_HEADER_MAX_START;
+    if (header_rows(img.cols, img.rows - start, 0) == 0)
+        return 0;
+    return start;
+}
+
+/**
+*\returns the first row of img with a black pixel, img.rows if none.
+*/
+int first_black_row(struct image img) {
+    const uint64_t *row;
+    int r, k;
+    for (r = 0; r < img.rows; r++) {
+        row = image_row(img, r);
+        for (k = 0; k < img.stride && row[k] == 0; k++)
+            ;
+        if (k < img.stride)
+            break;
+    }
+    return r;
+}
+
+/**
+*Splits the image in the header rows of h, placed by embed_header or
+*found by read_header, and the payload rows. The views share the
+*pixels of img.
+*\returns 0, or -1 if the image has no such rows.
+*/
+int header_split(struct image img, const struct wm_header *h,
+        struct image *top, struct image *rest) {
+    if (h->rows <= 0 || h->rows >= img.rows)
+        return -1;
+    *top = img;
+    top->rows = h->rows;
+    *rest = img;
+    rest->words = image_row(img, h->rows);
+    rest->rows = img.rows - h->rows;
+    return 0;
+}
+
+/**
+*Embeds the header from the first row with black pixels, in the
+*smallest strip where it makes no speck, a flipped pixel whose
+*neighbors all had its color, or else in the largest strip, and
+*records the rows of the margin and the strip in h->rows. The payload
+*rows, below them, are left to the caller, see embed_with_header.
+*\returns WM_OK, WM_EINVAL if the image is too small for a header,
+*WM_ECAPACITY if no strip has the pixels, or one of the other WM_E*
+*error codes.
+*/
+int embed_header(struct image img, struct wm_header *h,
+        const struct wm_options *opt) {
+    unsigned char buf[WM_HEADER_BYTES];
+    const float *lut;
+    int level, hrows, last = 0, status;
+    h->start = header_start(img);
+    if (header_rows(img.cols, img.rows - h->start, 0) == 0)
+        return WM_EINVAL;
+    lut = flippability_lut(3);
+    if (lut == NULL)
+        return WM_ENOLUT;
+    header_pack(h, buf);
+    for (level = 0; level < WM_HEADER_LEVELS; level++) {
+        hrows = header_rows(img.cols, img.rows - h->start, level);
+        if (hrows == 0)
+            break;
+        status = embed_strip(img, h->start, hrows, buf, opt, lut, 0);
+        if (status == WM_OK)
+            h->rows = h->start + hrows;
+        if (status != 1)
+            return status;
+        last = hrows;
+    }
+    //the speck rule never makes a page unembeddable
+    status = embed_strip(img, h->start, last, buf, opt, lut, 1);
+    if (status == WM_OK)
+        h->rows = h->start + last;
+    return status == 1 ? WM_ECAPACITY : status;
+}
+
+/**
+*Embeds the header so that its strip ends at row rows, the layout of
+*another page of the same size, if a strip of this page ends there
+*and takes the header without specks. The reader finds it as any
+*other, the smaller strips fail its magic.
+*\returns WM_OK, WM_ECAPACITY if the page has no such strip, or one
+*of the other WM_E* error codes.
+*/
+int embed_header_at(struct image img, struct wm_header *h,
+        const struct wm_options *opt, int rows) {
+    unsigned char buf[WM_HEADER_BYTES];
+    const float *lut;
+    int level, hrows, status;
+    h->start = header_start(img);
+    for (level = 0; level < WM_HEADER_LEVELS; level++) {
+        hrows = header_rows(img.cols, img.rows - h->start, level);
+        if (hrows == 0 || h->start + hrows >= rows)
+            break;
+    }
+    if (hrows == 0 || h->start + hrows != rows)
+        return WM_ECAPACITY;
+    lut = flippability_lut(3);
+    if (lut == NULL)
+        return WM_ENOLUT;
+    header_pack(h, buf);
+    status = embed_strip(img, h->start, hrows, buf, opt, lut, 0);
+    if (status == WM_OK)
+        h->rows = rows;
+    return status == 1 ? WM_ECAPACITY : status;
+}
+
+/**
+*Embeds the header in the hrows rows from start, scoring them on a
+*copy with the rows around them and a white frame, so every pixel
+*gets the score of its real neighborhood instead of the constant of
+*the borders of a view. The flips are written back only if none of
+*them is a speck, unless specks is set, and if the strip still holds
+*the first black row, so the reader finds the same start whatever
+*the payload rows below become.
+*\returns WM_OK if the strip was written, 1 if it would get specks,
+*move the start or lacks the pixels, or one of the WM_E* error codes.
+*/
+int embed_strip(struct image img, int start, int hrows,
+        const unsigned char *buf, const struct wm_options *opt,
+        const float *lut, int specks) {
+    struct image strip = img, canvas;
+    struct score_map map;
+    struct shuffle sh;
+    uint64_t *saved = NULL;
+    size_t words = (size_t)hrows * img.stride;
+    int *seq;
+    int window, r, c, i, k, pos, status;
+    strip.words = image_row(img, start);
+    strip.rows = hrows;
+    window = payload_window(strip, WM_HEADER_BYTES);
+    if (image_alloc(&canvas, img.cols + 2 * STRIP_HALO,
+            hrows + 2 * STRIP_HALO) != 0)
+        return WM_ENOMEM;
+    //canvas row r is image row start - STRIP_HALO + r, white out of it
+    for (r = 0; r < canvas.rows; r++) {
+        if (start - STRIP_HALO + r < 0 || start - STRIP_HALO + r >= img.rows)
+            continue;
+        for (c = 0; c < img.cols; c++) {
+            if (image_get(img, start - STRIP_HALO + r, c))
+                image_toggle(canvas, r, c + STRIP_HALO);
+        }
+    }
+    memset(&map, 0, sizeof(map));
+    seq = (int *)malloc(window * sizeof(int));
+    if (seq == NULL)
+        status = WM_ENOMEM;
+    else if (score_map_use(&map, opt->neighborhood) != 0)
+        status = WM_ENOLUT;
+    else if (score_map_build(&map, canvas, lut) != 0)
+        status = WM_ENOMEM;
+    else if (shuffle_open(&sh, img.cols * hrows, opt->seed ^ HEADER_SEED,
+            SHUFFLE_FEISTEL) != 0)
+        status = WM_EINVAL;
+    else {
+        status = WM_OK;
+        for (i = 0; i < HEADER_BITS && status == WM_OK; i++) {
+            //the windows of the strip, moved into the frame
+            for (k = 0; k < window; k++) {
+                pos = shuffle_at(&sh, i * window + k);
+                seq[k] = (pos / img.cols + STRIP_HALO) * canvas.cols +
+                    pos % img.cols + STRIP_HALO;
+            }
+            status = embed_bit(canvas, &map, seq, window,
+                    (buf[i >> 3] >> (i & 7)) & 1);
+        }
+        shuffle_close(&sh);
+        if (status == WM_ECAPACITY)
+            status = 1;
+    }
+    for (r = 0; r < hrows && status == WM_OK && !specks; r++) {
+        for (c = 0; c < img.cols; c++) {
+            if (image_get(canvas, r + STRIP_HALO, c + STRIP_HALO) !=
+                image_get(strip, r, c) && strip_speck(img, start + r, c)) {
+                status = 1;
+                break;
+            }
+        }
+    }
+    if (status == WM_OK) {
+        saved = (uint64_t *)malloc(words * sizeof(uint64_t));
+        if (saved == NULL)
+            status = WM_ENOMEM;
+        else
+            memcpy(saved, strip.words, words * sizeof(uint64_t));
+    }
+    for (r = 0; r < hrows && status == WM_OK; r++) {
+        for (c = 0; c < img.cols; c++) {
+            if (image_get(canvas, r + STRIP_HALO, c + STRIP_HALO) !=
+                image_get(strip, r, c))
+                image_toggle(strip, r, c);
+        }
+    }
+    if (status == WM_OK && (first_black_row(img) >= start + hrows ||
+            header_start(img) != start)) {
+        memcpy(strip.words, saved, words * sizeof(uint64_t));
+        status = 1;
+    }
+    score_map_free(&map);
+    free(saved);
+    free(seq);
+    image_free(&canvas);
+    return status;
+}
+
+/**
+*Whether flipping the pixel (r, c) of img would make a speck: all of
+*its 8 neighbors have its color, the pixels out of the image counting
+*as white. Such a pattern scores 0.
+*/
+int strip_speck(struct image img, int r, int c) {
+    int i, j, color = image_get(img, r, c);
+    for (i = r - 1; i <= r + 1; i++) {
+        for (j = c - 1; j <= c + 1; j++) {
+            if ((i >= 0 && i < img.rows && j >= 0 && j < img.cols ?
+                    image_get(img, i, j) : PBM_WHITE) != color)
+                return 0;
+        }
+    }
+    return 1;
+}
+
+/**
+*Decodes the header, the cost of which does not depend on the
+*payload, trying the strips from the smallest below the margin. An image that was not
+*watermarked, or with another seed, fails the magic or the checksum
+*of every one.
+*\param[in] opt The seed of the embedding.
+*\param[out] h The header, with the rows of its strip.
+*\returns WM_OK, WM_ENOHEADER if there is no valid header, or one of
+*the other WM_E* error codes.
+*/
+int read_header(struct image img, const struct wm_options *opt,
+        struct wm_header *h) {
+    int level, hrows, status, start = header_start(img);
+    for (level = 0; level < WM_HEADER_LEVELS; level++) {
+        hrows = header_rows(img.cols, img.rows - start, level);
+        if (hrows == 0)
+            break;
+        status = read_strip(img, start, hrows, opt, h);
+        if (status != WM_ENOHEADER)
+            return status;
+    }
+    return WM_ENOHEADER;
+}
+
+/**
+*Decodes the header of the strip of the hrows rows from start.
+*/
+int read_strip(struct image img, int start, int hrows,
+        const struct wm_options *opt, struct wm_header *h) {
+    struct image top, rest;
+    struct shuffle sh;
+    unsigned char buf[WM_HEADER_BYTES];
+    int window, status, *scratch;
+    h->rows = start + hrows;
+    if (header_split(img, h, &top, &rest) != 0)
+        return WM_ENOHEADER;
+    top.words = image_row(img, start);
+    top.rows = hrows;
+    window = payload_window(top, sizeof(buf));
+    scratch = (int *)malloc(window * sizeof(int));
+    if (scratch == NULL)
+        return WM_ENOMEM;
+    if (shuffle_open(&sh, top.cols * top.rows, opt->seed ^ HEADER_SEED,
+            SHUFFLE_FEISTEL) != 0) {
+        free(scratch);
+        return WM_ENOHEADER;
+    }
+    //the magic alone turns most strips down, at a sixth of the reads
+    status = extract_bytes(top, &sh, window, buf, 0, 4, scratch);
+    if (status == WM_OK && memcmp(buf, WM_HEADER_MAGIC, 4) != 0)
+        status = WM_ENOHEADER;
+    if (status == WM_OK)
+        status = extract_bytes(top, &sh, window, buf + 4, 4, sizeof(buf),
+                scratch);
+    shuffle_close(&sh);
+    free(scratch);
+    if (status != WM_OK)
+        return status;
+    if (header_unpack(buf, h) != 0 || h->start != start)
+        return WM_ENOHEADER;
+    //a length the payload rows cannot hold is no header either
+    if (h->length == 0 || payload_window(rest, h->length) <= 0)
+        return WM_ENOHEADER;
+    return WM_OK;
+}
+
+/**
+*Embeds a header describing the payload in the top rows and the
+*payload in the rows below. No trailer is needed to extract it.
+*\param[in] raw_length See header_init.
+*\returns WM_OK or one of the WM_E* error codes.
+*/
+int embed_with_header(struct image img, const void *payload, size_t bytes,
+        size_t raw_length, const struct wm_options *opt) {
+    struct image top, rest;
+    struct wm_header h;
+    int status;
+    if (bytes > UINT32_MAX || raw_length > UINT32_MAX)
+        return WM_EINVAL;
+    header_init(&h, payload, bytes, raw_length, opt);
+    //the strip the header settles in decides where the payload rows start
+    status = embed_header(img, &h, opt);
+    if (status != WM_OK)
+        return status;
+    header_split(img, &h, &top, &rest);
+    return embed_opt(rest, (void *)payload, bytes, opt);
+}
+
+/**
+*Replaces the payload of an image framed by embed_with_header with
+*another of the same size, in the mode the header records. The header
+*is rewritten by embed_header, through embed_strip and its speck rule,
+*and the payload through embed_update: only the windows whose bit
+*changed are flipped, in the payload rows below wherever the header
+*settles.
+*\param[in] raw_length See header_init.
+*\param[out] touched The windows flipped, may be NULL.
+*\returns WM_OK, WM_ENOHEADER if the image carries no header, WM_EINVAL
+*if the sizes differ, or one of the other WM_E* error codes.
+*/
+int update_with_header(struct image img, const void *payload, size_t bytes,
+        size_t raw_length, const struct wm_options *opt, long *touched) {
+    struct image top, rest;
+    struct wm_header h, now;
+    struct wm_options options = *opt;
+    unsigned char was[WM_HEADER_BYTES], buf[WM_HEADER_BYTES];
+    long n = 0, header_n = 0;
+    int i, status;
+    if (touched != NULL)
+        *touched = 0;
+    status = read_header(img, opt, &now);
+    if (status != WM_OK)
+        return status;
+    if (now.length != bytes || raw_length > UINT32_MAX)
+        return WM_EINVAL;
+    options.shuffle = now.mode;
+    options.neighborhood = now.neighborhood;
+    header_init(&h, payload, bytes, raw_length, &options);
+    status = embed_header(img, &h, &options);
+    if (status != WM_OK)
+        return status;
+    header_pack(&now, was);
+    header_pack(&h, buf);
+    for (i = 0; i < HEADER_BITS; i++)
+        header_n += ((was[i >> 3] ^ buf[i >> 3]) >> (i & 7)) & 1;
+    header_split(img, &h, &top, &rest);
+    status = embed_update(rest, NULL, payload, bytes, &options, &n);
+    if (touched != NULL)
+        *touched = n + header_n;
+    return status;
+}
+
+/**
+*Extracts the payload a header read by read_header describes and
+*checks it against the header checksum.
+*\param[out] payload Room for h->length bytes.
+*\param[in] opt The seed, threads and cache; the mode is the header's.
+*\returns WM_OK, WM_ECHECKSUM if the payload does not match, or one
+*of the other WM_E* error codes.
+*/
+int extract_with_header(struct image img, void *payload,
+        const struct wm_header *h, const struct wm_options *opt) {
+    struct image top, rest;
+    struct wm_options options = *opt;
+    int status;
+    if (header_split(img, h, &top, &rest) != 0)
+        return WM_ENOHEADER;
+    options.shuffle = h->mode;
+    status = extract_opt(rest, payload, h->length, &options);
+    return status == WM_OK ? header_check(h, payload) : status;
+}
+
+void header_pack(const struct wm_header *h, unsigned char *buf) {
+    memcpy(buf, WM_HEADER_MAGIC, 4);
+    buf[4] = (unsigned char)h->version;
+    buf[5] = (unsigned char)h->mode;
+    buf[6] = (unsigned char)h->neighborhood;
+    buf[7] = (unsigned char)(h->start / WM_HEADER_ALIGN);
+    put32(buf + 8, h->length);
+    put32(buf + 12, h->raw_length);
+    put32(buf + 16, h->crc);
+    put32(buf + 20, (uint32_t)crc32(crc32(0L, Z_NULL, 0), buf, 20));
+}
+
+/**
+*\returns 0, or -1 if the bytes are not a header this version reads.
+*/
+int header_unpack(const unsigned char *buf, struct wm_header *h) {
+    if (memcmp(buf, WM_HEADER_MAGIC, 4) != 0 ||
+        get32(buf + 20) != (uint32_t)crc32(crc32(0L, Z_NULL, 0), buf, 20))
+        return -1;
+    h->version = buf[4];
+    if (h->version != WM_HEADER_VERSION || buf[5] > SHUFFLE_BANDED)
+        return -1;
+    h->mode = (enum shuffle_mode)buf[5];
+    h->neighborhood = buf[6];
+    h->start = buf[7] * WM_HEADER_ALIGN;
+    h->length = get32(buf + 8);
+    h->raw_length = get32(buf + 12);
+    h->crc = get32(buf + 16);
+    return 0;
+}
+
+void put32(unsigned char *p, uint32_t v) {
+    p[0] = v & 0xff;
+    p[1] = (v >> 8) & 0xff;
+    p[2] = (v >> 16) & 0xff;
+    p[3] = v >> 24;
+}
+
+uint32_t get32(const unsigned char *p) {
+    return (uint32_t)p[0] | (uint32_t)p[1] << 8 | (uint32_t)p[2] << 16 |
+        (uint32_t)p[3] << 24;
+}
@@ -0,0 +1,55 @@
+#ifndef WM_HEADER_H
+#define WM_HEADER_H 1
+
+#include <stddef.h>
+#include <stdint.h>
+#include "bin_watermarking.h"
+
+#define WM_HEADER_MAGIC "FPWM"
+#define WM_HEADER_VERSION 1
+#define WM_HEADER_BYTES 24 //the size of the header once serialized
+#define WM_HEADER_WINDOW 32 //the fewest pixels of a header window
+#define WM_HEADER_LEVELS 6 //the header strips, each twice the one before
+#define WM_HEADER_ALIGN 16 //the strip starts on a multiple of these rows
+#define WM_HEADER_MAX_START (255 * WM_HEADER_ALIGN) //fits the start byte
+
+/**
+*The header embedded in the top rows of the image, see
+*embed_with_header. It tells the authentication everything the
+*trailer comment used to, and whether there is a watermark at all.
+*Serialized little endian: the magic, the version, the shuffle mode,
+*the neighborhood, start / WM_HEADER_ALIGN, length, raw_length, crc
+*and the CRC-32 of the 20 bytes before it.
+*/
+struct wm_header {
+    int version;
+    enum shuffle_mode mode; //the layout of the payload
+    int neighborhood;
+    uint32_t length; //the embedded payload bytes
+    uint32_t raw_length; //the payload before compression, 0 if unknown
+    uint32_t crc; //the CRC-32 of the embedded payload
+    int start; //the first row of the header strip, below the blank margin
+    int rows; //the rows above the payload, margin and strip, not serialized
+};
+
+void header_init(struct wm_header *h, const void *payload, size_t bytes,
+        size_t raw_length, const struct wm_options *opt);
+int header_check(const struct wm_header *h, const void *payload);
+int header_rows(int cols, int rows, int level);
+int header_start(struct image img);
+int header_split(struct image img, const struct wm_header *h,
+        struct image *top, struct image *rest);
+int embed_header(struct image img, struct wm_header *h,
+        const struct wm_options *opt);
+int embed_header_at(struct image img, struct wm_header *h,
+        const struct wm_options *opt, int rows);
+int read_header(struct image img, const struct wm_options *opt,
+        struct wm_header *h);
+int embed_with_header(struct image img, const void *payload, size_t bytes,
+        size_t raw_length, const struct wm_options *opt);
+int update_with_header(struct image img, const void *payload, size_t bytes,
+        size_t raw_length, const struct wm_options *opt, long *touched);
+int extract_with_header(struct image img, void *payload,
+        const struct wm_header *h, const struct wm_options *opt);
+
+#endif